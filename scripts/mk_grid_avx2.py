@@ -149,20 +149,16 @@ def sum_row(ind, grid_ptr, kern_vars, suff=""):
     # sums we are going to keep
     terms = kernel_size * double_complex_size // register_size
     sum_vars = [ f"sum{suff}{s}" for s in range(min(terms, parallel_sums)) ]
-    flops = 0
     for s, (svar, kvar) in enumerate(zip(sum_vars, kern_vars)):
         off = s * register_size // double_size
         emit(f"{ind}__m256d {svar} = _mm256_mul_pd({kvar}, _mm256_loadu_pd({grid_ptr}+{off}));")
-        flops += register_size // double_size
     # Cover remaining row
     for o in range(parallel_sums, terms, parallel_sums):
         for s, (svar, kvar) in enumerate(zip(sum_vars, kern_vars[o:])):
             off = (s+o) * register_size // double_size
             emit(f"{ind}{svar} = _mm256_fmadd_pd({kvar}, _mm256_loadu_pd({grid_ptr}+{off}), {svar});");
-            flops += 2 * register_size // double_size
     # Generate sum term to return
-    flops += (len(sum_vars) - 1) * register_size // double_size
-    return "+".join(sum_vars), flops
+    return "+".join(sum_vars)
 
 kernel_y_reg_cache = False
 def sum_row_group(ind, grid_ptr, y_expr, suff=""):
@@ -179,7 +175,6 @@ def sum_row_group(ind, grid_ptr, y_expr, suff=""):
         emit(f"{ind}__m256d kerny{suff} = {kern_y_expr};")
         kern_y_expr = f"kerny{suff}"
 
-    flops_sum = 0
     for u in range(register_size // double_size):
         # Get pointer to grid row
         emit(f"{ind}double *pgrid{suff}{u} = (double *)(current_grid + ({y_expr}+{u})*grid_stride);")
@@ -188,19 +183,15 @@ def sum_row_group(ind, grid_ptr, y_expr, suff=""):
         permut = make_permute(u,u,u,u)
         emit(f"{ind}__m256d ky{suff}{u} = _mm256_permute4x64_pd({kern_y_expr},{permut});")
         # Generate sum over row, multipy/add into visibility accumulator
-        sum_term, flops = sum_row(ind, f"pgrid{suff}{u}", kern_x_vars, suff=suff+str(u))
+        sum_term = sum_row(ind, f"pgrid{suff}{u}", kern_x_vars, suff=suff+str(u))
         emit(f"{ind}vis = _mm256_fmadd_pd({sum_term}, ky{suff}{u}, vis);")
-        flops_sum += flops + 2 * register_size // double_size
-
-    return flops_sum
 
 # Now loop over rows. This can be done either as a loop over
 # groups, or unrolled entirely
 if unroll_y_loop:
-    flops_sum = 0
     emit(f"""    __m256d vis = _mm256_setzero_pd();""")
     for y in range(0, kernel_size, register_size // double_size):
-        flops_sum += sum_row_group("    ", "current_grid", str(y), suff=str(y))
+        sum_row_group("    ", "current_grid", str(y), suff=str(y))
 
 else:
     # Generate inner loop, unrolled so we can load as many values of the
@@ -210,10 +201,9 @@ else:
     int y;
     for (y = 0; y < {kernel_size}; y += {register_size // double_size}) {{""")
 
-    flops_sum = sum_row_group("        ", "current_grid", "y")
+    sum_row_group("        ", "current_grid", "y")
 
     emit(f"    }}")
-    flops_sum *= register_size // double_size
 
 # Copy next kernel
 load_kernel_dup("    ", "next_kernel_x", kern_x_vars)
@@ -222,8 +212,11 @@ if kernel_y_load:
 else:
     copy_kernel("    ", "next_kernel_y", "kern_y_cache")
 
-# Store visibility and conjugate. We don't count this floating point
-# operations, it's overhead strictly speaking.
+# Store visibility and conjugate. We report the same nominal number
+# of floating point operations as degrid_conv_uv, so rates are
+# comparable between kernels (the final reduction is overhead,
+# strictly speaking).
+flops_sum = 4 * (1 + kernel_size) * kernel_size
 emit(f"""    __m128d vis_out = _mm256_extractf128_pd(vis, 0) + _mm256_extractf128_pd(vis, 1);
     _mm_store_pd((double *)pvis, _mm_xor_pd(vis_out, conj_mask));
 }}
@@ -0,0 +1,146 @@
+
+
+import sys
+import os
+import re
+
+if len(sys.argv) != 2:
+    print("Please supply an outpuf file name!", file=sys.stderr)
+    exit(1)
+
+# Extract desired kernel size from file name
+out_fname = sys.argv[1]
+kernel_size = int(re.search('([0-9]+)\.', os.path.basename(out_fname))[1])
+
+
+# Architecture assumptions (bytes)
+double_size = 8
+double_complex_size = 16
+register_size = 64
+cache_line_size = 64
+sse_align = 16
+avx_align = 32
+
+# Number of rows we accumulate in parallel. Every row has its own set
+# of sums (one per register in a row), so this multiplies the number
+# of independent FMA chains.
+parallel_rows = 2
+
+# Needs to be in sync with assumption in load_sep_kern!
+kernel_stride = avx_align * ((kernel_size * double_size + avx_align - 1) // avx_align) // double_size
+
+# Complex values per register, registers needed for a grid row. The
+# last register might be partially filled, in which case we mask it.
+complex_per_reg = register_size // double_complex_size
+row_regs = (kernel_size + complex_per_reg - 1) // complex_per_reg
+tail_complex = kernel_size - (row_regs - 1) * complex_per_reg
+tail_mask = (1 << (2 * tail_complex)) - 1
+
+# Open the file
+out_file = open(out_fname, "w")
+def emit(*args, **kwargs):
+    print(*args, **kwargs, file=out_file)
+
+# Generate prelude. We assume that conjugation can be achieved using
+# an "xor" operation (we essentially just flip a sign).
+emit(f"""
+
+// THIS IS A GENERATED FILE!
+
+assert(kernel->size == {kernel_size});
+assert(kernel->stride == {kernel_stride});
+assert((uintptr_t)kernel->data % {avx_align} == 0);
+assert((uintptr_t)pvis % {sse_align} == 0);
+
+const int oversample = kernel->oversampling;
+__m128d conj_mask = conjugate ? _mm_xor_pd(_mm_set_pd(-1, 1), _mm_set_pd(1, 1)) : _mm_set_pd(0., 0.);
+const __m512i dup_idx = _mm512_set_epi64(3, 3, 2, 2, 1, 1, 0, 0);
+
+// Calculate grid and sub-grid coordinates
+int grid_offset, sub_offset_x, sub_offset_y;
+frac_coord_sep_uv(grid_size, grid_stride, {kernel_size}, {kernel_stride}, oversample,
+                  theta, u, v,
+                  &grid_offset, &sub_offset_x, &sub_offset_y);
+complex double *next_grid = uvgrid + grid_offset;
+double *next_kernel_x = kernel->data + sub_offset_x;
+double *next_kernel_y = kernel->data + sub_offset_y;""")
+
+def reg_mask(r):
+    """Mask for register r of a row, or None if it is fully used"""
+    if r == row_regs - 1 and tail_mask != 0xff:
+        return f"0x{tail_mask:02x}"
+    return None
+
+def load_grid(ptr, r):
+    off = r * register_size // double_size
+    mask = reg_mask(r)
+    if mask is None:
+        return f"_mm512_loadu_pd({ptr}+{off})"
+    return f"_mm512_maskz_loadu_pd({mask}, {ptr}+{off})"
+
+# Now generate loop over visibilities
+emit(f"""
+for (; i < i1; i++, u += du, v += dv, pvis++) {{
+
+    complex double *current_grid = next_grid;
+    const double *kernel_x = next_kernel_x;
+    const double *kernel_y = next_kernel_y;
+
+    int grid_offset, sub_offset_x, sub_offset_y;
+    frac_coord_sep_uv(grid_size, grid_stride, {kernel_size}, {kernel_stride}, oversample,
+                      theta, u+du, v+dv,
+                      &grid_offset, &sub_offset_x, &sub_offset_y);
+    next_grid = uvgrid + grid_offset;
+    next_kernel_x = kernel->data + sub_offset_x;
+    next_kernel_y = kernel->data + sub_offset_y;""")
+
+# Prefetch kernel for next visibility
+def prefetch_kernel(ind, ptr):
+    for s in range((kernel_size * double_size + cache_line_size - 1) // cache_line_size):
+        off = s * cache_line_size // double_size
+        emit(f"{ind}_mm_prefetch({ptr}+{off}, _MM_HINT_T0);")
+prefetch_kernel("    ", "next_kernel_x")
+prefetch_kernel("    ", "next_kernel_y")
+
+# Accumulate rows weighted by the y-kernel. Separate sums for every
+# register of a row and group of rows, so we have
+# row_regs*parallel_rows independent FMA chains.
+sums_used = set()
+for y in range(kernel_size):
+    p = y % parallel_rows
+    emit(f"    const double *pgrid{y} = (const double *)(current_grid + {y}*grid_stride);")
+    emit(f"    __m512d ky{y} = _mm512_set1_pd(kernel_y[{y}]);")
+    for r in range(row_regs):
+        svar = f"sum{p}_{r}"
+        if svar not in sums_used:
+            emit(f"    __m512d {svar} = _mm512_mul_pd(ky{y}, {load_grid(f'pgrid{y}', r)});")
+            sums_used.add(svar)
+        else:
+            emit(f"    {svar} = _mm512_fmadd_pd(ky{y}, {load_grid(f'pgrid{y}', r)}, {svar});")
+
+# Apply x-kernel. We duplicate every kernel value so it applies to
+# both real and imaginary part, zeroing values past the kernel size.
+for r in range(row_regs):
+    off = r * register_size // double_complex_size
+    mask = reg_mask(r)
+    load = f"_mm512_castpd256_pd512(_mm256_load_pd(kernel_x+{off}))"
+    if mask is None:
+        emit(f"    __m512d kx{r} = _mm512_permutexvar_pd(dup_idx, {load});")
+    else:
+        emit(f"    __m512d kx{r} = _mm512_maskz_permutexvar_pd({mask}, dup_idx, {load});")
+    sums = [f"sum{p}_{r}" for p in range(parallel_rows) if f"sum{p}_{r}" in sums_used]
+    if r == 0:
+        emit(f"    __m512d vis = _mm512_mul_pd(kx{r}, {'+'.join(sums)});")
+    else:
+        emit(f"    vis = _mm512_fmadd_pd(kx{r}, {'+'.join(sums)}, vis);")
+
+# Store visibility and conjugate. We report the same nominal number
+# of floating point operations as degrid_conv_uv, so rates are
+# comparable between kernels (masked lanes and the final reduction
+# are overhead, strictly speaking).
+flops_sum = 4 * (1 + kernel_size) * kernel_size
+emit(f"""    __m256d vis2 = _mm512_castpd512_pd256(vis) + _mm512_extractf64x4_pd(vis, 1);
+    __m128d vis_out = _mm256_castpd256_pd128(vis2) + _mm256_extractf128_pd(vis2, 1);
+    _mm_store_pd((double *)pvis, _mm_xor_pd(vis_out, conj_mask));
+}}
+*flops += {flops_sum} * (i1 - i0);""")
@@ -0,0 +1,179 @@
+
+
+import sys
+import os
+import re
+
+if len(sys.argv) != 2:
+    print("Please supply an outpuf file name!", file=sys.stderr)
+    exit(1)
+
+# Extract desired instruction set and kernel size from file name
+# (e.g. "grid_f32_avx512_16.c")
+out_fname = sys.argv[1]
+match = re.search('_(avx2|avx512)_([0-9]+)\.', os.path.basename(out_fname))
+isa = match[1]
+kernel_size = int(match[2])
+
+# Architecture assumptions (bytes)
+float_size = 4
+float_complex_size = 8
+register_size = 64 if isa == "avx512" else 32
+cache_line_size = 64
+sse_align = 16
+avx_align = 32
+
+# Number of rows we accumulate in parallel. Every row has its own set
+# of sums (one per register in a row), so this multiplies the number
+# of independent FMA chains.
+parallel_rows = 2
+
+# Needs to be in sync with assumption in sep_kern_make_float!
+kernel_stride = avx_align * ((kernel_size * float_size + avx_align - 1) // avx_align) // float_size
+
+# Complex values per register, registers needed for a grid row. The
+# last register might be partially filled, in which case we mask it.
+floats_per_reg = register_size // float_size
+complex_per_reg = register_size // float_complex_size
+row_regs = (kernel_size + complex_per_reg - 1) // complex_per_reg
+tail_floats = 2 * (kernel_size - (row_regs - 1) * complex_per_reg)
+
+# Instruction set specifics
+if isa == "avx512":
+    vec = "__m512"
+    pfx = "_mm512"
+    dup_idx = ", ".join(str(i // 2) for i in reversed(range(floats_per_reg)))
+    dup_decl = f"const __m512i dup_idx = _mm512_set_epi32({dup_idx});"
+    tail_decl = f"const __mmask16 tail_mask = 0x{(1 << tail_floats) - 1:04x};"
+    def load_half_kernel(ptr):
+        return f"_mm512_castps256_ps512(_mm256_load_ps({ptr}))"
+    def dup(x, tail):
+        if tail:
+            return f"_mm512_maskz_permutexvar_ps(tail_mask, dup_idx, {x})"
+        return f"_mm512_permutexvar_ps(dup_idx, {x})"
+    def load_grid(ptr, tail):
+        if tail:
+            return f"_mm512_maskz_loadu_ps(tail_mask, {ptr})"
+        return f"_mm512_loadu_ps({ptr})"
+    def reduce_256(x):
+        return (f"_mm512_castps512_ps256({x}) + "
+                f"_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd({x}), 1))")
+else:
+    vec = "__m256"
+    pfx = "_mm256"
+    dup_idx = ", ".join(str(i // 2) for i in reversed(range(floats_per_reg)))
+    dup_decl = f"const __m256i dup_idx = _mm256_set_epi32({dup_idx});"
+    tail_bits = ", ".join("-1" if i < tail_floats else "0" for i in reversed(range(floats_per_reg)))
+    tail_decl = f"const __m256i tail_mask = _mm256_set_epi32({tail_bits});"
+    def load_half_kernel(ptr):
+        return f"_mm256_castps128_ps256(_mm_load_ps({ptr}))"
+    def dup(x, tail):
+        if tail:
+            return f"_mm256_and_ps(_mm256_castsi256_ps(tail_mask), _mm256_permutevar8x32_ps({x}, dup_idx))"
+        return f"_mm256_permutevar8x32_ps({x}, dup_idx)"
+    def load_grid(ptr, tail):
+        if tail:
+            return f"_mm256_maskload_ps({ptr}, tail_mask)"
+        return f"_mm256_loadu_ps({ptr})"
+    def reduce_256(x):
+        return x
+
+def is_tail(r):
+    return r == row_regs - 1 and tail_floats != floats_per_reg
+if not is_tail(row_regs - 1):
+    tail_decl = ""
+
+# Open the file
+out_file = open(out_fname, "w")
+def emit(*args, **kwargs):
+    print(*args, **kwargs, file=out_file)
+
+# Generate prelude. We assume that conjugation can be achieved using
+# an "xor" operation (we essentially just flip a sign).
+emit(f"""
+
+// THIS IS A GENERATED FILE!
+
+assert(kernel->size == {kernel_size});
+assert(kernel->stride_f == {kernel_stride});
+assert((uintptr_t)kernel->data_f % {avx_align} == 0);
+assert((uintptr_t)pvis % {sse_align} == 0);
+
+const int oversample = kernel->oversampling;
+__m128d conj_mask = conjugate ? _mm_xor_pd(_mm_set_pd(-1, 1), _mm_set_pd(1, 1)) : _mm_set_pd(0., 0.);
+{dup_decl}
+{tail_decl}
+
+// Calculate grid and sub-grid coordinates
+int grid_offset, sub_offset_x, sub_offset_y;
+frac_coord_sep_uv(grid_size, grid_stride, {kernel_size}, {kernel_stride}, oversample,
+                  theta, u, v,
+                  &grid_offset, &sub_offset_x, &sub_offset_y);
+complex float *next_grid = uvgrid + grid_offset;
+float *next_kernel_x = kernel->data_f + sub_offset_x;
+float *next_kernel_y = kernel->data_f + sub_offset_y;""")
+
+# Now generate loop over visibilities
+emit(f"""
+for (; i < i1; i++, u += du, v += dv, pvis++) {{
+
+    complex float *current_grid = next_grid;
+    const float *kernel_x = next_kernel_x;
+    const float *kernel_y = next_kernel_y;
+
+    int grid_offset, sub_offset_x, sub_offset_y;
+    frac_coord_sep_uv(grid_size, grid_stride, {kernel_size}, {kernel_stride}, oversample,
+                      theta, u+du, v+dv,
+                      &grid_offset, &sub_offset_x, &sub_offset_y);
+    next_grid = uvgrid + grid_offset;
+    next_kernel_x = kernel->data_f + sub_offset_x;
+    next_kernel_y = kernel->data_f + sub_offset_y;""")
+
+# Prefetch kernel for next visibility
+def prefetch_kernel(ind, ptr):
+    for s in range((kernel_size * float_size + cache_line_size - 1) // cache_line_size):
+        off = s * cache_line_size // float_size
+        emit(f"{ind}_mm_prefetch({ptr}+{off}, _MM_HINT_T0);")
+prefetch_kernel("    ", "next_kernel_x")
+prefetch_kernel("    ", "next_kernel_y")
+
+# Accumulate rows weighted by the y-kernel. Separate sums for every
+# register of a row and group of rows, so we have
+# row_regs*parallel_rows independent FMA chains.
+sums_used = set()
+for y in range(kernel_size):
+    p = y % parallel_rows
+    emit(f"    const float *pgrid{y} = (const float *)(current_grid + {y}*grid_stride);")
+    emit(f"    {vec} ky{y} = {pfx}_set1_ps(kernel_y[{y}]);")
+    for r in range(row_regs):
+        svar = f"sum{p}_{r}"
+        load = load_grid(f"pgrid{y}+{r * floats_per_reg}", is_tail(r))
+        if svar not in sums_used:
+            emit(f"    {vec} {svar} = {pfx}_mul_ps(ky{y}, {load});")
+            sums_used.add(svar)
+        else:
+            emit(f"    {svar} = {pfx}_fmadd_ps(ky{y}, {load}, {svar});")
+
+# Apply x-kernel. We duplicate every kernel value so it applies to
+# both real and imaginary part, zeroing values past the kernel size.
+for r in range(row_regs):
+    off = r * complex_per_reg
+    emit(f"    {vec} kx{r} = {dup(load_half_kernel(f'kernel_x+{off}'), is_tail(r))};")
+    sums = [f"sum{p}_{r}" for p in range(parallel_rows) if f"sum{p}_{r}" in sums_used]
+    if r == 0:
+        emit(f"    {vec} vis = {pfx}_mul_ps(kx{r}, {'+'.join(sums)});")
+    else:
+        emit(f"    vis = {pfx}_fmadd_ps(kx{r}, {'+'.join(sums)}, vis);")
+
+# Sum up, convert to double precision, store visibility and
+# conjugate. We report the same nominal number of floating point
+# operations as degrid_conv_uv, so rates are comparable between
+# kernels (masked lanes and the final reduction are overhead,
+# strictly speaking).
+flops_sum = 4 * (1 + kernel_size) * kernel_size
+emit(f"""    __m256 vis2 = {reduce_256("vis")};
+    __m128 vis1 = _mm256_castps256_ps128(vis2) + _mm256_extractf128_ps(vis2, 1);
+    __m128d vis_out = _mm_cvtps_pd(vis1 + _mm_movehl_ps(vis1, vis1));
+    _mm_store_pd((double *)pvis, _mm_xor_pd(vis_out, conj_mask));
+}}
+*flops += {flops_sum} * (i1 - i0);""")
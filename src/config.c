@@ -1,6 +1,7 @@
 
 #include "grid.h"
 #include "config.h"
+#include "pool.h"
 
 #include <hdf5.h>
 #include <stdlib.h>
@@ -212,6 +213,7 @@ static void collect_work(struct vis_spec *spec, struct bl_data *bl_data,
             struct subgrid_work_bl *wbl = (struct subgrid_work_bl *)
                 malloc(sizeof(struct subgrid_work_bl));
             wbl->a1 = a1; wbl->a2 = a2; wbl->chunks=chunks;
+            wbl->iw = iw - nwlevels/2;
             wbl->next = pos;
             wbl->min_w = min_w;
             /* wbl->sg_min_u = sg_min[0]; */
@@ -359,9 +361,30 @@ static bool generate_subgrid_work_assignment(struct work_config *cfg)
                       &nbl, &bls, &nsubgrid, &nwlevels);
     printf(" %g s\n", get_time_ns() - start);
 
+    // With w-towers, streamers derive all w-levels of a subgrid from
+    // the one at w=0. Therefore move all baselines there, in order of
+    // w-level so they get worked on one w-level at a time.
+    int iu, iv, iw;
+    if (cfg->vis_wtowers) {
+        for (iv = 0; iv < nsubgrid; iv++) {
+            for (iu = 0; iu < nsubgrid; iu++) {
+                int ix0 = (nwlevels/2) * nsubgrid*nsubgrid + iv * nsubgrid + iu;
+                struct subgrid_work_bl *tower = NULL, **last = &tower;
+                int nbl_tower = 0;
+                for (iw = 0; iw < nwlevels; iw++) {
+                    int ix = iw * nsubgrid*nsubgrid + iv * nsubgrid + iu;
+                    *last = bls[ix];
+                    while (*last) last = &(*last)->next;
+                    nbl_tower += nbl[ix];
+                    bls[ix] = NULL; nbl[ix] = 0;
+                }
+                bls[ix0] = tower; nbl[ix0] = nbl_tower;
+            }
+        }
+    }
+
     // Count how many sub-grids actually have visibilities
     int npop = 0, nbl_total = 0, nbl_max = 0;
-    int iu, iv, iw;
     for (iw = 0; iw < nwlevels; iw++) {
         for (iv = 0; iv < nsubgrid; iv++) {
             for (iu = 0; iu < nsubgrid; iu++) {
@@ -641,24 +664,41 @@ void config_init(struct work_config *cfg)
     memset(cfg, 0, sizeof(*cfg));
     cfg->gridder.x0 = 0.5;
     cfg->w_gridder.x0 = 0.5;
+    cfg->sg_step_w = 1;
     cfg->config_dump_baseline_bins = false;
     cfg->config_dump_subgrid_work = false;
     cfg->produce_parallel_cols = false;
     cfg->produce_retain_bf = true;
     cfg->produce_batch_rows = 16;
     cfg->produce_queue_length = 4;
+    cfg->produce_fill_threads = 0;
+    cfg->produce_real_facets = false;
     cfg->vis_skip_metadata = true;
     cfg->vis_bls_per_task = 256;
     cfg->vis_subgrid_queue_length = 256;
     cfg->vis_task_queue_length = 96;
     cfg->vis_chunk_queue_length = 4096;
+    cfg->vis_backend = VIS_BACKEND_HDF5;
+    cfg->aggregator_workers = 0;
     cfg->vis_writer_count = 2;
+    cfg->vis_writer_routing = WRITER_ROUTE_BASELINE;
+    cfg->vis_writer_cache = 0;
+    cfg->vis_writer_ds_cache = 256;
+    cfg->vis_writer_direct_chunks = false;
+    cfg->vis_shared_file = VIS_SHARED_OFF;
+    cfg->vis_layout = VIS_LAYOUT_GROUPS;
+    cfg->vis_hdf5_profile = HDF5_PROFILE_DEFAULT;
+    cfg->vis_hdf5_align = 1024;
+    cfg->vis_writer_uring_depth = 0;
     cfg->vis_fork_writer = false;
     cfg->vis_check_existing = false;
     cfg->vis_checks = 16384;
     cfg->grid_checks = 4096;
     cfg->vis_max_error = 1;
     cfg->vis_round_to_wplane = false;
+    cfg->vis_degrid_single = false;
+    cfg->vis_wtowers = false;
+    cfg->vis_pool_pages = POOL_PAGES_DEFAULT;
 
     cfg->statsd_socket = -1;
     cfg->statsd_rate = 1;
@@ -701,6 +741,7 @@ void config_free(struct work_config *cfg)
     free(cfg->vis_path);
     free(cfg->facet_work);
     free(cfg->gridder.data); cfg->gridder.data = NULL;
+    free(cfg->gridder.data_f); cfg->gridder.data_f = NULL;
     free(cfg->gridder.corr); cfg->gridder.corr = NULL;
     free(cfg->w_gridder.data); cfg->w_gridder.data = NULL;
     free(cfg->w_gridder.corr); cfg->w_gridder.corr = NULL;
@@ -771,7 +812,10 @@ void config_set_visibilities(struct work_config *cfg,
     // Calculate uvw cube split
     assert(cfg->recombine.image_size != 0); // Must be set previously
     cfg->sg_step = cfg->recombine.xA_size;
-    cfg->sg_step_w = 1;
+    if (!cfg->w_gridder.data) {
+        // Without w-kernel subgrids can only cover a single w-plane
+        cfg->sg_step_w = 1;
+    }
 
     // Cache cosinus + sinus values
     cfg->spec.ha_sin = (double *)malloc(sizeof(double) * cfg->spec.time_count);
@@ -804,7 +848,7 @@ bool config_set_degrid(struct work_config *cfg, const char *gridder_path,
     if (gridder_path) {
 
         // Clear existing data, if any
-        free(cfg->gridder.data); free(cfg->gridder.corr);
+        free(cfg->gridder.data); free(cfg->gridder.data_f); free(cfg->gridder.corr);
         memset(&cfg->gridder, 0, sizeof(struct sep_kernel_data));
 
         // Load gridder
@@ -855,6 +899,30 @@ bool config_set_degrid(struct work_config *cfg, const char *gridder_path,
     return true;
 }
 
+bool config_set_w_degrid(struct work_config *cfg,
+                         const char *w_gridder_path, int sg_step_w)
+{
+
+    // Clear existing data, if any
+    free(cfg->w_gridder.data); free(cfg->w_gridder.corr);
+    memset(&cfg->w_gridder, 0, sizeof(struct sep_kernel_data));
+    cfg->w_gridder.x0 = 0.5;
+
+    // Load w-gridder. Its correction gets applied to sources.
+    if (load_sep_kern(w_gridder_path, &cfg->w_gridder, true)) {
+        return false;
+    }
+
+    // Number of w-planes a subgrid spans
+    if (sg_step_w < 1) {
+        fprintf(stderr, "ERROR: Invalid subgrid w-step %d!\n", sg_step_w);
+        return false;
+    }
+    cfg->sg_step_w = sg_step_w;
+
+    return true;
+}
+
 bool config_set_statsd(struct work_config *cfg,
                        const char *node, const char *service)
 {
@@ -1035,32 +1103,60 @@ void config_set_sources(struct work_config *cfg, int count, unsigned int seed)
         } else {
             cfg->source_corr[i] = 1;
         }
+        // Same for w-gridder. The phase difference between w-planes
+        // is wstep*n, interpolate linearly between correction points.
+        if (cfg->w_gridder.corr) {
+            const int ncorr = cfg->w_gridder.corr_size;
+            double j = fmod(cfg->wstep * n * ncorr + ncorr, ncorr);
+            int j0 = (int)floor(j) % ncorr, j1 = (j0 + 1) % ncorr;
+            double w = j - floor(j);
+            cfg->source_corr[i] *=
+                (1 - w) * cfg->w_gridder.corr[j0] + w * cfg->w_gridder.corr[j1];
+            assert(cfg->source_corr[i] != 0);
+        }
     }
 
 }
 
-bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
+// Determine baselines a visibility file should hold: The ones covered
+// by the worker, or all of them if worker < 0. Files of aggregators
+// only hold baselines routed to them (see aggregator).
+static bool *_file_baselines(struct work_config *work_cfg, int worker, int aggregator)
 {
-    struct vis_spec *spec = &work_cfg->spec;
-    struct ant_config *cfg = spec->cfg;
-
-    // Map baselines to work
-    struct subgrid_work **bl_work = NULL;
+    const int nant = work_cfg->spec.cfg->ant_count;
+    bool *bls = (bool *)calloc(sizeof(bool), nant * nant);
+    if (!bls)
+        return NULL;
+    int a1, a2;
     if (worker >= 0) {
-        bl_work = (struct subgrid_work **)
-            calloc(sizeof(struct subgrid_work *), cfg->ant_count * cfg->ant_count);
         struct subgrid_work *work = work_cfg->subgrid_work + worker * work_cfg->subgrid_max_work;
         int iwork;
         for (iwork = 0; iwork < work_cfg->subgrid_max_work; iwork++) {
-            if (work[iwork].nbl == 0) continue;
             struct subgrid_work_bl *bl;
-            for (bl = work[iwork].bls; bl; bl = bl->next) {
-                // Note this might overlap (here: overwrite). We are just
-                // interested in an example below.
-                bl_work[bl->a1 * cfg->ant_count + bl->a2] = &work[iwork];
-            }
+            for (bl = work[iwork].bls; bl; bl = bl->next)
+                bls[bl->a1 * nant + bl->a2] = true;
         }
+    } else {
+        for (a1 = 0; a1 < nant; a1++)
+            for (a2 = a1+1; a2 < nant; a2++)
+                bls[a1 * nant + a2] = true;
     }
+    if (aggregator >= 0)
+        for (a1 = 0; a1 < nant * nant; a1++)
+            if (bls[a1] && config_baseline_aggregator(work_cfg, a1 / nant, a1 % nant) != aggregator)
+                bls[a1] = false;
+    return bls;
+}
+
+bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker, int aggregator)
+{
+    struct vis_spec *spec = &work_cfg->spec;
+    struct ant_config *cfg = spec->cfg;
+
+    // Determine baselines to create
+    bool *bls = _file_baselines(work_cfg, worker, aggregator);
+    if (!bls)
+        return false;
 
     int a1, a2;
     int ncreated = 0;
@@ -1072,10 +1168,8 @@ bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
 
         hid_t a1_g = 0;
         for (a2 = a1+1; a2 < cfg->ant_count; a2++) {
-            if (bl_work) {
-                struct subgrid_work *bw = bl_work[a1 * cfg->ant_count + a2];
-                if (!bw) continue;
-            }
+            if (!bls[a1 * cfg->ant_count + a2])
+                continue;
 
             // Create outer antenna group, if not already done so
             if (!a1_g) {
@@ -1084,6 +1178,7 @@ bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
                 a1_g = H5Gcreate(vis_group, a1name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
                 if (a1_g < 0) {
                     fprintf(stderr, "Could not open '%s' antenna group!\n", a1name);
+                    free(bls);
                     return false;
                 }
             }
@@ -1095,6 +1190,7 @@ bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
             if (a2_g < 0) {
                 fprintf(stderr, "Could not open '%s' antenna group!\n", a2name);
                 H5Gclose(a1_g);
+                free(bls);
                 return false;
             }
 
@@ -1104,8 +1200,11 @@ bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
 
             // Write to visibility group
             if (!create_vis_group(a2_g, spec->freq_chunk, spec->time_chunk,
-                                  work_cfg->vis_skip_metadata, &bl)) {
+                                  work_cfg->vis_skip_metadata,
+                                  work_cfg->vis_shared_file != VIS_SHARED_OFF,
+                                  work_cfg->vis_hdf5_profile, &bl)) {
                 H5Gclose(a2_g); H5Gclose(a1_g);
+                free(bls);
                 return 1;
             }
 
@@ -1121,5 +1220,46 @@ bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker)
     printf("\ndone in %.2fs, %d groups for up to %"PRIu64" visibilities (~%.3f GB) created\n",
            get_time_ns() -create_start, ncreated, nvis, 16. * nvis / 1000000000);
 
+    free(bls);
     return true;
 }
+
+bool create_bl_table(hid_t vis_group, struct work_config *work_cfg, int worker, int aggregator)
+{
+    struct vis_spec *spec = &work_cfg->spec;
+    const int nant = spec->cfg->ant_count;
+
+    // Collect antenna pairs of baselines to create
+    bool *bls = _file_baselines(work_cfg, worker, aggregator);
+    int *antennas = (int *)malloc(sizeof(int) * 2 * nant * nant);
+    if (!bls || !antennas) {
+        free(bls); free(antennas);
+        return false;
+    }
+    int a1, a2, bl_count = 0;
+    for (a1 = 0; a1 < nant; a1++)
+        for (a2 = a1+1; a2 < nant; a2++)
+            if (bls[a1 * nant + a2]) {
+                antennas[2*bl_count] = a1;
+                antennas[2*bl_count+1] = a2;
+                bl_count++;
+            }
+    free(bls);
+
+    // Create table and dataset. Time and frequency metadata are the
+    // same for all baselines.
+    double create_start = get_time_ns();
+    struct bl_data bl;
+    vis_spec_to_bl_data(&bl, spec, 0, 1);
+    bool success = create_vis_table(vis_group, spec->freq_chunk, spec->time_chunk,
+                                    work_cfg->vis_skip_metadata, work_cfg->vis_hdf5_profile,
+                                    &bl, bl_count, antennas);
+    const uint64_t nvis = (uint64_t)bl_count * bl.time_count * bl.freq_count;
+    free(bl.time); free(bl.uvw_m); free(bl.freq);
+    free(antennas);
+
+    if (success)
+        printf("\ndone in %.2fs, table of %d baselines for up to %"PRIu64" visibilities (~%.3f GB) created\n",
+               get_time_ns() - create_start, bl_count, nvis, 16. * nvis / 1000000000);
+    return success;
+}
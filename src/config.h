@@ -44,6 +44,7 @@ struct subgrid_work_bl
 {
     int a1, a2; // Baseline antennas
     int chunks; // Number of (time,frequency) chunks overlapping
+    int iw; // w-level (can differ from subgrid's with w-towers)
     double min_w; // Minimum touched w-level (for sorting)
     struct bl_data *bl_data;
     struct subgrid_work_bl *next;
@@ -62,6 +63,33 @@ struct subgrid_work
     struct subgrid_work_bl *bls; // Baselines
 };
 
+// Output format for visibilities
+enum vis_backend {
+    VIS_BACKEND_HDF5 = 0, // HDF5 file, one group per baseline (see create_bl_groups)
+    VIS_BACKEND_RAW // flat binary file written with O_DIRECT (see raw.h)
+};
+
+// Layout of visibilities in HDF5 files
+enum vis_layout {
+    VIS_LAYOUT_GROUPS = 0, // group and dataset per baseline (see create_bl_groups)
+    VIS_LAYOUT_SINGLE // one dataset [baseline, time, freq] (see create_bl_table)
+};
+
+// Writing all visibilities into one file shared by all writing
+// processes, using parallel HDF5 (MPI-IO)
+enum vis_shared {
+    VIS_SHARED_OFF = 0, // one file per writer
+    VIS_SHARED_INDEPENDENT, // writers write chunks independently
+    VIS_SHARED_COLLECTIVE // writers write chunks in lock-step, collectively
+};
+
+// Assignment of visibility chunks to writers
+enum writer_routing {
+    WRITER_ROUTE_BUSY = 0, // least busy writer
+    WRITER_ROUTE_BASELINE, // by baseline, so every baseline ends up in one file
+    WRITER_ROUTE_CHUNK // by chunk
+};
+
 struct work_config {
 
     // Fundamental dimensions (uvw grid / cubes)
@@ -79,6 +107,7 @@ struct work_config {
     int facet_count; // Number of facets
     struct facet_work *facet_work; // facet work list (2d array - worker x work)
     int subgrid_workers; // number of subgrid workers
+    int aggregator_workers; // number of I/O aggregators (0: streamers write visibilities)
     int subgrid_max_work; // work list length per worker
     struct subgrid_work *subgrid_work; // subgrid work list (2d array - worker x work)
     int iu_min, iu_max, iv_min, iv_max; // subgrid columns/rows
@@ -100,17 +129,32 @@ struct work_config {
     int produce_retain_bf;
     int produce_batch_rows;
     int produce_queue_length;
+    int produce_fill_threads; // Threads filling next w-level's facets while streaming (0: off)
+    int produce_real_facets; // Hold facets as real values (see recombine2d_set_real)
     int vis_skip_metadata;
     int vis_bls_per_task;
     int vis_subgrid_queue_length;
     int vis_task_queue_length;
     int vis_chunk_queue_length;
+    int vis_backend; // enum vis_backend
+    int vis_layout; // enum vis_layout (HDF5 backend)
     int vis_writer_count;
+    int vis_writer_routing; // enum writer_routing
+    int vis_writer_cache; // MB per writer for write-back cache (0: off)
+    int vis_writer_ds_cache; // Open datasets to keep per writer
+    int vis_writer_direct_chunks; // Use direct chunk I/O (H5Dwrite_chunk)
+    int vis_shared_file; // enum vis_shared
+    int vis_hdf5_profile; // enum hdf5_profile
+    int vis_hdf5_align; // KB, alignment / page size for HDF5 profile (stripe size)
+    int vis_writer_uring_depth; // Writes in flight per writer using io_uring (0: off, raw backend only)
     int vis_fork_writer;
     int vis_check_existing;
     int vis_checks, grid_checks;
     double vis_max_error;
     int vis_round_to_wplane;
+    int vis_degrid_single; // Degrid from single precision subgrids
+    int vis_wtowers; // Derive w-levels of a subgrid column from w=0
+    int vis_pool_pages; // Pages backing streamer buffers (enum pool_pages)
 
     // Statsd connection
     int statsd_socket;
@@ -144,6 +188,8 @@ void config_set_visibilities(struct work_config *cfg,
                              const char *vis_path);
 bool config_set_degrid(struct work_config *cfg,
                        const char *gridder_path, double gridder_x0, int downsample);
+bool config_set_w_degrid(struct work_config *cfg,
+                         const char *w_gridder_path, int sg_step_w);
 
 bool config_set_statsd(struct work_config *cfg,
                        const char *node, const char *service);
@@ -159,7 +205,24 @@ void config_set_sources(struct work_config *cfg, int count, unsigned int seed);
 
 void vis_spec_to_bl_data(struct bl_data *bl, struct vis_spec *spec,
                          int a1, int a2);
-bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker);
+bool create_bl_groups(hid_t vis_group, struct work_config *work_cfg, int worker, int aggregator);
+bool create_bl_table(hid_t vis_group, struct work_config *work_cfg, int worker, int aggregator);
+
+// Hash of a baseline, used for assigning baselines to writers and
+// I/O aggregators
+inline static uint32_t config_baseline_hash(struct work_config *cfg, int a1, int a2)
+{
+    const uint32_t bl = a1 * cfg->spec.cfg->ant_count + a2;
+    return (bl * 2654435761u) >> 8;
+}
+inline static int config_baseline_aggregator(struct work_config *cfg, int a1, int a2)
+{
+    return config_baseline_hash(cfg, a1, a2) % cfg->aggregator_workers;
+}
+inline static int config_aggregator_rank(struct work_config *cfg, int aggregator)
+{
+    return cfg->subgrid_workers + cfg->facet_workers + aggregator;
+}
 
 int make_subgrid_tag(struct work_config *wcfg,
                      int subgrid_worker_ix, int subgrid_work_ix,
@@ -167,5 +230,6 @@ int make_subgrid_tag(struct work_config *wcfg,
 
 int producer(struct work_config *wcfg, int facet_worker, int *streamer_ranks);
 int streamer(struct work_config *wcfg, int subgrid_worker, int *producer_ranks);
+int aggregator(struct work_config *wcfg, int aggregator);
 
 #endif // CONFIG_H
@@ -11,7 +11,13 @@
 #include <omp.h>
 #include <string.h>
 #include <fenv.h>
-#ifdef __SSE4_1__
+
+// Select vectorised degridding kernels at runtime?
+#if defined(__GNUC__) && defined(__x86_64__)
+#define GRID_DISPATCH
+#endif
+
+#if defined(__SSE4_1__) || defined(GRID_DISPATCH)
 #include <immintrin.h>
 #endif
 
@@ -128,21 +134,181 @@ void degrid_conv_uv(double complex *uvgrid, int grid_size, int grid_stride, doub
 #endif
 }
 
+#ifdef GRID_DISPATCH
+
+// Vectorised degridding kernels. These get compiled for the given
+// instruction set independently of "-march", so we can select the
+// best variant supported by the CPU at runtime. Returns false if
+// there is no specialised kernel for the kernel size.
+__attribute__((target("avx2,fma")))
+static bool degrid_line_avx2(double complex *uvgrid, int grid_size, int grid_stride,
+                             double theta, double u, double v, double du, double dv,
+                             int i, int i1, bool conjugate,
+                             struct sep_kernel_data *kernel,
+                             double complex *pvis, uint64_t *flops)
+{
+    const int i0 = i;
+    switch (kernel->size) {
+    case 8: {
+        #include "grid_avx2_8.c"
+        return true; }
+    case 10: {
+        #include "grid_avx2_10.c"
+        return true; }
+    case 12: {
+        #include "grid_avx2_12.c"
+        return true; }
+    case 14: {
+        #include "grid_avx2_14.c"
+        return true; }
+    case 16: {
+        #include "grid_avx2_16.c"
+        return true; }
+    }
+    return false;
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static bool degrid_line_avx512(double complex *uvgrid, int grid_size, int grid_stride,
+                               double theta, double u, double v, double du, double dv,
+                               int i, int i1, bool conjugate,
+                               struct sep_kernel_data *kernel,
+                               double complex *pvis, uint64_t *flops)
+{
+    const int i0 = i;
+    switch (kernel->size) {
+    case 8: {
+        #include "grid_avx512_8.c"
+        return true; }
+    case 10: {
+        #include "grid_avx512_10.c"
+        return true; }
+    case 12: {
+        #include "grid_avx512_12.c"
+        return true; }
+    case 14: {
+        #include "grid_avx512_14.c"
+        return true; }
+    case 16: {
+        #include "grid_avx512_16.c"
+        return true; }
+    }
+    return false;
+}
+
+static bool degrid_line_vec(double complex *uvgrid, int grid_size, int grid_stride,
+                            double theta, double u, double v, double du, double dv,
+                            int i, int i1, bool conjugate,
+                            struct sep_kernel_data *kernel,
+                            double complex *pvis, uint64_t *flops)
+{
+    if (__builtin_cpu_supports("avx512f"))
+        return degrid_line_avx512(uvgrid, grid_size, grid_stride, theta, u, v, du, dv,
+                                  i, i1, conjugate, kernel, pvis, flops);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return degrid_line_avx2(uvgrid, grid_size, grid_stride, theta, u, v, du, dv,
+                                i, i1, conjugate, kernel, pvis, flops);
+    return false;
+}
+
+__attribute__((target("avx2,fma")))
+static bool degrid_line_f32_avx2(float complex *uvgrid, int grid_size, int grid_stride,
+                                 double theta, double u, double v, double du, double dv,
+                                 int i, int i1, bool conjugate,
+                                 struct sep_kernel_data *kernel,
+                                 double complex *pvis, uint64_t *flops)
+{
+    const int i0 = i;
+    switch (kernel->size) {
+    case 8: {
+        #include "grid_f32_avx2_8.c"
+        return true; }
+    case 10: {
+        #include "grid_f32_avx2_10.c"
+        return true; }
+    case 12: {
+        #include "grid_f32_avx2_12.c"
+        return true; }
+    case 14: {
+        #include "grid_f32_avx2_14.c"
+        return true; }
+    case 16: {
+        #include "grid_f32_avx2_16.c"
+        return true; }
+    }
+    return false;
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static bool degrid_line_f32_avx512(float complex *uvgrid, int grid_size, int grid_stride,
+                                   double theta, double u, double v, double du, double dv,
+                                   int i, int i1, bool conjugate,
+                                   struct sep_kernel_data *kernel,
+                                   double complex *pvis, uint64_t *flops)
+{
+    const int i0 = i;
+    switch (kernel->size) {
+    case 8: {
+        #include "grid_f32_avx512_8.c"
+        return true; }
+    case 10: {
+        #include "grid_f32_avx512_10.c"
+        return true; }
+    case 12: {
+        #include "grid_f32_avx512_12.c"
+        return true; }
+    case 14: {
+        #include "grid_f32_avx512_14.c"
+        return true; }
+    case 16: {
+        #include "grid_f32_avx512_16.c"
+        return true; }
+    }
+    return false;
+}
+
+static bool degrid_line_f32_vec(float complex *uvgrid, int grid_size, int grid_stride,
+                                double theta, double u, double v, double du, double dv,
+                                int i, int i1, bool conjugate,
+                                struct sep_kernel_data *kernel,
+                                double complex *pvis, uint64_t *flops)
+{
+    if (__builtin_cpu_supports("avx512f"))
+        return degrid_line_f32_avx512(uvgrid, grid_size, grid_stride, theta, u, v, du, dv,
+                                      i, i1, conjugate, kernel, pvis, flops);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return degrid_line_f32_avx2(uvgrid, grid_size, grid_stride, theta, u, v, du, dv,
+                                    i, i1, conjugate, kernel, pvis, flops);
+    return false;
+}
+
+#endif
+
+const char *degrid_kernel_arch(struct sep_kernel_data *kernel)
+{
+#ifdef GRID_DISPATCH
+    if (kernel->size >= 8 && kernel->size <= 16 && kernel->size % 2 == 0) {
+        if (__builtin_cpu_supports("avx512f"))
+            return "AVX-512";
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return "AVX2";
+    }
+#endif
+    return "generic";
+}
+
 inline static int imax(int a, int b) { return a >= b ? a : b; }
 inline static int imin(int a, int b) { return a <= b ? a : b; }
 
-void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
-                         double theta, double u0, double v0, double w0,
-                         double du, double dv, double dw, int count,
-                         double min_u, double max_u,
-                         double min_v, double max_v,
-                         double min_w, double max_w,
-                         bool conjugate,
-                         struct sep_kernel_data *kernel,
-                         double complex *pvis0, uint64_t *flops)
+// Determine range of visibilities [i0,i1) on a line that fall into
+// the given uvw bounds
+inline static void degrid_line_bounds(double u0, double v0, double w0,
+                                      double du, double dv, double dw, int count,
+                                      double min_u, double max_u,
+                                      double min_v, double max_v,
+                                      double min_w, double max_w,
+                                      int *pi0, int *pi1)
 {
-
-    // Figure out bounds
     int i0 = 0, i1 = count;
     if (du > 0) {
         if (u0+i0*du < min_u) i0 = imax(i0, ceil( (min_u - u0) / du ));
@@ -166,32 +332,39 @@ void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
         if (w0+i1*dw < min_w) i1 = imin(i1, ceil( (min_w - w0) / dw ));
     }
     i0 = imax(0, imin(i0, i1));
+    *pi0 = i0; *pi1 = i1;
+}
 
-    // Fill zeroes
-    int i = 0; double complex *pvis = pvis0;
-    double u = u0, v = v0, w = w0;
-    for (; i < i0; i++, u += du, v += dv, w += dw, pvis++) {
-        /* assert(!( u >= min_u && u < max_u && */
-        /*           v >= min_v && v < max_v && */
-        /*           w >= min_w && w < max_w )); */
-        *pvis = 0.;
-    }
+void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
+                         double theta, double u0, double v0, double w0,
+                         double du, double dv, double dw, int count,
+                         double min_u, double max_u,
+                         double min_v, double max_v,
+                         double min_w, double max_w,
+                         bool conjugate,
+                         struct sep_kernel_data *kernel,
+                         double complex *pvis0, int *pi0, int *pi1,
+                         uint64_t *flops)
+{
+
+    // Figure out bounds. Visibilities outside are left untouched.
+    int i0, i1;
+    degrid_line_bounds(u0, v0, w0, du, dv, dw, count,
+                       min_u, max_u, min_v, max_v, min_w, max_w,
+                       &i0, &i1);
+    *pi0 = i0; *pi1 = i1;
+    int i = i0; double complex *pvis = pvis0 + i0;
+    double u = u0 + i0 * du, v = v0 + i0 * dv, w = w0 + i0 * dw;
 
     // Anything to do?
     if (i < i1) {
 
-#ifdef __AVX2__
-        if (kernel->size == 8) {
-            #include "grid_avx2_8.c"
-        } else if (kernel->size == 10) {
-            #include "grid_avx2_10.c"
-        } else if (kernel->size == 12) {
-            #include "grid_avx2_12.c"
-        } else if (kernel->size == 14) {
-            #include "grid_avx2_14.c"
-        } else if (kernel->size == 16) {
-            #include "grid_avx2_16.c"
-
+#ifdef GRID_DISPATCH
+        if (degrid_line_vec(uvgrid, grid_size, grid_stride, theta,
+                            u, v, du, dv, i, i1, conjugate,
+                            kernel, pvis, flops)) {
+            pvis += i1 - i; u += (i1 - i) * du; v += (i1 - i) * dv; w += (i1 - i) * dw;
+            i = i1;
         } else
 #endif
         {
@@ -208,16 +381,173 @@ void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
         }
     }
 
-    // Fill remaining zeroes
-    for (; i < count; i++, u += du, v += dv, w += dw, pvis++) {
-        /* assert(!( u >= min_u && u < max_u && */
-        /*           v >= min_v && v < max_v && */
-        /*           w >= min_w && w < max_w )); */
-        *pvis = 0.;
+}
+
+
+inline static
+void degrid_conv_uv_f32(float complex *uvgrid, int grid_size, int grid_stride, double theta,
+                        bool conjugate, double u, double v,
+                        struct sep_kernel_data *kernel,
+                        uint64_t *flops, double complex *pvis)
+{
+
+    // Calculate grid and sub-grid coordinates
+    int grid_offset, sub_offset_x, sub_offset_y;
+    const int kernel_size = kernel->size;
+    frac_coord_sep_uv(grid_size, grid_stride, kernel_size, kernel->stride_f, kernel->oversampling,
+                      theta, u, v,
+                      &grid_offset, &sub_offset_x, &sub_offset_y);
+
+    // Get visibility
+    float complex vis = 0;
+    int y, x;
+    for (y = 0; y < kernel_size; y++) {
+        float complex visy = 0;
+        for (x = 0; x < kernel_size; x++) {
+            visy += kernel->data_f[sub_offset_x + x] *
+                    uvgrid[grid_offset + y*grid_stride + x];
+        }
+        vis += kernel->data_f[sub_offset_y + y] * visy;
+    }
+    *flops += 4 * (1 + kernel_size) * kernel_size;
+    *pvis = (conjugate ? conjf(vis) : vis);
+}
+
+void degrid_conv_uv_line_f32(float complex *uvgrid, int grid_size, int grid_stride,
+                             double theta, double u0, double v0, double w0,
+                             double du, double dv, double dw, int count,
+                             double min_u, double max_u,
+                             double min_v, double max_v,
+                             double min_w, double max_w,
+                             bool conjugate,
+                             struct sep_kernel_data *kernel,
+                             double complex *pvis0, int *pi0, int *pi1,
+                             uint64_t *flops)
+{
+
+    // Figure out bounds. Visibilities outside are left untouched.
+    int i0, i1;
+    degrid_line_bounds(u0, v0, w0, du, dv, dw, count,
+                       min_u, max_u, min_v, max_v, min_w, max_w,
+                       &i0, &i1);
+    *pi0 = i0; *pi1 = i1;
+    int i = i0; double complex *pvis = pvis0 + i0;
+    double u = u0 + i0 * du, v = v0 + i0 * dv;
+
+    // Degrid visibilities
+    if (i < i1) {
+
+#ifdef GRID_DISPATCH
+        if (degrid_line_f32_vec(uvgrid, grid_size, grid_stride, theta,
+                                u, v, du, dv, i, i1, conjugate,
+                                kernel, pvis, flops)) {
+            pvis += i1 - i; i = i1;
+        } else
+#endif
+        {
+            for (; i < i1; i++, u += du, v += dv, pvis++) {
+                degrid_conv_uv_f32(uvgrid, grid_size, grid_stride, theta,
+                                   conjugate, u, v, kernel, flops, pvis);
+            }
+        }
+    }
+
+}
+
+void degrid_conv_uvw_line(void **wplanes, int wplane_count, double wstep, bool single,
+                          int grid_size, int grid_stride,
+                          double theta, double u0, double v0, double w0,
+                          double du, double dv, double dw, int count,
+                          double min_u, double max_u,
+                          double min_v, double max_v,
+                          double min_w, double max_w,
+                          bool conjugate,
+                          struct sep_kernel_data *kernel,
+                          struct sep_kernel_data *w_kernel,
+                          double complex *pvis0, int *pi0, int *pi1,
+                          uint64_t *flops)
+{
+
+    // Figure out bounds. Visibilities outside are left untouched.
+    int i0, i1, i;
+    degrid_line_bounds(u0, v0, w0, du, dv, dw, count,
+                       min_u, max_u, min_v, max_v, min_w, max_w,
+                       &i0, &i1);
+    *pi0 = i0; *pi1 = i1;
+    if (i0 >= i1)
+        return;
+
+    // Work through runs of visibilities that use the same w-planes
+    const int w_size = w_kernel->size;
+    double complex vis_plane[i1 - i0] __attribute__ ((aligned (16)));
+    int wfrac[i1 - i0];
+    for (i = i0; i < i1; ) {
+
+        // Find end of run, remembering oversampled w-kernel offsets
+        int iw, jw, j;
+        _frac_coord(wplane_count, w_kernel->oversampling, (w0 + i * dw) / wstep,
+                    &iw, wfrac);
+        for (j = i + 1; j < i1; j++) {
+            _frac_coord(wplane_count, w_kernel->oversampling, (w0 + j * dw) / wstep,
+                        &jw, wfrac + j - i);
+            if (jw != iw) break;
+        }
+        assert(iw - w_size/2 >= 0 && iw - w_size/2 + w_size <= wplane_count);
+
+        // Degrid from every plane, accumulate weighted by the w-kernel.
+        // The run is within bounds already.
+        int p, k, k0, k1;
+        for (p = 0; p < w_size; p++) {
+            void *plane = wplanes[iw - w_size/2 + p];
+            assert(plane);
+            if (single)
+                degrid_conv_uv_line_f32((float complex *)plane, grid_size, grid_stride, theta,
+                                        u0 + i * du, v0 + i * dv, 0, du, dv, 0, j - i,
+                                        -INFINITY, INFINITY, -INFINITY, INFINITY,
+                                        -INFINITY, INFINITY,
+                                        conjugate, kernel, vis_plane, &k0, &k1, flops);
+            else
+                degrid_conv_uv_line((double complex *)plane, grid_size, grid_stride, theta,
+                                    u0 + i * du, v0 + i * dv, 0, du, dv, 0, j - i,
+                                    -INFINITY, INFINITY, -INFINITY, INFINITY,
+                                    -INFINITY, INFINITY,
+                                    conjugate, kernel, vis_plane, &k0, &k1, flops);
+            const double *kern_w = w_kernel->data + p;
+            if (p == 0) {
+                for (k = 0; k < j - i; k++)
+                    pvis0[i + k] = kern_w[w_kernel->stride * wfrac[k]] * vis_plane[k];
+            } else {
+                for (k = 0; k < j - i; k++)
+                    pvis0[i + k] += kern_w[w_kernel->stride * wfrac[k]] * vis_plane[k];
+            }
+        }
+        *flops += 4 * w_size * (j - i);
+        i = j;
     }
 
 }
 
+bool sep_kern_make_float(struct sep_kernel_data *kernel)
+{
+    if (kernel->data_f) return true;
+
+    // Same alignment assumptions as load_sep_kern
+    const int align = 32; // For AVX2
+    kernel->stride_f = align * ((kernel->size * sizeof(float) + align - 1) / align) / sizeof(float);
+    if (posix_memalign((void *)&kernel->data_f, align,
+                       sizeof(float) * kernel->oversampling * kernel->stride_f)) {
+        kernel->data_f = NULL;
+        return false;
+    }
+    int i, j;
+    for (i = 0; i < kernel->oversampling; i++) {
+        for (j = 0; j < kernel->stride_f; j++) {
+            kernel->data_f[i * kernel->stride_f + j] =
+                (j < kernel->size ? kernel->data[i * kernel->stride + j] : 0);
+        }
+    }
+    return true;
+}
 
 uint64_t degrid_conv_bl(double complex *uvgrid, int grid_size, int grid_stride, double theta,
                         double d_u, double d_v,
@@ -263,3 +593,34 @@ void fft_shift(double complex *uvgrid, int grid_size) {
     }
 
 }
+
+// Multiply grid by a (-1)^(x+y) checkerboard. For even grid sizes,
+// doing this to the input of a Fourier transform has the same effect
+// as applying fft_shift to its output.
+void fft_shift_modulate(double complex *uvgrid, int grid_size, int grid_stride) {
+
+    assert(grid_size % 2 == 0);
+    int x, y;
+    for (y = 0; y < grid_size; y++) {
+        double complex *row = uvgrid + (size_t)y * grid_stride;
+        for (x = 1 - (y % 2); x < grid_size; x += 2) {
+            row[x] = -row[x];
+        }
+    }
+
+}
+
+// Plan a 2D Fourier transform of a packed grid that writes its result
+// with the given row stride. Together with fft_shift_modulate this
+// replaces FFT + fft_shift + re-striding by one pass over the data.
+fftw_plan fft_plan_strided_2d(int grid_size, int out_stride,
+                              double complex *in, double complex *out,
+                              int sign, unsigned flags) {
+
+    fftw_iodim dims[2] = {
+        { grid_size, grid_size, out_stride },
+        { grid_size, 1, 1 }
+    };
+    return fftw_plan_guru_dft(2, dims, 0, NULL, in, out, sign, flags);
+
+}
@@ -92,6 +92,9 @@ struct sep_kernel_data
     // grid-plane kernel
     int size, stride, oversampling;
     double *data; // [oversampling][stride]
+    // single precision copy (see sep_kern_make_float)
+    int stride_f;
+    float *data_f; // [oversampling][stride_f]
     // image-plane correction
     int corr_size;
     double *corr; // [corr_size]
@@ -109,21 +112,63 @@ struct perf_counters
     int llc_miss;
 };
 
+// Tuning of HDF5 visibility files (see vis_file_access_props)
+enum hdf5_profile {
+    HDF5_PROFILE_DEFAULT = 0, // library defaults
+    HDF5_PROFILE_PFS // aligned to file system stripes, for parallel file systems
+};
+
+// Least recently used cache of open visibility datasets and their
+// dataspaces, keyed by antennas (see read_vis_chunk). Also selects
+// whether chunks get accessed directly (H5Dwrite_chunk). For files
+// with a single visibility dataset (see create_vis_table) it instead
+// holds that dataset and the row of every baseline.
+struct vis_ds_cache
+{
+    bool direct;
+    int size, used;
+    int buckets, *bucket; // hash table
+    int free, oldest, newest; // free list and usage order
+    struct vis_ds_cache_entry *entries;
+    hid_t chunk_dsp; // memory dataspace for a chunk
+    int time_chunk_size, freq_chunk_size;
+    uint64_t hits, misses;
+    hid_t dapl; // access properties for datasets (owned, see vis_dataset_access_props)
+    bool single; // see vis_ds_cache_open_table
+    hid_t single_ds, single_dsp;
+    int ant_count, *bl_row; // [ant_count * ant_count], row or -1
+};
+
 // Prototypes
 void init_dtype_cpx();
 bool load_ant_config(const char *filename, struct ant_config *ant);
+hid_t vis_file_create_props(int profile, size_t align, bool paged);
+hid_t vis_file_access_props(hid_t fapl, int profile, size_t align, bool paged);
+hid_t vis_dataset_access_props(int profile, size_t chunk_bytes, int chunks);
 bool create_vis_group(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_metadata,
-                      struct bl_data *bl);
-bool read_vis_chunk(hid_t vis_group,
+                      bool full_size, int profile, struct bl_data *bl);
+bool create_vis_table(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_metadata,
+                      int profile, struct bl_data *bl, int bl_count, const int *antennas);
+bool vis_ds_cache_init(struct vis_ds_cache *cache, int size, bool direct,
+                       int time_chunk_size, int freq_chunk_size, hid_t dapl);
+bool vis_ds_cache_open_table(struct vis_ds_cache *cache, hid_t vis_group, int ant_count);
+void vis_ds_cache_free(struct vis_ds_cache *cache);
+bool read_vis_chunk(hid_t vis_group, struct vis_ds_cache *cache,
                     struct bl_data *bl,
                     int time_chunk_size, int freq_chunk_size,
                     int time_chunk_ix, int freq_chunk_ix,
                     double complex *buf);
-bool write_vis_chunk(hid_t vis_group,
+bool write_vis_chunk(hid_t vis_group, struct vis_ds_cache *cache,
                     struct bl_data *bl,
                     int time_chunk_size, int freq_chunk_size,
                     int time_chunk_ix, int freq_chunk_ix,
                      double complex *buf);
+bool write_vis_chunk_ranges(hid_t vis_group, struct vis_ds_cache *cache,
+                            struct bl_data *bl,
+                            int time_chunk_size, int freq_chunk_size,
+                            int time_chunk_ix, int freq_chunk_ix,
+                            const int *ranges, hid_t dxpl,
+                            double complex *buf);
 
 int load_vis(const char *filename, struct vis_data *vis,
              double min_len, double max_len);
@@ -134,6 +179,8 @@ void frac_coord(int grid_size, int oversample,
 void degrid_conv_uv_pf(double complex *uvgrid, int grid_size, int grid_stride, double theta,
                        double u, double v,
                        struct sep_kernel_data *kernel);
+// Degrid a line of visibilities. Only the range [*pi0,*pi1) that
+// falls within the uvw bounds gets written.
 void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
                          double theta, double u0, double v0, double w0,
                          double du, double dv, double dw, int count,
@@ -142,14 +189,45 @@ void degrid_conv_uv_line(double complex *uvgrid, int grid_size, int grid_stride,
                          double min_w, double max_w,
                          bool conjugate,
                          struct sep_kernel_data *kernel,
-                         double complex *pvis0, uint64_t *flops);
+                         double complex *pvis0, int *pi0, int *pi1,
+                         uint64_t *flops);
 
+void degrid_conv_uv_line_f32(float complex *uvgrid, int grid_size, int grid_stride,
+                             double theta, double u0, double v0, double w0,
+                             double du, double dv, double dw, int count,
+                             double min_u, double max_u,
+                             double min_v, double max_v,
+                             double min_w, double max_w,
+                             bool conjugate,
+                             struct sep_kernel_data *kernel,
+                             double complex *pvis0, int *pi0, int *pi1,
+                             uint64_t *flops);
+// Degrid from a stack of w-planes "wstep" apart (plane
+// wplane_count/2 at w=0), interpolating using a separable w-kernel
+void degrid_conv_uvw_line(void **wplanes, int wplane_count, double wstep, bool single,
+                          int grid_size, int grid_stride,
+                          double theta, double u0, double v0, double w0,
+                          double du, double dv, double dw, int count,
+                          double min_u, double max_u,
+                          double min_v, double max_v,
+                          double min_w, double max_w,
+                          bool conjugate,
+                          struct sep_kernel_data *kernel,
+                          struct sep_kernel_data *w_kernel,
+                          double complex *pvis0, int *pi0, int *pi1,
+                          uint64_t *flops);
+bool sep_kern_make_float(struct sep_kernel_data *kernel);
 uint64_t degrid_conv_bl(double complex *uvgrid, int grid_size, int grid_stride, double theta,
                         double d_u, double d_v,
                         double min_u, double max_u, double min_v, double max_v,
                         struct bl_data *bl, int time0, int time1, int freq0, int freq1,
                         struct sep_kernel_data *kernel);
+const char *degrid_kernel_arch(struct sep_kernel_data *kernel);
 void fft_shift(double complex *uvgrid, int grid_size);
+void fft_shift_modulate(double complex *uvgrid, int grid_size, int grid_stride);
+fftw_plan fft_plan_strided_2d(int grid_size, int out_stride,
+                              double complex *in, double complex *out,
+                              int sign, unsigned flags);
 
 void open_perf_counters(struct perf_counters *counter);
 void enable_perf_counters(struct perf_counters *counter);
@@ -163,4 +241,17 @@ void *read_dump(int size, char *name, ...);
 int get_npoints_hdf5(const char *file, char *name, ...);
 void *read_hdf5(int size, const char *file, char *name, ...);
 
+// Dataset kept open for reading ranges of rows (see read_hdf5_rows)
+struct hdf5_rows
+{
+    const char *file, *name; // NULL if not open
+    hid_t f, dset, type;
+    int row_count;
+    size_t row_size; // bytes
+};
+bool open_hdf5_rows(struct hdf5_rows *rows, int row_count, size_t row_size,
+                    const char *file, const char *name);
+bool read_hdf5_rows(struct hdf5_rows *rows, int row0, int row1, void *data);
+void close_hdf5_rows(struct hdf5_rows *rows);
+
 #endif // GRID_H
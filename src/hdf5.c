@@ -391,13 +391,68 @@ int load_vis(const char *filename, struct vis_data *vis,
     return 0;
 }
 
+// Property lists for visibility files. The parallel file system
+// profile aligns larger objects (i.e. chunks) to stripes, aggregates
+// metadata and small raw data into stripe-sized blocks and uses the
+// latest file format. Unless "paged" is false (parallel HDF5 does not
+// support it), file space gets managed in pages of a stripe, which
+// lets us put a page buffer in front of the file.
+hid_t vis_file_create_props(int profile, size_t align, bool paged)
+{
+    hid_t fcpl = H5Pcreate(H5P_FILE_CREATE);
+    if (profile == HDF5_PROFILE_PFS && paged) {
+        H5Pset_file_space_strategy(fcpl, H5F_FSPACE_STRATEGY_PAGE, false, 1);
+        H5Pset_file_space_page_size(fcpl, align);
+    }
+    return fcpl;
+}
+hid_t vis_file_access_props(hid_t fapl, int profile, size_t align, bool paged)
+{
+    if (profile == HDF5_PROFILE_PFS) {
+        H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+        H5Pset_alignment(fapl, align / 4, align);
+        H5Pset_meta_block_size(fapl, align);
+        H5Pset_small_data_block_size(fapl, align);
+        if (paged)
+            H5Pset_page_buffer_size(fapl, 16 * align, 0, 0);
+    }
+    return fapl;
+}
+
+// Chunk cache for visibility datasets. We write chunks once and in
+// full, so caching only costs memory and copies: Keep room for
+// "chunks" chunks per dataset, and evict fully written chunks first.
+hid_t vis_dataset_access_props(int profile, size_t chunk_bytes, int chunks)
+{
+    if (profile != HDF5_PROFILE_PFS)
+        return H5P_DEFAULT;
+    hid_t dapl = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl, chunks > 1 ? 100 * chunks + 1 : 1, chunks * chunk_bytes, 1.0);
+    return dapl;
+}
+
+// Allocate space up front and never write fill values for the
+// parallel file system profile: Writers fill every chunk themselves
+static void _set_vis_ds_alloc(hid_t dcpl, int profile)
+{
+    if (profile == HDF5_PROFILE_PFS) {
+        H5Pset_alloc_time(dcpl, H5D_ALLOC_TIME_EARLY);
+        H5Pset_fill_time(dcpl, H5D_FILL_TIME_NEVER);
+    } else {
+        H5Pset_alloc_time(dcpl, H5D_ALLOC_TIME_DEFAULT);
+        H5Pset_fill_time(dcpl, H5D_FILL_TIME_IFSET);
+    }
+}
+
 bool create_vis_group(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_metadata,
-                      struct bl_data *bl) {
+                      bool full_size, int profile, struct bl_data *bl) {
 
     // Create a visibility group from baseline data *without* actually
     // writing any visibility data (data in "bl" will be ignored).
     // Instead, we will write a chunked visibility dataset with zeros
-    // for fill value.
+    // for fill value. The dataset starts out empty unless "full_size"
+    // is set, which is needed if we cannot extend it later (parallel
+    // HDF5 requires that to be a collective operation).
 
     // Create properties for compact and contigous data. Yes, it is
     // worth sharing them.
@@ -416,6 +471,7 @@ bool create_vis_group(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_met
     }
     hsize_t chunks[3] = { time_chunk, freq_chunk, 1 };
     H5Pset_chunk(chunked_ds_prop, 3, chunks);
+    _set_vis_ds_alloc(chunked_ds_prop, profile);
     // Create datasets
     if (!skip_metadata) {
         hsize_t freq_size = bl->freq_count;
@@ -455,8 +511,11 @@ bool create_vis_group(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_met
         H5Sclose(uvw_dsp); H5Dclose(uvw_ds);
     }
 
-    hsize_t vis_dims[3] = { 0, 0, 1 };
     hsize_t max_vis_dims[3] = { bl->time_count, bl->freq_count, 1 };
+    hsize_t vis_dims[3] = { 0, 0, 1 };
+    if (full_size) {
+        vis_dims[0] = max_vis_dims[0]; vis_dims[1] = max_vis_dims[1];
+    }
     hid_t vis_dsp = H5Screate_simple(3, vis_dims, max_vis_dims);
     hid_t vis_ds = H5Dcreate(vis_g, "vis", dtype_cpx,
                              vis_dsp, H5P_DEFAULT, chunked_ds_prop, H5P_DEFAULT);
@@ -470,39 +529,379 @@ bool create_vis_group(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_met
     return true;
 }
 
-static bool _rw_vis_chunk(hid_t vis_group,
-                          struct bl_data *bl,
-                          int time_chunk_size, int freq_chunk_size,
-                          int time_chunk_ix, int freq_chunk_ix,
-                          bool write, double complex *buf)
+bool create_vis_table(hid_t vis_g, int freq_chunk, int time_chunk, bool skip_metadata,
+                      int profile, struct bl_data *bl, int bl_count, const int *antennas) {
+
+    // Create visibility data for all baselines as one chunked dataset
+    // [baseline, time, frequency], again without writing any
+    // visibilities. Baselines are identified by a table of antenna
+    // pairs (antennas, [bl_count, 2]). The baseline data "bl" is only
+    // used for the shape and time/frequency metadata, which all
+    // baselines share. UVWs are not stored with this layout.
+    hsize_t bl_dims[2] = { bl_count, 2 };
+    hid_t bl_dsp = H5Screate_simple(2, bl_dims, NULL);
+    hid_t bl_ds = H5Dcreate(vis_g, "baselines", H5T_STD_I32LE,
+                            bl_dsp, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (bl_ds < 0) {
+        fprintf(stderr, "failed to create baseline dataset!");
+        H5Sclose(bl_dsp);
+        return false;
+    }
+    H5Dwrite(bl_ds, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, antennas);
+    H5Sclose(bl_dsp); H5Dclose(bl_ds);
+
+    if (!skip_metadata) {
+        hsize_t freq_size = bl->freq_count;
+        hid_t freq_dsp = H5Screate_simple(1, &freq_size, NULL);
+        hid_t freq_ds = H5Dcreate(vis_g, "frequency", H5T_IEEE_F64LE,
+                                  freq_dsp, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (freq_ds >= 0)
+            H5Dwrite(freq_ds, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, bl->freq);
+        H5Sclose(freq_dsp);
+        hsize_t time_size = bl->time_count;
+        hid_t time_dsp = H5Screate_simple(1, &time_size, NULL);
+        hid_t time_ds = H5Dcreate(vis_g, "time", H5T_IEEE_F64LE,
+                                  time_dsp, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (time_ds >= 0)
+            H5Dwrite(time_ds, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, bl->time);
+        H5Sclose(time_dsp);
+        if (freq_ds < 0 || time_ds < 0) {
+            fprintf(stderr, "failed to create time/frequency datasets!");
+            if (freq_ds >= 0) H5Dclose(freq_ds);
+            if (time_ds >= 0) H5Dclose(time_ds);
+            return false;
+        }
+        H5Dclose(freq_ds); H5Dclose(time_ds);
+    }
+
+    // One chunk per baseline and chunk of time and frequency, same as
+    // with a dataset per baseline (see create_vis_group)
+    hid_t chunked_ds_prop = H5Pcreate(H5P_DATASET_CREATE);
+    hsize_t chunks[3] = { 1, time_chunk, freq_chunk };
+    H5Pset_chunk(chunked_ds_prop, 3, chunks);
+    complex double fill_value = 0;
+    H5Pset_fill_value(chunked_ds_prop, dtype_cpx, &fill_value);
+    _set_vis_ds_alloc(chunked_ds_prop, profile);
+    hsize_t vis_dims[3] = { bl_count, bl->time_count, bl->freq_count };
+    hid_t vis_dsp = H5Screate_simple(3, vis_dims, NULL);
+    hid_t vis_ds = H5Dcreate(vis_g, "vis", dtype_cpx,
+                             vis_dsp, H5P_DEFAULT, chunked_ds_prop, H5P_DEFAULT);
+    H5Pclose(chunked_ds_prop); H5Sclose(vis_dsp);
+    if (vis_ds < 0) {
+        fprintf(stderr, "failed to create visibility dataset!");
+        return false;
+    }
+    H5Dclose(vis_ds);
+
+    return true;
+}
+
+struct vis_ds_cache_entry
 {
+    int a1, a2;
+    hid_t ds, dsp;
+    int hash_next; // next in bucket (or free list)
+    int prev, next; // neighbours in order of use
+};
+
+bool vis_ds_cache_init(struct vis_ds_cache *cache, int size, bool direct,
+                       int time_chunk_size, int freq_chunk_size, hid_t dapl)
+{
+    int i;
+    cache->direct = direct;
+    cache->dapl = dapl;
+    cache->single = false;
+    cache->size = size; cache->used = 0;
+    cache->buckets = 2 * size + 1;
+    cache->bucket = (int *)malloc(sizeof(int) * cache->buckets);
+    cache->entries = (struct vis_ds_cache_entry *)
+        malloc(sizeof(struct vis_ds_cache_entry) * size);
+    if (!cache->bucket || !cache->entries) {
+        free(cache->bucket); free(cache->entries);
+        cache->size = 0;
+        return false;
+    }
+    for (i = 0; i < cache->buckets; i++)
+        cache->bucket[i] = -1;
+    for (i = 0; i < size; i++)
+        cache->entries[i].hash_next = (i + 1 < size ? i + 1 : -1);
+    cache->free = (size > 0 ? 0 : -1);
+    cache->oldest = cache->newest = -1;
+    cache->time_chunk_size = time_chunk_size;
+    cache->freq_chunk_size = freq_chunk_size;
+    hsize_t chunk_dims[] = { time_chunk_size, freq_chunk_size, 1 };
+    cache->chunk_dsp = H5Screate_simple(3, chunk_dims, chunk_dims);
+    cache->hits = cache->misses = 0;
+    return true;
+}
+
+static void _vis_ds_cache_unlink(struct vis_ds_cache *cache, int i)
+{
+    struct vis_ds_cache_entry *entry = cache->entries + i;
+    if (entry->prev >= 0) cache->entries[entry->prev].next = entry->next;
+    else cache->oldest = entry->next;
+    if (entry->next >= 0) cache->entries[entry->next].prev = entry->prev;
+    else cache->newest = entry->prev;
+}
+
+static void _vis_ds_cache_link_newest(struct vis_ds_cache *cache, int i)
+{
+    struct vis_ds_cache_entry *entry = cache->entries + i;
+    entry->prev = cache->newest; entry->next = -1;
+    if (cache->newest >= 0) cache->entries[cache->newest].next = i;
+    else cache->oldest = i;
+    cache->newest = i;
+}
+
+static int _vis_ds_cache_bucket(struct vis_ds_cache *cache, int a1, int a2)
+{
+    return ((unsigned)a1 * 65599u + (unsigned)a2) % cache->buckets;
+}
+
+// Close least recently used dataset
+static void _vis_ds_cache_evict(struct vis_ds_cache *cache)
+{
+    const int i = cache->oldest;
+    struct vis_ds_cache_entry *entry = cache->entries + i;
+    int *pi = cache->bucket + _vis_ds_cache_bucket(cache, entry->a1, entry->a2);
+    while (*pi != i)
+        pi = &cache->entries[*pi].hash_next;
+    *pi = entry->hash_next;
+    _vis_ds_cache_unlink(cache, i);
+    H5Sclose(entry->dsp); H5Dclose(entry->ds);
+    entry->hash_next = cache->free;
+    cache->free = i;
+    cache->used--;
+}
+
+void vis_ds_cache_free(struct vis_ds_cache *cache)
+{
+    if (cache->single) {
+        H5Sclose(cache->single_dsp); H5Dclose(cache->single_ds);
+        free(cache->bl_row);
+        cache->single = false;
+    }
+    if (cache->size > 0) {
+        while (cache->oldest >= 0)
+            _vis_ds_cache_evict(cache);
+        H5Sclose(cache->chunk_dsp);
+        free(cache->bucket); free(cache->entries);
+    }
+    if (cache->dapl != H5P_DEFAULT)
+        H5Pclose(cache->dapl);
+}
+
+// Open the visibility dataset of a file using the single-dataset
+// layout, and read the baseline table to locate baselines' rows
+bool vis_ds_cache_open_table(struct vis_ds_cache *cache, hid_t vis_group, int ant_count)
+{
+    hid_t bl_ds = H5Dopen2(vis_group, "baselines", H5P_DEFAULT);
+    if (bl_ds < 0) {
+        fprintf(stderr, "ERROR: Could not access baseline table!\n");
+        return false;
+    }
+    hid_t bl_dsp = H5Dget_space(bl_ds);
+    hsize_t bl_dims[2];
+    H5Sget_simple_extent_dims(bl_dsp, bl_dims, NULL);
+    H5Sclose(bl_dsp);
+    int *antennas = (int *)malloc(sizeof(int) * 2 * bl_dims[0]);
+    cache->bl_row = (int *)malloc(sizeof(int) * ant_count * ant_count);
+    if (!antennas || !cache->bl_row ||
+        H5Dread(bl_ds, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, antennas) < 0) {
+        fprintf(stderr, "ERROR: Could not read baseline table!\n");
+        free(antennas); free(cache->bl_row);
+        H5Dclose(bl_ds);
+        return false;
+    }
+    H5Dclose(bl_ds);
+
+    int i;
+    for (i = 0; i < ant_count * ant_count; i++)
+        cache->bl_row[i] = -1;
+    for (i = 0; i < bl_dims[0]; i++) {
+        const int a1 = antennas[2*i], a2 = antennas[2*i+1];
+        if (a1 >= 0 && a2 >= 0 && a1 < ant_count && a2 < ant_count)
+            cache->bl_row[a1 * ant_count + a2] = i;
+    }
+    free(antennas);
+
+    cache->single_ds = H5Dopen2(vis_group, "vis", cache->dapl);
+    if (cache->single_ds < 0) {
+        fprintf(stderr, "ERROR: Could not access visibility dataset!\n");
+        free(cache->bl_row);
+        return false;
+    }
+    cache->single_dsp = H5Dget_space(cache->single_ds);
+    cache->ant_count = ant_count;
+    cache->single = true;
+    return true;
+}
 
+// Open dataset of a baseline and create its dataspace. Datasets get
+// created empty (see create_vis_group), so for direct chunk access we
+// need to extend them to full size first.
+static bool _open_vis_ds(hid_t vis_group, struct bl_data *bl, bool direct, hid_t dapl,
+                         hid_t *ds, hid_t *dsp)
+{
     // Generate name
     char name[128];
     sprintf(name, "%d/%d/vis", bl->antenna1, bl->antenna2);
 
     // Open dataset
-    hid_t vis_ds = H5Dopen2(vis_group, name, H5P_DEFAULT);
-    if (vis_ds < 0) {
+    *ds = H5Dopen2(vis_group, name, dapl);
+    if (*ds < 0) {
         fprintf(stderr, "ERROR: Could not access dataset %s!\n", name);
         return false;
     }
-
-    // Create memory and file data spaces
-    hsize_t chunk_dims[] = { time_chunk_size, freq_chunk_size, 1 };
-    hid_t chunk_dsp = H5Screate_simple(3, chunk_dims, chunk_dims);
     hsize_t vis_dims[] = { bl->time_count, bl->freq_count, 1 };
-    hid_t vis_dsp = H5Screate_simple(3, vis_dims, vis_dims);
+    *dsp = H5Screate_simple(3, vis_dims, vis_dims);
+    if (direct) {
+        hid_t cur_dsp = H5Dget_space(*ds);
+        hsize_t cur_dims[3];
+        H5Sget_simple_extent_dims(cur_dsp, cur_dims, NULL);
+        H5Sclose(cur_dsp);
+        if ((cur_dims[0] < vis_dims[0] || cur_dims[1] < vis_dims[1]) &&
+            H5Dset_extent(*ds, vis_dims) < 0) {
+            fprintf(stderr, "ERROR: Could not extend dataset %s!\n", name);
+            H5Sclose(*dsp); H5Dclose(*ds);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Look up dataset of a baseline, opening it if required
+static bool _vis_ds_cache_get(struct vis_ds_cache *cache, hid_t vis_group,
+                              struct bl_data *bl, hid_t *ds, hid_t *dsp)
+{
+    int i;
+    const int b = _vis_ds_cache_bucket(cache, bl->antenna1, bl->antenna2);
+    for (i = cache->bucket[b]; i >= 0; i = cache->entries[i].hash_next) {
+        struct vis_ds_cache_entry *entry = cache->entries + i;
+        if (entry->a1 == bl->antenna1 && entry->a2 == bl->antenna2) {
+            _vis_ds_cache_unlink(cache, i);
+            _vis_ds_cache_link_newest(cache, i);
+            *ds = entry->ds; *dsp = entry->dsp;
+            cache->hits++;
+            return true;
+        }
+    }
 
-    // Select chunk (as one "block")
-    hsize_t start[] = { time_chunk_ix * time_chunk_size,
-                        freq_chunk_ix * freq_chunk_size, 0 };
-    hsize_t stride[] = { 1,1,1 };
-    assert(H5Sselect_hyperslab(vis_dsp, H5S_SELECT_SET, start, stride, stride, chunk_dims) >= 0);
+    // Not found, open and add
+    cache->misses++;
+    if (!_open_vis_ds(vis_group, bl, cache->direct, cache->dapl, ds, dsp))
+        return false;
+    if (cache->used >= cache->size)
+        _vis_ds_cache_evict(cache);
+    i = cache->free;
+    struct vis_ds_cache_entry *entry = cache->entries + i;
+    cache->free = entry->hash_next;
+    entry->a1 = bl->antenna1; entry->a2 = bl->antenna2;
+    entry->ds = *ds; entry->dsp = *dsp;
+    entry->hash_next = cache->bucket[b];
+    cache->bucket[b] = i;
+    _vis_ds_cache_link_newest(cache, i);
+    cache->used++;
+    return true;
+}
 
-    // Read or write chunk
+// Get dataset and dataspace holding a baseline's visibilities, either
+// from cache or fresh (then "owned" is set, and they need closing).
+// For the single-dataset layout, also returns the baseline's row.
+static bool _get_vis_ds(struct vis_ds_cache *cache, hid_t vis_group,
+                        struct bl_data *bl, bool direct,
+                        hid_t *ds, hid_t *dsp, int *row, bool *owned)
+{
+    *row = -1; *owned = false;
+    if (cache && cache->single) {
+        *row = cache->bl_row[bl->antenna1 * cache->ant_count + bl->antenna2];
+        if (*row < 0) {
+            fprintf(stderr, "ERROR: Baseline %d/%d not in visibility dataset!\n",
+                    bl->antenna1, bl->antenna2);
+            return false;
+        }
+        *ds = cache->single_ds; *dsp = cache->single_dsp;
+        return true;
+    }
+    if (cache && cache->size > 0)
+        return _vis_ds_cache_get(cache, vis_group, bl, ds, dsp);
+    *owned = true;
+    return _open_vis_ds(vis_group, bl, direct, cache ? cache->dapl : H5P_DEFAULT, ds, dsp);
+}
+
+// Offset of a baseline's visibility in its dataset: [time, freq, 1]
+// for a dataset per baseline, [baseline, time, freq] otherwise
+static void _vis_offset(int row, int t, int f, hsize_t *offset)
+{
+    if (row >= 0) {
+        offset[0] = row; offset[1] = t; offset[2] = f;
+    } else {
+        offset[0] = t; offset[1] = f; offset[2] = 0;
+    }
+}
+static herr_t _select_vis(hid_t dsp, H5S_seloper_t op, int row, int t, int f, int nt, int nf)
+{
+    hsize_t start[3], count[3];
+    _vis_offset(row, t, f, start);
+    if (row >= 0) {
+        count[0] = 1; count[1] = nt; count[2] = nf;
+    } else {
+        count[0] = nt; count[1] = nf; count[2] = 1;
+    }
+    return H5Sselect_hyperslab(dsp, op, start, NULL, count, NULL);
+}
+
+static bool _rw_vis_chunk(hid_t vis_group, struct vis_ds_cache *cache,
+                          struct bl_data *bl,
+                          int time_chunk_size, int freq_chunk_size,
+                          int time_chunk_ix, int freq_chunk_ix,
+                          bool write, double complex *buf)
+{
+
+    // Get dataset and data spaces
+    const bool direct = cache && cache->direct;
+    hid_t vis_ds, vis_dsp, chunk_dsp;
+    int row; bool owned;
+    hsize_t chunk_dims[] = { time_chunk_size, freq_chunk_size, 1 };
+    if (cache && cache->size > 0)
+        assert(cache->time_chunk_size == time_chunk_size &&
+               cache->freq_chunk_size == freq_chunk_size);
+    if (!_get_vis_ds(cache, vis_group, bl, direct, &vis_ds, &vis_dsp, &row, &owned))
+        return false;
+    if (cache && cache->size > 0)
+        chunk_dsp = cache->chunk_dsp;
+    else
+        chunk_dsp = H5Screate_simple(3, chunk_dims, chunk_dims);
+
+    // Select chunk
+    const int t0 = time_chunk_ix * time_chunk_size, f0 = freq_chunk_ix * freq_chunk_size;
+    hsize_t start[3];
+    _vis_offset(row, t0, f0, start);
+    if (!direct)
+        assert(_select_vis(vis_dsp, H5S_SELECT_SET, row, t0, f0,
+                           time_chunk_size, freq_chunk_size) >= 0);
+
+    // Read or write chunk. Direct access bypasses selections, type
+    // conversion and filters, which works as the dataset chunks match
+    // our chunks exactly, and dtype_cpx is laid out like double
+    // complex. Chunks that were never written read as zero (fill value).
     bool success = false;
-    if (write) {
+    const size_t chunk_bytes = sizeof(double complex) * time_chunk_size * freq_chunk_size;
+    if (direct && write) {
+        success = H5Dwrite_chunk(vis_ds, H5P_DEFAULT, 0, start, chunk_bytes, buf) >= 0;
+        assert(success);
+    } else if (direct) {
+        hsize_t stored_bytes = 0; uint32_t filters = 0;
+        H5Dget_chunk_storage_size(vis_ds, start, &stored_bytes);
+        if (stored_bytes == 0) {
+            memset(buf, 0, chunk_bytes);
+            success = true;
+        } else {
+            assert(stored_bytes == chunk_bytes);
+            success = H5Dread_chunk(vis_ds, H5P_DEFAULT, start, &filters, buf) >= 0;
+            assert(success);
+        }
+    } else if (write) {
         success = H5Dwrite(vis_ds, dtype_cpx, chunk_dsp, vis_dsp, H5P_DEFAULT, buf) >= 0;
         assert(success);
     } else {
@@ -510,30 +909,74 @@ static bool _rw_vis_chunk(hid_t vis_group,
         assert(success);
     }
 
-    H5Sclose(chunk_dsp);
-    H5Sclose(vis_dsp);
-    H5Dclose(vis_ds);
+    if (!cache || cache->size == 0)
+        H5Sclose(chunk_dsp);
+    if (owned) {
+        H5Sclose(vis_dsp);
+        H5Dclose(vis_ds);
+    }
     return success;
 }
 
-bool read_vis_chunk(hid_t vis_group,
+bool read_vis_chunk(hid_t vis_group, struct vis_ds_cache *cache,
                     struct bl_data *bl,
                     int time_chunk_size, int freq_chunk_size,
                     int time_chunk_ix, int freq_chunk_ix,
                     double complex *buf)
 {
-    return _rw_vis_chunk(vis_group, bl, time_chunk_size, freq_chunk_size, time_chunk_ix, freq_chunk_ix,
-                         false, buf);
+    return _rw_vis_chunk(vis_group, cache, bl, time_chunk_size, freq_chunk_size,
+                         time_chunk_ix, freq_chunk_ix, false, buf);
 }
 
-bool write_vis_chunk(hid_t vis_group,
+bool write_vis_chunk(hid_t vis_group, struct vis_ds_cache *cache,
                     struct bl_data *bl,
                     int time_chunk_size, int freq_chunk_size,
                     int time_chunk_ix, int freq_chunk_ix,
                     double complex *buf)
 {
-    return _rw_vis_chunk(vis_group, bl, time_chunk_size, freq_chunk_size, time_chunk_ix, freq_chunk_ix,
-                         true, buf);
+    return _rw_vis_chunk(vis_group, cache, bl, time_chunk_size, freq_chunk_size,
+                         time_chunk_ix, freq_chunk_ix, true, buf);
+}
+
+// Write only the valid part of a visibility chunk: for every time
+// step t the frequencies [ranges[2*t], ranges[2*t+1]). The rest of the
+// chunk is left alone, so writers contributing to the same chunk can
+// share a file without merging. Without ranges nothing gets selected,
+// which is how a process takes part in a collective write without data.
+bool write_vis_chunk_ranges(hid_t vis_group, struct vis_ds_cache *cache,
+                            struct bl_data *bl,
+                            int time_chunk_size, int freq_chunk_size,
+                            int time_chunk_ix, int freq_chunk_ix,
+                            const int *ranges, hid_t dxpl,
+                            double complex *buf)
+{
+    hid_t vis_ds, vis_dsp;
+    int row; bool owned;
+    if (!_get_vis_ds(cache, vis_group, bl, false, &vis_ds, &vis_dsp, &row, &owned))
+        return false;
+
+    // Select valid range of every time step, both in memory and file
+    hsize_t chunk_dims[] = { time_chunk_size, freq_chunk_size, 1 };
+    hid_t mem_dsp = H5Screate_simple(3, chunk_dims, chunk_dims);
+    H5Sselect_none(mem_dsp); H5Sselect_none(vis_dsp);
+    int t;
+    for (t = 0; ranges && t < time_chunk_size; t++) {
+        const int i0 = ranges[2*t], i1 = ranges[2*t+1];
+        if (i1 <= i0) continue;
+        hsize_t mem_start[] = { t, i0, 0 };
+        hsize_t count[] = { 1, i1 - i0, 1 };
+        H5Sselect_hyperslab(mem_dsp, H5S_SELECT_OR, mem_start, NULL, count, NULL);
+        _select_vis(vis_dsp, H5S_SELECT_OR, row, time_chunk_ix * time_chunk_size + t,
+                    freq_chunk_ix * freq_chunk_size + i0, 1, i1 - i0);
+    }
+
+    bool success = H5Dwrite(vis_ds, dtype_cpx, mem_dsp, vis_dsp, dxpl, buf) >= 0;
+    H5Sclose(mem_dsp);
+    if (owned) {
+        H5Sclose(vis_dsp);
+        H5Dclose(vis_ds);
+    }
+    return success;
 }
 
 int load_sep_kern(const char *filename, struct sep_kernel_data *sepkern, bool load_corr)
@@ -739,3 +1182,77 @@ void *read_hdf5(int size, const char *file, char *name, ...)
     H5Dclose(dset); H5Fclose(f);
     return data;
 }
+
+// Open dataset with "row_count" rows of "row_size" bytes. The rows
+// are either along the first dimension, or consecutive in a flat
+// (one-dimensional) dataset.
+bool open_hdf5_rows(struct hdf5_rows *rows, int row_count, size_t row_size,
+                    const char *file, const char *name)
+{
+    rows->file = rows->name = NULL;
+    rows->f = H5Fopen(file, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (rows->f < 0) {
+        fprintf(stderr, "Could not open %s!\n", file);
+        return false;
+    }
+    rows->dset = H5Dopen(rows->f, name, H5P_DEFAULT);
+    if (rows->dset < 0) {
+        fprintf(stderr, "Could not open dataset %s in %s!\n", name, file);
+        H5Fclose(rows->f);
+        return false;
+    }
+    // Check overall size and shape
+    rows->type = H5Dget_type(rows->dset);
+    hid_t dsp = H5Dget_space(rows->dset);
+    hsize_t dims[H5S_MAX_RANK];
+    int rank = H5Sget_simple_extent_dims(dsp, dims, NULL);
+    size_t elem_size = H5Tget_size(rows->type);
+    size_t npoints = H5Sget_simple_extent_npoints(dsp);
+    H5Sclose(dsp);
+    if (npoints * elem_size != (size_t)row_count * row_size ||
+        (rank > 1 && dims[0] != (hsize_t)row_count)) {
+        fprintf(stderr, "Dataset %s in %s has wrong extend (%zu*%zu != %d*%zu)\n",
+                name, file, npoints, elem_size, row_count, row_size);
+        close_hdf5_rows(rows);
+        return false;
+    }
+    rows->file = file; rows->name = name;
+    rows->row_count = row_count;
+    rows->row_size = row_size;
+    return true;
+}
+
+// Read rows [row0, row1) into data
+bool read_hdf5_rows(struct hdf5_rows *rows, int row0, int row1, void *data)
+{
+    assert(row0 >= 0 && row0 <= row1 && row1 <= rows->row_count);
+    hid_t dsp = H5Dget_space(rows->dset);
+    hsize_t start[H5S_MAX_RANK], count[H5S_MAX_RANK];
+    int i, rank = H5Sget_simple_extent_dims(dsp, count, NULL);
+    for (i = 0; i < rank; i++)
+        start[i] = 0;
+    if (rank > 1) {
+        start[0] = row0; count[0] = row1 - row0;
+    } else {
+        const hsize_t row_elems = rows->row_size / H5Tget_size(rows->type);
+        start[0] = row0 * row_elems; count[0] = (row1 - row0) * row_elems;
+    }
+    H5Sselect_hyperslab(dsp, H5S_SELECT_SET, start, NULL, count, NULL);
+    hsize_t mem_size = (row1 - row0) * rows->row_size / H5Tget_size(rows->type);
+    hid_t mem_dsp = H5Screate_simple(1, &mem_size, NULL);
+    herr_t err = H5Dread(rows->dset, rows->type, mem_dsp, dsp, H5P_DEFAULT, data);
+    H5Sclose(mem_dsp); H5Sclose(dsp);
+    if (err < 0) {
+        fprintf(stderr, "Failed to read rows %d-%d of %s in %s!\n",
+                row0, row1, rows->name, rows->file);
+        return false;
+    }
+    return true;
+}
+
+void close_hdf5_rows(struct hdf5_rows *rows)
+{
+    H5Tclose(rows->type);
+    H5Dclose(rows->dset); H5Fclose(rows->f);
+    rows->file = rows->name = NULL;
+}
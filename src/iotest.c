@@ -1,6 +1,7 @@
 
 #include "grid.h"
 #include "config.h"
+#include "pool.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -226,15 +227,15 @@ enum Opts
         Opt_flag = 0,
 
         Opt_telescope, Opt_fov, Opt_dec, Opt_time, Opt_freq,
-        Opt_grid, Opt_grid_x0, Opt_grid_downsample, Opt_vis_set,
+        Opt_grid, Opt_grid_x0, Opt_grid_downsample, Opt_w_grid, Opt_w_grid_step, Opt_vis_set,
         Opt_recombine, Opt_rec_aa, Opt_rec_set,
-        Opt_rec_load_facet, Opt_rec_load_facet_hdf5, Opt_batch_rows,
-        Opt_facet_workers, Opt_plan_workers,
+        Opt_rec_load_facet, Opt_rec_load_facet_hdf5, Opt_batch_rows, Opt_fill_threads,
+        Opt_facet_workers, Opt_plan_workers, Opt_aggregators,
         Opt_parallel_cols, Opt_dont_retain_bf,
         Opt_source_count, Opt_source_seed, Opt_vis_checks, Opt_grid_checks,
-        Opt_max_error, Opt_send_queue,
+        Opt_max_error, Opt_degrid_precision, Opt_send_queue,
         Opt_bls_per_task, Opt_subgrid_queue, Opt_task_queue, Opt_visibility_queue,
-        Opt_writer_count,
+        Opt_vis_backend, Opt_vis_layout, Opt_vis_shared, Opt_hdf5_profile, Opt_hdf5_align, Opt_writer_count, Opt_writer_routing, Opt_writer_cache, Opt_writer_ds_cache, Opt_writer_uring, Opt_pool_pages,
         Opt_statsd, Opt_statsd_port,
     };
 
@@ -254,8 +255,11 @@ bool set_cmdarg_config(int argc, char **argv,
         {"grid",       required_argument, 0, Opt_grid },
         {"grid-x0",    required_argument, 0, Opt_grid_x0 },
         {"grid-downsample", required_argument, 0, Opt_grid_downsample },
+        {"w-grid",     required_argument, 0, Opt_w_grid },
+        {"w-grid-step", required_argument, 0, Opt_w_grid_step },
         {"vis-set",    required_argument, 0, Opt_vis_set},
         {"vis-round-to-wplane",no_argument,&cfg->vis_round_to_wplane, true },
+        {"w-towers",   no_argument,       &cfg->vis_wtowers, true },
         {"add-meta",   no_argument,       &cfg->vis_skip_metadata, false },
         {"dump-baseline-bins", no_argument, &cfg->config_dump_baseline_bins, true },
         {"dump-subgrid-work", no_argument, &cfg->config_dump_subgrid_work, true },
@@ -266,23 +270,38 @@ bool set_cmdarg_config(int argc, char **argv,
         {"load-facet", required_argument, 0, Opt_rec_load_facet },
         {"load-facet-hdf5", required_argument, 0, Opt_rec_load_facet_hdf5 },
         {"batch-rows", required_argument, 0, Opt_batch_rows },
+        {"fill-threads", required_argument, 0, Opt_fill_threads },
 
         {"source-count",    required_argument, 0, Opt_source_count },
         {"source-seed",     required_argument, 0, Opt_source_seed },
         {"vis-check-freq",  required_argument, 0, Opt_vis_checks },
         {"grid-check-freq", required_argument, 0, Opt_grid_checks },
         {"max-error",       required_argument, 0, Opt_max_error },
+        {"degrid-precision",required_argument, 0, Opt_degrid_precision },
+        {"pool-pages",      required_argument, 0, Opt_pool_pages },
 
         {"facet-workers",   required_argument, 0, Opt_facet_workers },
         {"plan-workers",    required_argument, 0, Opt_plan_workers },
+        {"aggregators",     required_argument, 0, Opt_aggregators },
         {"parallel-columns",no_argument,       &cfg->produce_parallel_cols, true },
         {"dont-retain-bf",  no_argument,       &cfg->produce_retain_bf, false },
+        {"real-facets",     no_argument,       &cfg->produce_real_facets, true },
         {"bls-per-task",    required_argument, 0, Opt_bls_per_task },
         {"send-queue",      required_argument, 0, Opt_send_queue },
         {"subgrid-queue",   required_argument, 0, Opt_subgrid_queue },
         {"task-queue",      required_argument, 0, Opt_task_queue },
         {"visibility-queue",required_argument, 0, Opt_visibility_queue },
+        {"vis-backend",     required_argument, 0, Opt_vis_backend },
+        {"vis-layout",      required_argument, 0, Opt_vis_layout },
+        {"vis-shared",      required_argument, 0, Opt_vis_shared },
+        {"hdf5-profile",    required_argument, 0, Opt_hdf5_profile },
+        {"hdf5-align",      required_argument, 0, Opt_hdf5_align },
         {"writer-count",    required_argument, 0, Opt_writer_count },
+        {"writer-routing",  required_argument, 0, Opt_writer_routing },
+        {"writer-cache",    required_argument, 0, Opt_writer_cache },
+        {"writer-ds-cache", required_argument, 0, Opt_writer_ds_cache },
+        {"writer-uring",    required_argument, 0, Opt_writer_uring },
+        {"writer-direct-chunks", no_argument, &cfg->vis_writer_direct_chunks, true },
         {"fork-writer",     no_argument,       &cfg->vis_fork_writer, true },
         {"check-existing",  no_argument,       &cfg->vis_check_existing, true },
 
@@ -300,16 +319,17 @@ bool set_cmdarg_config(int argc, char **argv,
     char subgrid_degrid_path[256]; char subgrid_path_hdf5[256];
     double subgrid_threshold = 1e-8, subgrid_fct_threshold = 1e-8,
            subgrid_degrid_threshold = 1e-8;
-    int facet_workers = (world_size + 1) / 2;
+    int facet_workers = -1; // default: half of non-aggregator ranks
     int plan_workers = world_size;
     double gridder_x0 = 0; int gridder_downsample = 0;
     char gridder_path[256]; char vis_path[256];
+    char w_gridder_path[256]; int w_gridder_step = 1;
     char statsd_addr[256]; char statsd_port[256] = "8125";
     int source_count = 0; int source_seed = 0;
     memset(&spec, 0, sizeof(spec));
     spec.dec = 90 * atan(1) * 4 / 180;
     memset(&recombine_pars, 0, sizeof(recombine_pars));
-    aa_path[0] = gridder_path[0] = facet_path[0] = facet_path_hdf5[0] =
+    aa_path[0] = gridder_path[0] = w_gridder_path[0] = facet_path[0] = facet_path_hdf5[0] =
         subgrid_path[0] = subgrid_fct_path[0] = subgrid_degrid_path[0] =
         subgrid_path_hdf5[0] = vis_path[0] = statsd_addr[0] = 0;
 
@@ -367,6 +387,18 @@ bool set_cmdarg_config(int argc, char **argv,
                 invalid=true; fprintf(stderr, "ERROR: Could not parse 'grid-downsample' option!\n");
             }
             break;
+        case Opt_w_grid:
+            nscan = sscanf(optarg, "%255s", w_gridder_path);
+            if (nscan < 1) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'w-grid' option!\n");
+            }
+            break;
+        case Opt_w_grid_step:
+            nscan = sscanf(optarg, "%d", &w_gridder_step);
+            if (nscan < 1 || w_gridder_step < 1) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'w-grid-step' option!\n");
+            }
+            break;
         case Opt_vis_set:
             if (load_vis_parset(optarg, recombine_pars[0], &spec))
                 have_vis_spec = true;
@@ -408,6 +440,12 @@ bool set_cmdarg_config(int argc, char **argv,
                 invalid=true; fprintf(stderr, "ERROR: Could not parse 'batch-rows' option!\n");
             }
             break;
+        case Opt_fill_threads:
+            nscan = sscanf(optarg, "%d", &cfg->produce_fill_threads);
+            if (nscan != 1 || cfg->produce_fill_threads < 0) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'fill-threads' option!\n");
+            }
+            break;
         case Opt_facet_workers:
             nscan = sscanf(optarg, "%d", &facet_workers);
             if (nscan != 1) {
@@ -420,6 +458,12 @@ bool set_cmdarg_config(int argc, char **argv,
                 invalid=true; fprintf(stderr, "ERROR: Could not parse 'plan-workers' option!\n");
             }
             break;
+        case Opt_aggregators:
+            nscan = sscanf(optarg, "%d", &cfg->aggregator_workers);
+            if (nscan != 1 || cfg->aggregator_workers < 0) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'aggregators' option!\n");
+            }
+            break;
         case Opt_source_count:
             nscan = sscanf(optarg, "%d", &source_count);
             if (nscan != 1) {
@@ -450,6 +494,83 @@ bool set_cmdarg_config(int argc, char **argv,
                 invalid=true; fprintf(stderr, "ERROR: Could not parse 'max-error' option!\n");
             }
             break;
+        case Opt_degrid_precision:
+            if (!strcmp(optarg, "single")) {
+                cfg->vis_degrid_single = true;
+            } else if (!strcmp(optarg, "double")) {
+                cfg->vis_degrid_single = false;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'degrid-precision' option!\n");
+            }
+            break;
+        case Opt_pool_pages:
+            if (!strcmp(optarg, "default")) {
+                cfg->vis_pool_pages = POOL_PAGES_DEFAULT;
+            } else if (!strcmp(optarg, "thp")) {
+                cfg->vis_pool_pages = POOL_PAGES_THP;
+            } else if (!strcmp(optarg, "2m")) {
+                cfg->vis_pool_pages = POOL_PAGES_2M;
+            } else if (!strcmp(optarg, "1g")) {
+                cfg->vis_pool_pages = POOL_PAGES_1G;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'pool-pages' option!\n");
+            }
+            break;
+        case Opt_writer_routing:
+            if (!strcmp(optarg, "busy")) {
+                cfg->vis_writer_routing = WRITER_ROUTE_BUSY;
+            } else if (!strcmp(optarg, "baseline")) {
+                cfg->vis_writer_routing = WRITER_ROUTE_BASELINE;
+            } else if (!strcmp(optarg, "chunk")) {
+                cfg->vis_writer_routing = WRITER_ROUTE_CHUNK;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'writer-routing' option!\n");
+            }
+            break;
+        case Opt_vis_backend:
+            if (!strcmp(optarg, "hdf5")) {
+                cfg->vis_backend = VIS_BACKEND_HDF5;
+            } else if (!strcmp(optarg, "raw")) {
+                cfg->vis_backend = VIS_BACKEND_RAW;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'vis-backend' option!\n");
+            }
+            break;
+        case Opt_vis_layout:
+            if (!strcmp(optarg, "groups")) {
+                cfg->vis_layout = VIS_LAYOUT_GROUPS;
+            } else if (!strcmp(optarg, "single")) {
+                cfg->vis_layout = VIS_LAYOUT_SINGLE;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'vis-layout' option!\n");
+            }
+            break;
+        case Opt_vis_shared:
+            if (!strcmp(optarg, "off")) {
+                cfg->vis_shared_file = VIS_SHARED_OFF;
+            } else if (!strcmp(optarg, "independent")) {
+                cfg->vis_shared_file = VIS_SHARED_INDEPENDENT;
+            } else if (!strcmp(optarg, "collective")) {
+                cfg->vis_shared_file = VIS_SHARED_COLLECTIVE;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'vis-shared' option!\n");
+            }
+            break;
+        case Opt_hdf5_profile:
+            if (!strcmp(optarg, "default")) {
+                cfg->vis_hdf5_profile = HDF5_PROFILE_DEFAULT;
+            } else if (!strcmp(optarg, "pfs")) {
+                cfg->vis_hdf5_profile = HDF5_PROFILE_PFS;
+            } else {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'hdf5-profile' option!\n");
+            }
+            break;
+        case Opt_hdf5_align:
+            nscan = sscanf(optarg, "%d", &cfg->vis_hdf5_align);
+            if (nscan != 1 || cfg->vis_hdf5_align < 4) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'hdf5-align' option!\n");
+            }
+            break;
         case Opt_bls_per_task:
             nscan = sscanf(optarg, "%d", &cfg->vis_bls_per_task);
             if (nscan != 1) {
@@ -486,6 +607,24 @@ bool set_cmdarg_config(int argc, char **argv,
                 invalid=true; fprintf(stderr, "ERROR: Could not parse 'writer-count' option!\n");
             }
             break;
+        case Opt_writer_cache:
+            nscan = sscanf(optarg, "%d", &cfg->vis_writer_cache);
+            if (nscan != 1 || cfg->vis_writer_cache < 0) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'writer-cache' option!\n");
+            }
+            break;
+        case Opt_writer_ds_cache:
+            nscan = sscanf(optarg, "%d", &cfg->vis_writer_ds_cache);
+            if (nscan != 1 || cfg->vis_writer_ds_cache < 0) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'writer-ds-cache' option!\n");
+            }
+            break;
+        case Opt_writer_uring:
+            nscan = sscanf(optarg, "%d", &cfg->vis_writer_uring_depth);
+            if (nscan != 1 || cfg->vis_writer_uring_depth < 0) {
+                invalid=true; fprintf(stderr, "ERROR: Could not parse 'writer-uring' option!\n");
+            }
+            break;
         case Opt_statsd:
             strncpy(statsd_addr, optarg, 254); statsd_addr[255] = 0;
             break;
@@ -517,6 +656,36 @@ bool set_cmdarg_config(int argc, char **argv,
     if (!recombine_pars[0]) {
         invalid=1; fprintf(stderr, "ERROR: Please supply recombination parameters!\n");
     }
+    if (facet_workers < 0) {
+        facet_workers = (world_size - cfg->aggregator_workers + 1) / 2;
+    }
+    if (cfg->aggregator_workers > 0 && (!vis_path[0] || world_size == 1)) {
+        invalid=1; fprintf(stderr, "ERROR: Aggregators need a visibility path and multiple workers!\n");
+    }
+    if (cfg->aggregator_workers > 0 && cfg->vis_fork_writer) {
+        fprintf(stderr, "WARNING: Streamers forward visibilities to aggregators using threads, not forking writers!\n");
+    }
+    if (cfg->vis_writer_cache > 0 && cfg->vis_writer_routing == WRITER_ROUTE_BUSY) {
+        fprintf(stderr, "WARNING: Write-back cache needs fixed writers per chunk, routing by chunk!\n");
+        cfg->vis_writer_routing = WRITER_ROUTE_CHUNK;
+    }
+    if (cfg->vis_writer_uring_depth > 0 && cfg->vis_backend != VIS_BACKEND_RAW) {
+        invalid=1; fprintf(stderr, "ERROR: Asynchronous writes require --vis-backend=raw!\n");
+    }
+    if (cfg->vis_shared_file != VIS_SHARED_OFF) {
+#ifndef H5_HAVE_PARALLEL
+        invalid=1; fprintf(stderr, "ERROR: Shared visibility files need parallel HDF5 (see HDF5_INC in Makefile)!\n");
+#endif
+        if (cfg->vis_backend != VIS_BACKEND_HDF5 || cfg->vis_writer_cache > 0 ||
+            cfg->vis_writer_direct_chunks) {
+            invalid=1; fprintf(stderr, "ERROR: Shared visibility files need the HDF5 backend, "
+                               "without write-back cache or direct chunk writes!\n");
+        }
+        if (cfg->vis_writer_count > 1 || cfg->vis_fork_writer) {
+            fprintf(stderr, "WARNING: Shared visibility files use one writer thread per process!\n");
+            cfg->vis_writer_count = 1;
+        }
+    }
 
     if (invalid) {
         printf("Usage: %s [options] <path>\n", argv[0]);
@@ -532,8 +701,23 @@ bool set_cmdarg_config(int argc, char **argv,
         printf("  --freq=<start>:<end>/<steps>[/<chunk>]  Set frequency channels (in Hz).\n");
         printf("  --grid=<path>          Gridding function to use\n");
         printf("  --grid-x0=<path>       Override gridder's x0 (useable FoV)\n");
+        printf("  --w-grid=<path>        w-gridding function to use (3D degridding)\n");
+        printf("  --w-grid-step=<N>      Number of w-planes covered per subgrid (default 1)\n");
+        printf("  --w-towers             Derive w-levels from subgrids at w=0 on streamers\n");
+        printf("  --degrid-precision=[single/double]  Precision of subgrids for degridding\n");
+        printf("  --pool-pages=[default/thp/2m/1g]  Pages backing streamer subgrid buffers\n");
         printf("  --vis=[vlaa/ska_low]   Use standard configuration sets\n");
+        printf("  --vis-backend=[hdf5/raw]  Visibility file format (raw: flat file, O_DIRECT)\n");
+        printf("  --vis-layout=[groups/single]  HDF5 layout: dataset per baseline, or one for all\n");
+        printf("  --vis-shared=[off/independent/collective]  Write one file shared by all processes (MPI-IO)\n");
+        printf("  --hdf5-profile=[default/pfs]  HDF5 tuning: library defaults, or for parallel file systems\n");
+        printf("  --hdf5-align=<KB>      Alignment and page size for HDF5 profile (stripe size, default 1024)\n");
         printf("  --writer-count=<N>     Number of parallel writers per process\n");
+        printf("  --writer-routing=[busy/baseline/chunk]  Assign chunks to writers (default baseline)\n");
+        printf("  --writer-cache=<MB>    Write-back cache per writer, merges chunks before writing\n");
+        printf("  --writer-ds-cache=<N>  Visibility datasets to keep open per writer (default 256)\n");
+        printf("  --writer-uring=<N>     Keep N asynchronous writes in flight per writer (raw backend)\n");
+        printf("  --writer-direct-chunks Write visibility chunks directly (H5Dwrite_chunk)\n");
         printf("  --fork-writer          Fork separate processes for writers\n");
         printf("\n");
         printf("Sky Parameters:\n");
@@ -549,12 +733,15 @@ bool set_cmdarg_config(int argc, char **argv,
         printf("  --rec-aa=<path>        Anti-aliasing function to use for recombination\n");
         printf("  --rec-set=[test]       Selection recombination parameter set\n");
         printf("  --batch-rows=<N>       Image rows to batch per thread\n");
+        printf("  --fill-threads=<N>     Threads filling the next w-level's facets while streaming (doubles facet memory)\n");
         printf("\n");
         printf("Distribution Parameters:\n");
         printf("  --facet-workers=<val>  Number of workers holding facets (default: half)\n");
         printf("  --plan-workers=<val>   Override number of workers to plan for\n");
+        printf("  --aggregators=<N>      Number of workers collecting and writing visibilities\n");
         printf("  --dont-retain-bf       Discard BF term. Saves memory at expense of compute.\n");
         printf("  --parallel-columns     Work on grid columns in parallel. Worse for distribution.\n");
+        printf("  --real-facets          Use real-valued facets (halves facet memory, no w-stacking)\n");
         printf("  --send-queue=<N>       Outgoing subgrid queue length (default 8)\n");
         printf("  --bls-per-task=<N>     Number of baselines per OpenMP task (default 256)\n");
         printf("  --subgrid-queue=<N>    Incoming subgrid queue length (default 8)\n");
@@ -586,6 +773,14 @@ bool set_cmdarg_config(int argc, char **argv,
             return false;
         }
     }
+    if (w_gridder_path[0]) {
+        if (!config_set_w_degrid(cfg, w_gridder_path, w_gridder_step)) {
+            fprintf(stderr, "ERROR: Could not access w-gridder at %s!\n", w_gridder_path);
+            return false;
+        }
+    } else if (w_gridder_step != 1) {
+        fprintf(stderr, "WARNING: Subgrid w-step requires a w-gridder, ignoring!\n");
+    }
     if (have_vis_spec) {
         config_set_visibilities(cfg, &spec, vis_path[0] ? vis_path : NULL);
     }
@@ -594,7 +789,7 @@ bool set_cmdarg_config(int argc, char **argv,
     }
 
     // Make work assignment
-    int subgrid_workers = plan_workers - facet_workers;
+    int subgrid_workers = plan_workers - facet_workers - cfg->aggregator_workers;
     if (!config_assign_work(cfg, facet_workers, subgrid_workers))
         return false;
 
@@ -649,9 +844,9 @@ int main(int argc, char *argv[]) {
 
     // Plane size matches world size? Generally means we were only
     // test-running the configuration phase.
-    if (config.facet_workers + config.subgrid_workers != world_size) {
-        printf("Plan size (%d+%d) does not match world size (%d), aborting.\n",
-               config.facet_workers, config.subgrid_workers, world_size);
+    if (config.facet_workers + config.subgrid_workers + config.aggregator_workers != world_size) {
+        printf("Plan size (%d+%d+%d) does not match world size (%d), aborting.\n",
+               config.facet_workers, config.subgrid_workers, config.aggregator_workers, world_size);
         exit(0);
     }
 
@@ -672,7 +867,13 @@ int main(int argc, char *argv[]) {
         // Determine number of producers and streamers (pretty arbitrary for now)
         int i;
 
-        if (world_rank >= config.subgrid_workers) {
+        if (world_rank >= config.subgrid_workers + config.facet_workers) {
+            int aggregator_id = world_rank - config.subgrid_workers - config.facet_workers;
+            printf("%s pid %d role: Aggregator %d\n", proc_name, getpid(), aggregator_id);
+
+            result = aggregator(&config, aggregator_id);
+
+        } else if (world_rank >= config.subgrid_workers) {
             int producer_id = world_rank - config.subgrid_workers;
             printf("%s pid %d role: Producer %d\n", proc_name, getpid(), producer_id);
 
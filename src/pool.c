@@ -0,0 +1,165 @@
+
+#include "pool.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// Header in front of every buffer. Padded to a cache line so buffer
+// data stays aligned for vector loads.
+#define POOL_HEADER_SIZE 64
+struct pool_buffer
+{
+    struct pool_buffer *next;
+    size_t map_size;
+    int node;
+};
+
+// NUMA node the calling thread is currently running on
+static int pool_current_node()
+{
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < POOL_MAX_NODES)
+        return node;
+#endif
+    return 0;
+}
+
+static size_t pool_page_size(enum pool_pages pages)
+{
+    switch (pages) {
+    case POOL_PAGES_THP: case POOL_PAGES_2M: return (size_t)1 << 21;
+    case POOL_PAGES_1G: return (size_t)1 << 30;
+    default: return sysconf(_SC_PAGESIZE);
+    }
+}
+
+static void pool_set_pages(struct pool *pool, enum pool_pages pages)
+{
+    const size_t page = pool_page_size(pages);
+    pool->pages = pages;
+    pool->map_size = (POOL_HEADER_SIZE + pool->size + page - 1) / page * page;
+}
+
+bool pool_init(struct pool *pool, const char *name, size_t size, enum pool_pages pages)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->size = size;
+    pool_set_pages(pool, pages);
+    return pthread_mutex_init(&pool->lock, NULL) == 0;
+}
+
+// Map a new buffer. Falls back to transparent huge pages if explicit
+// huge pages are not available (see /proc/sys/vm/nr_hugepages).
+static struct pool_buffer *pool_map(struct pool *pool)
+{
+    void *buf = MAP_FAILED;
+    if (pool->pages == POOL_PAGES_2M || pool->pages == POOL_PAGES_1G) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+            (pool->pages == POOL_PAGES_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+        buf = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (buf == MAP_FAILED) {
+            fprintf(stderr, "WARNING: Could not map huge pages for %s pool, "
+                    "using transparent huge pages instead!\n", pool->name);
+            pool_set_pages(pool, POOL_PAGES_THP);
+        }
+    }
+    if (buf == MAP_FAILED) {
+        // Pages get placed on first touch, i.e. by the requesting thread
+        buf = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (pool->pages == POOL_PAGES_THP)
+            madvise(buf, pool->map_size, MADV_HUGEPAGE);
+#endif
+    }
+    pool->mapped++;
+    ((struct pool_buffer *)buf)->map_size = pool->map_size;
+    return (struct pool_buffer *)buf;
+}
+
+void *pool_alloc(struct pool *pool)
+{
+    const int node = pool_current_node();
+    struct pool_buffer *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    buf = pool->free[node];
+    if (buf) {
+        pool->free[node] = buf->next;
+        pool->reused++;
+    } else {
+        buf = pool_map(pool);
+    }
+    if (buf) {
+        pool->in_use++;
+        if (pool->in_use > pool->high_water)
+            pool->high_water = pool->in_use;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!buf)
+        return NULL;
+
+    buf->node = node;
+    return (char *)buf + POOL_HEADER_SIZE;
+}
+
+void pool_free(struct pool *pool, void *data)
+{
+    if (!data) return;
+    struct pool_buffer *buf = (struct pool_buffer *)((char *)data - POOL_HEADER_SIZE);
+    pthread_mutex_lock(&pool->lock);
+    buf->next = pool->free[buf->node];
+    pool->free[buf->node] = buf;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_report(struct pool *pool)
+{
+    static const char *page_names[] = { "default", "thp", "2m", "1g" };
+    printf("Pool %s: %.2f MB buffers, %d mapped, high-water %d (%.2f GB), "
+           "%"PRIu64" reused, %s pages\n",
+           pool->name, (double)pool->size / 1000000, pool->mapped, pool->high_water,
+           (double)pool->high_water * pool->map_size / 1000000000, pool->reused,
+           page_names[pool->pages]);
+}
+
+void pool_destroy(struct pool *pool)
+{
+    int node;
+    assert(pool->in_use == 0);
+    for (node = 0; node < POOL_MAX_NODES; node++) {
+        while (pool->free[node]) {
+            struct pool_buffer *buf = pool->free[node];
+            pool->free[node] = buf->next;
+            munmap(buf, buf->map_size);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
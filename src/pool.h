@@ -0,0 +1,46 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Page types to back pool buffers with
+enum pool_pages {
+    POOL_PAGES_DEFAULT = 0, // whatever the system gives us
+    POOL_PAGES_THP, // transparent huge pages (madvise)
+    POOL_PAGES_2M, // explicit 2 MB huge pages (MAP_HUGETLB)
+    POOL_PAGES_1G // explicit 1 GB huge pages (MAP_HUGETLB)
+};
+
+#define POOL_MAX_NODES 64
+
+// Pool of fixed-size buffers. Freed buffers are kept on free lists
+// per NUMA node, and get handed back out to threads running on the
+// same node. New buffers get mapped fresh, so first touch by the
+// requesting thread places them on its node.
+struct pool
+{
+    const char *name;
+    size_t size; // usable size of a buffer
+    size_t map_size; // mapped size, including header
+    enum pool_pages pages;
+
+    // Free lists, per NUMA node
+    pthread_mutex_t lock;
+    struct pool_buffer *free[POOL_MAX_NODES];
+
+    // Statistics
+    int mapped, in_use, high_water;
+    uint64_t reused;
+};
+
+bool pool_init(struct pool *pool, const char *name, size_t size, enum pool_pages pages);
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *buf);
+void pool_report(struct pool *pool);
+void pool_destroy(struct pool *pool);
+
+#endif // POOL_H
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
 #include <omp.h>
 
 #ifndef NO_MPI
@@ -16,6 +17,33 @@
 #define MPI_REQUEST_NULL 0
 #endif
 
+// Where subgrids go, indexed by subgrid column, row and w-level
+// (see producer_routing_init). Replaces walking the subgrid work list
+// for every subgrid we produce.
+struct producer_routing {
+    int iu_min, iv_min, iw_min;
+    int nu, nv, nw;
+    int *off_u; // [nw][nu] column offset, INT_MIN if no work
+    int *off_v; // [nw][nu][nv] row offset, INT_MIN if no work
+    int *dest_start; // [nw*nu*nv+1] start of subgrid's destinations
+    int *dest; // (subgrid worker, work index) pairs
+};
+
+// Facet state kept across w-levels. For facets loaded from a file, we
+// keep the data as loaded, and apply a w-stacking phase screen
+// exp(2 pi i w n(l,m)) to it per w-level (see producer_facet_screen).
+struct producer_facet {
+    double complex *F0; // [yB_size * F_stride0], NULL if not from file
+    bool separable; // n(l,m) ~ n(l,0) + n(0,m), see producer_facets_init
+    double *n_l, *n_m; // [yB_size], n by column and row if separable
+    double *n; // [yB_size * yB_size] otherwise
+    bool *rows; // [yB_size], rows that can be non-zero (NULL: all), see producer_facet_rows
+};
+
+// Maximum phase error (in radians) we accept from the separable
+// approximation of the phase screen
+#define FACET_SCREEN_MAX_PHASE_ERROR 1e-7
+
 struct producer_stream {
 
     // Facet worker id, number of facets to work on
@@ -25,6 +53,8 @@ struct producer_stream {
     // Stream targets
     int streamer_count;
     int *streamer_ranks;
+    const struct producer_routing *routing;
+    struct producer_facet *facets; // [facet_work_count]
 
     // Send queue
     int send_queue_length;
@@ -37,14 +67,117 @@ struct producer_stream {
     // Worker structure
     struct recombine2d_worker worker;
 
+    // Facet dataset currently open (if reading facets from HDF5)
+    struct hdf5_rows facet_rows;
+
     // Time (in s) spent in different stages
     double mpi_wait_time, mpi_send_time;
+    double fill_time, fill_wait_time; // pipelined filling, see producer_pipeline
 
 };
 
+static inline int routing_index(const struct producer_routing *routing, int iu, int iv, int iw)
+{
+    return ((iw - routing->iw_min) * routing->nu + iu - routing->iu_min) * routing->nv
+        + iv - routing->iv_min;
+}
+
+static void producer_routing_free(struct producer_routing *routing);
+
+// Build routing table from subgrid work list
+static bool producer_routing_init(struct work_config *wcfg, struct producer_routing *routing)
+{
+    const int nwork = wcfg->subgrid_workers * wcfg->subgrid_max_work;
+    int iwork, iw_max = INT_MIN;
+    memset(routing, 0, sizeof(*routing));
+    routing->iu_min = wcfg->iu_min; routing->nu = wcfg->iu_max - wcfg->iu_min + 1;
+    routing->iv_min = wcfg->iv_min; routing->nv = wcfg->iv_max - wcfg->iv_min + 1;
+    routing->iw_min = INT_MAX;
+    for (iwork = 0; iwork < nwork; iwork++) {
+        struct subgrid_work *work = wcfg->subgrid_work + iwork;
+        if (!work->nbl) continue;
+        if (work->iw < routing->iw_min) routing->iw_min = work->iw;
+        if (work->iw > iw_max) iw_max = work->iw;
+    }
+    if (iw_max < routing->iw_min || routing->nu <= 0 || routing->nv <= 0)
+        return true; // no work
+    routing->nw = iw_max - routing->iw_min + 1;
+
+    // Allocate
+    const int cols = routing->nw * routing->nu;
+    const int cells = cols * routing->nv;
+    routing->off_u = (int *)malloc(sizeof(int) * cols);
+    routing->off_v = (int *)malloc(sizeof(int) * cells);
+    routing->dest_start = (int *)calloc(cells + 1, sizeof(int));
+    int *last_worker = (int *)malloc(sizeof(int) * cells);
+    if (!routing->off_u || !routing->off_v || !routing->dest_start || !last_worker) {
+        free(last_worker);
+        producer_routing_free(routing);
+        return false;
+    }
+    int i;
+    for (i = 0; i < cols; i++) routing->off_u[i] = INT_MIN;
+    for (i = 0; i < cells; i++) { routing->off_v[i] = INT_MIN; last_worker[i] = -1; }
+
+    // Collect offsets, and count destinations. A subgrid can appear
+    // for multiple workers if it was split in work assignment
+    // (typically at the grid centre), but we only send it once per
+    // worker, for the first matching work item.
+    for (iwork = 0; iwork < nwork; iwork++) {
+        struct subgrid_work *work = wcfg->subgrid_work + iwork;
+        if (!work->nbl) continue;
+        const int iworker = iwork / wcfg->subgrid_max_work;
+        const int cell = routing_index(routing, work->iu, work->iv, work->iw);
+        assert(work->iu >= routing->iu_min && work->iu - routing->iu_min < routing->nu);
+        assert(work->iv >= routing->iv_min && work->iv - routing->iv_min < routing->nv);
+        if (routing->off_u[cell / routing->nv] == INT_MIN)
+            routing->off_u[cell / routing->nv] = work->subgrid_off_u;
+        if (routing->off_v[cell] == INT_MIN)
+            routing->off_v[cell] = work->subgrid_off_v;
+        if (last_worker[cell] != iworker) {
+            last_worker[cell] = iworker;
+            routing->dest_start[cell+1]++;
+        }
+    }
+    for (i = 0; i < cells; i++)
+        routing->dest_start[i+1] += routing->dest_start[i];
+
+    // Fill in destinations (ordered by worker, as work list)
+    routing->dest = (int *)malloc(sizeof(int) * 2 * (routing->dest_start[cells] + 1));
+    if (!routing->dest) {
+        free(last_worker);
+        producer_routing_free(routing);
+        return false;
+    }
+    int *fill = last_worker; // re-use as fill count
+    for (i = 0; i < cells; i++) fill[i] = 0;
+    for (iwork = 0; iwork < nwork; iwork++) {
+        struct subgrid_work *work = wcfg->subgrid_work + iwork;
+        if (!work->nbl) continue;
+        const int iworker = iwork / wcfg->subgrid_max_work;
+        const int cell = routing_index(routing, work->iu, work->iv, work->iw);
+        int *dest = routing->dest + 2 * (routing->dest_start[cell] + fill[cell]);
+        if (fill[cell] > 0 && dest[-2] == iworker)
+            continue;
+        dest[0] = iworker; dest[1] = iwork % wcfg->subgrid_max_work;
+        fill[cell]++;
+    }
+    free(last_worker);
+    return true;
+}
+
+static void producer_routing_free(struct producer_routing *routing)
+{
+    free(routing->off_u); free(routing->off_v);
+    free(routing->dest_start); free(routing->dest);
+    memset(routing, 0, sizeof(*routing));
+}
+
 void init_producer_stream(struct recombine2d_config *cfg, struct producer_stream *prod,
                           int facet_worker, int facet_work_count,
                           int streamer_count, int *streamer_ranks,
+                          const struct producer_routing *routing,
+                          struct producer_facet *facets,
                           int BF_batch, fftw_plan BF_plan,
                           int send_queue_length)
 {
@@ -55,6 +188,8 @@ void init_producer_stream(struct recombine2d_config *cfg, struct producer_stream
     // Set streamers
     prod->streamer_count = streamer_count;
     prod->streamer_ranks = streamer_ranks;
+    prod->routing = routing;
+    prod->facets = facets;
 
     // Initialise queue
     prod->send_queue_length = send_queue_length;
@@ -68,16 +203,22 @@ void init_producer_stream(struct recombine2d_config *cfg, struct producer_stream
     prod->NMBF_NMBF_queue =
         (double complex *)malloc(cfg->NMBF_NMBF_size * send_queue_length);
     recombine2d_init_worker(&prod->worker, cfg, BF_batch, BF_plan, FFTW_MEASURE);
+    prod->facet_rows.file = NULL;
 
     // Initialise statistics
     prod->bytes_sent = 0;
     prod->mpi_wait_time = prod->mpi_send_time = 0;
+    prod->fill_time = prod->fill_wait_time = 0;
 
 }
 
 void free_producer_stream(struct producer_stream *prod)
 {
     recombine2d_free_worker(&prod->worker);
+    if (prod->facet_rows.file) {
+#pragma omp critical
+        close_hdf5_rows(&prod->facet_rows);
+    }
 
     free(prod->requests);
     free(prod->NMBF_NMBF_queue);
@@ -136,6 +277,15 @@ void producer_dump_stats(struct work_config *wcfg, int facet_worker,
            prod->mpi_wait_time, 100 * prod->mpi_wait_time / producer_count / dt,
            prod->mpi_send_time, 100 * prod->mpi_send_time / producer_count / dt,
            idle, 100 * idle / producer_count / dt);
+    if (wcfg->produce_fill_threads > 0) {
+        double overlap = prod->fill_time - prod->fill_wait_time;
+        if (overlap < 0) overlap = 0;
+        printf("fill (%d threads): %.2f s, overlapped with streaming: %.2f s (%.1f%%), "
+               "streaming waited: %.2f s\n", wcfg->produce_fill_threads,
+               prod->fill_time, overlap,
+               prod->fill_time > 0 ? 100 * overlap / prod->fill_time : 0,
+               prod->fill_wait_time);
+    }
 }
 
 int make_subgrid_tag(struct work_config *wcfg,
@@ -157,25 +307,14 @@ void producer_send_subgrid(struct work_config *wcfg, struct producer_stream *pro
     // Extract subgrids along second axis
     double complex *NMBF_NMBF = NULL;
 
-    // Find streamer (subgrid workers) to send to
-    int iworker;
-    for (iworker = 0; iworker < wcfg->subgrid_workers; iworker++) {
-
-        // Check whether it is in streamer's work list. Note that
-        // it can appear for multiple workers if the subgrid was
-        // split in work assignment (typically at the grid centre).
-        struct subgrid_work *work_list = wcfg->subgrid_work +
-            iworker * wcfg->subgrid_max_work;
-        int iwork;
-        for (iwork = 0; iwork < wcfg->subgrid_max_work; iwork++) {
-            if (work_list[iwork].nbl &&
-                work_list[iwork].iu == iu &&
-                work_list[iwork].iv == iv &&
-                work_list[iwork].iw == iw)
-                break;
-        }
-        if (iwork >= wcfg->subgrid_max_work)
-            continue;
+    // Go through streamers (subgrid workers) to send to. Note that
+    // there can be multiple if the subgrid was split in work
+    // assignment (typically at the grid centre).
+    const struct producer_routing *routing = prod->routing;
+    const int cell = routing_index(routing, iu, iv, iw);
+    int idest;
+    for (idest = routing->dest_start[cell]; idest < routing->dest_start[cell+1]; idest++) {
+        const int iworker = routing->dest[2*idest], iwork = routing->dest[2*idest+1];
 
         // Select send slot if running in distributed mode
         int indx;
@@ -227,8 +366,50 @@ void producer_send_subgrid(struct work_config *wcfg, struct producer_stream *pro
 }
 
 
+// Facet coordinates of a source. Returns false if the source is
+// outside the facet.
+static bool producer_source_pos(struct recombine2d_config *cfg,
+                                struct facet_work *work,
+                                const double *source_xy, int *x0, int *x1)
+{
+    int il = source_xy[0], im = source_xy[1];
+    if (il - work->facet_off_l < -cfg->yB_size/2 ||
+        il - work->facet_off_l >= cfg->yB_size/2 ||
+        im - work->facet_off_m < -cfg->yB_size/2 ||
+        im - work->facet_off_m >= cfg->yB_size/2) {
+
+        return false;
+    }
+
+    // Keep in mind that the centre is at (0/0).
+    *x0 = (im - work->facet_off_m + cfg->yB_size) % cfg->yB_size;
+    *x1 = (il - work->facet_off_l + cfg->yB_size) % cfg->yB_size;
+    return true;
+}
+
+// Determine rows of a facet that producer_fill_facet can make
+// non-zero. Only facets made up of sources are sparse, and which rows
+// they touch does not depend on w. Returns NULL if all rows might be
+// non-zero.
+static bool *producer_facet_rows(struct work_config *wcfg,
+                                 struct facet_work *work)
+{
+    struct recombine2d_config *const cfg = &wcfg->recombine;
+    if (work->path || wcfg->source_count <= 0)
+        return NULL;
+    bool *rows = (bool *)calloc(cfg->yB_size, sizeof(bool));
+    if (!rows)
+        return NULL;
+    int i, x0, x1;
+    for (i = 0; i < wcfg->source_count; i++)
+        if (producer_source_pos(cfg, work, wcfg->source_xy + i*2, &x0, &x1))
+            rows[x0] = true;
+    return rows;
+}
+
 bool producer_fill_facet(struct work_config *wcfg,
                          struct facet_work *work,
+                         struct hdf5_rows *facet_rows,
                          double complex *F,
                          int source_count, double *source_xy, double *source_lmn,
                          double *source_corr,
@@ -262,38 +443,34 @@ bool producer_fill_facet(struct work_config *wcfg,
 
         printf("Reading facet data from %s:%s (%d-%d)...\n", work->hdf5, work->path, x0_start, x0_end);
 
-        // Make sure strides are as expected, then read
-        // TODO: Clearly HDF5 can do partial reads, optimise
+        // Make sure strides are as expected, then read just our rows,
+        // keeping the dataset open for the next chunk of the facet
         assert (cfg->F_stride0 == cfg->yB_size && cfg->F_stride1 == 1);
-        double complex *data;
+        bool success;
 #pragma omp critical
-        data = read_hdf5(cfg->F_size, work->hdf5, work->path);
-
-        // Copy
-        memcpy(F, data + offset / sizeof(double complex), size);
-        free(data);
+        {
+            if (facet_rows->file &&
+                (facet_rows->file != work->hdf5 || facet_rows->name != work->path))
+                close_hdf5_rows(facet_rows);
+            success = facet_rows->file ||
+                open_hdf5_rows(facet_rows, cfg->yB_size, sizeof(double complex) * cfg->yB_size,
+                               work->hdf5, work->path);
+            if (success)
+                success = read_hdf5_rows(facet_rows, x0_start, x0_end, F);
+        }
+        if (!success)
+            return false;
 
     } else if (source_count > 0) {
 
         // Place sources in gridder's usable region
         int i;
         for (i = 0; i < source_count; i++) {
-            int il = source_xy[i*2+0], im = source_xy[i*2+1];
 
             // Skip sources outside the current facet (region)
-            if (il - work->facet_off_l < -cfg->yB_size/2 ||
-                il - work->facet_off_l >= cfg->yB_size/2 ||
-                im - work->facet_off_m < -cfg->yB_size/2 ||
-                im - work->facet_off_m >= cfg->yB_size/2) {
-
-                continue;
-            }
-
-            // Calculate facet coordinates, keeping in mind that the
-            // centre is at (0/0).
-            int x0 = (im - work->facet_off_m + cfg->yB_size) % cfg->yB_size;
-            int x1 = (il - work->facet_off_l + cfg->yB_size) % cfg->yB_size;
-            if (x0 < x0_start || x0 >= x0_end) {
+            int x0, x1;
+            if (!producer_source_pos(cfg, work, source_xy + i*2, &x0, &x1) ||
+                x0 < x0_start || x0 >= x0_end) {
                 continue;
             }
 
@@ -325,36 +502,18 @@ bool producer_fill_facet(struct work_config *wcfg,
 }
 
 // Gets subgrid offset for given column/rpw. Returns INT_MIN if no work was found.
-static int get_subgrid_off_u(struct work_config *wcfg, int iu, int iw)
+static int get_subgrid_off_u(const struct producer_routing *routing, int iu, int iw)
 {
-
-    // Somewhat inefficiently walk entire work list
-    int iwork;
-    for (iwork = 0; iwork < wcfg->subgrid_workers * wcfg->subgrid_max_work; iwork++) {
-        if (wcfg->subgrid_work[iwork].nbl > 0 &&
-            wcfg->subgrid_work[iwork].iu == iu &&
-            wcfg->subgrid_work[iwork].iw == iw) break;
-    }
-    if (iwork >= wcfg->subgrid_workers * wcfg->subgrid_max_work)
+    if (iw < routing->iw_min || iw - routing->iw_min >= routing->nw)
         return INT_MIN;
-
-    return wcfg->subgrid_work[iwork].subgrid_off_u;
+    return routing->off_u[routing_index(routing, iu, routing->iv_min, iw) / routing->nv];
 }
 
-static int get_subgrid_off_v(struct work_config *wcfg, int iu, int iv, int iw)
+static int get_subgrid_off_v(const struct producer_routing *routing, int iu, int iv, int iw)
 {
-
-    // Somewhat inefficiently walk entire work list
-    int iwork;
-    for (iwork = 0; iwork < wcfg->subgrid_workers * wcfg->subgrid_max_work; iwork++) {
-        if (wcfg->subgrid_work[iwork].nbl > 0 &&
-            wcfg->subgrid_work[iwork].iu == iu &&
-            wcfg->subgrid_work[iwork].iv == iv &&
-            wcfg->subgrid_work[iwork].iw == iw) break;
-    }
-    if (iwork >= wcfg->subgrid_workers * wcfg->subgrid_max_work) return INT_MIN;
-
-    return wcfg->subgrid_work[iwork].subgrid_off_v;
+    if (iw < routing->iw_min || iw - routing->iw_min >= routing->nw)
+        return INT_MIN;
+    return routing->off_v[routing_index(routing, iu, iv, iw)];
 }
 
 
@@ -363,16 +522,18 @@ static void producer_facets_work(struct work_config *wcfg,
                                  struct producer_stream *prod,
                                  struct producer_stream *producers,
                                  double complex *F, double complex *BF,
-                                 int wlevel)
+                                 int wlevel, bool prepared)
 {
 
     int ifacet;
 
-    // Do first stage preparation and Fourier Transform
-    if (wcfg->produce_retain_bf)
+    // Do first stage preparation and Fourier Transform (unless done
+    // by fill threads already, see producer_fill_thread)
+    if (wcfg->produce_retain_bf && !prepared)
         for (ifacet = 0; ifacet < prod->facet_work_count; ifacet++)
             recombine2d_pf1_ft1_omp(&prod->worker,
                                     F + ifacet * wcfg->recombine.F_size / sizeof(*F),
+                                    prod->facets[ifacet].rows,
                                     BF + ifacet * wcfg->recombine.BF_size / sizeof(*BF));
 
     int iu;
@@ -382,7 +543,7 @@ static void producer_facets_work(struct work_config *wcfg,
         for (iu = wcfg->iu_min; iu <= wcfg->iu_max ; iu++) {
 
             // Determine column offset / check whether column actually has work
-            int subgrid_off_u = get_subgrid_off_u(wcfg, iu, wlevel);
+            int subgrid_off_u = get_subgrid_off_u(prod->routing, iu, wlevel);
             if (subgrid_off_u == INT_MIN) continue;
 
             // Loop through facets sequentially (inefficient, as it
@@ -393,12 +554,13 @@ static void producer_facets_work(struct work_config *wcfg,
                 // transform along second axis
                 recombine2d_es1_pf0_ft0(&prod->worker, subgrid_off_u,
                                         BF + ifacet * wcfg->recombine.BF_size / sizeof(*BF),
+                                        prod->facets[ifacet].rows,
                                         prod->worker.NMBF_BF);
 
                 // Go through rows in sequence
                 int iv;
                 for (iv = wcfg->iv_min; iv <= wcfg->iv_max; iv++) {
-                    int subgrid_off_v = get_subgrid_off_v(wcfg, iu, iv, wlevel);
+                    int subgrid_off_v = get_subgrid_off_v(prod->routing, iu, iv, wlevel);
                     if (subgrid_off_v == INT_MIN) continue;
                     producer_send_subgrid(wcfg, prod, ifacet, prod->worker.NMBF_BF,
                                           subgrid_off_u, subgrid_off_v, iu, iv,
@@ -411,7 +573,7 @@ static void producer_facets_work(struct work_config *wcfg,
         for (iu = wcfg->iu_min; iu <= wcfg->iu_max; iu++) {
 
             // Determine column offset / check whether column actually has work
-            int subgrid_off_u = get_subgrid_off_u(wcfg, iu, wlevel);
+            int subgrid_off_u = get_subgrid_off_u(prod->routing, iu, wlevel);
             if (subgrid_off_u == INT_MIN) continue;
 
             // Loop through facets (inefficient, see above)
@@ -424,18 +586,18 @@ static void producer_facets_work(struct work_config *wcfg,
                 if (wcfg->produce_retain_bf)
                     recombine2d_es1_omp(&prod->worker, subgrid_off_u,
                                         BF + ifacet * wcfg->recombine.BF_size / sizeof(*BF),
-                                        NMBF);
+                                        prod->facets[ifacet].rows, NMBF);
                 else
                     recombine2d_pf1_ft1_es1_omp(&prod->worker, subgrid_off_u,
                                                 F + ifacet * wcfg->recombine.F_size / sizeof(*F),
-                                                NMBF);
+                                                prod->facets[ifacet].rows, NMBF);
                 recombine2d_pf0_ft0_omp(&prod->worker, NMBF, NMBF_BF);
 
                 // Go through rows in parallel
                 int iv;
                 #pragma omp for schedule(dynamic)
                 for (iv = wcfg->iv_min; iv <= wcfg->iv_max; iv++) {
-                    int subgrid_off_v = get_subgrid_off_v(wcfg, iu, iv, wlevel);
+                    int subgrid_off_v = get_subgrid_off_v(prod->routing, iu, iv, wlevel);
                     if (subgrid_off_v == INT_MIN) continue;
                     producer_send_subgrid(wcfg, prod, ifacet, NMBF_BF,
                                           subgrid_off_u, subgrid_off_v, iu, iv,
@@ -446,76 +608,357 @@ static void producer_facets_work(struct work_config *wcfg,
     }
 }
 
-double producer_work(struct work_config *wcfg,
-                     struct producer_stream *producers,
-                     int facet_work_count,
-                     double complex *F, double complex *BF)
+// Set up facets loaded from files: Allocate space for keeping
+// the data, and calculate n(l,m) for phase screens
+static struct producer_facet *producer_facets_init(struct work_config *wcfg,
+                                                   struct facet_work *fwork,
+                                                   int facet_work_count,
+                                                   const struct producer_routing *routing)
+{
+    struct recombine2d_config *const cfg = &wcfg->recombine;
+    const int yB_size = cfg->yB_size;
+    struct producer_facet *facets = (struct producer_facet *)
+        calloc(facet_work_count ? facet_work_count : 1, sizeof(struct producer_facet));
+    if (!facets)
+        return NULL;
+
+    // Largest |w| of any w-level
+    int iw_max = abs(routing->iw_min);
+    if (abs(routing->iw_min + routing->nw - 1) > iw_max)
+        iw_max = abs(routing->iw_min + routing->nw - 1);
+    const double w_max = iw_max * wcfg->wstep * wcfg->sg_step_w;
+
+    // Rows that can be non-zero, so recombination can skip the rest
+    int ifacet;
+    for (ifacet = 0; ifacet < facet_work_count; ifacet++)
+        facets[ifacet].rows = producer_facet_rows(wcfg, fwork + ifacet);
+
+    // Real facets only ever get used at w=0 (see producer), so we
+    // can fill them directly
+    if (cfg->F_real)
+        return facets;
+
+    for (ifacet = 0; ifacet < facet_work_count; ifacet++) {
+        struct facet_work *work = fwork + ifacet;
+        struct producer_facet *facet = facets + ifacet;
+        if (!work->path)
+            continue;
+        facet->F0 = (double complex *)calloc(1, sizeof(double complex) * yB_size * yB_size);
+        facet->n_l = (double *)malloc(sizeof(double) * yB_size);
+        facet->n_m = (double *)malloc(sizeof(double) * yB_size);
+        if (!facet->F0 || !facet->n_l || !facet->n_m)
+            return facets;
+
+        // Facet coordinates are relative to the facet centre, see
+        // producer_fill_facet. Separable terms first.
+        double l[yB_size], m[yB_size];
+        int x0, x1;
+        for (x0 = 0; x0 < yB_size; x0++) {
+            const int ix = (x0 < yB_size / 2 ? x0 : x0 - yB_size);
+            l[x0] = (work->facet_off_l + ix) * wcfg->theta / cfg->image_size;
+            m[x0] = (work->facet_off_m + ix) * wcfg->theta / cfg->image_size;
+            facet->n_l[x0] = sqrt(fmax(0, 1 - l[x0]*l[x0])) - 1;
+            facet->n_m[x0] = sqrt(fmax(0, 1 - m[x0]*m[x0])) - 1;
+        }
+
+        // Check error of separable approximation. It grows with |l|
+        // and |m|, so check at the facet corners.
+        double max_err = 0;
+        const int corners[] = { 0, yB_size / 2 - 1, yB_size / 2, yB_size - 1 };
+        int i, j;
+        for (i = 0; i < 4; i++)
+            for (j = 0; j < 4; j++) {
+                const double ll = l[corners[j]], mm = m[corners[i]];
+                const double n = sqrt(fmax(0, 1 - ll*ll - mm*mm)) - 1;
+                const double err = fabs(n - facet->n_l[corners[j]] - facet->n_m[corners[i]]);
+                if (err > max_err) max_err = err;
+            }
+        facet->separable = 2 * M_PI * w_max * max_err <= FACET_SCREEN_MAX_PHASE_ERROR;
+
+        // Otherwise precalculate n for every pixel
+        if (!facet->separable) {
+            facet->n = (double *)malloc(sizeof(double) * yB_size * yB_size);
+            if (!facet->n)
+                return facets;
+            for (x0 = 0; x0 < yB_size; x0++)
+                for (x1 = 0; x1 < yB_size; x1++)
+                    facet->n[x0 * yB_size + x1] =
+                        sqrt(fmax(0, 1 - l[x1]*l[x1] - m[x0]*m[x0])) - 1;
+        }
+        printf("Facet %d: %s phase screen (separable error %.2g rad)\n", ifacet,
+               facet->separable ? "separable" : "full", 2 * M_PI * w_max * max_err);
+    }
+    return facets;
+}
+
+static bool producer_facets_ok(struct recombine2d_config *cfg,
+                               struct producer_facet *facets, struct facet_work *fwork,
+                               int facet_work_count)
+{
+    int ifacet;
+    for (ifacet = 0; ifacet < facet_work_count; ifacet++) {
+        struct producer_facet *facet = facets + ifacet;
+        if (fwork[ifacet].path && !cfg->F_real &&
+            (!facet->F0 || !facet->n_l || !facet->n_m || (!facet->separable && !facet->n)))
+            return false;
+    }
+    return true;
+}
+
+static void producer_facets_free(struct producer_facet *facets, int facet_work_count)
+{
+    int ifacet;
+    for (ifacet = 0; ifacet < facet_work_count; ifacet++) {
+        free(facets[ifacet].F0);
+        free(facets[ifacet].n_l); free(facets[ifacet].n_m);
+        free(facets[ifacet].n);
+        free(facets[ifacet].rows);
+    }
+    free(facets);
+}
+
+// Apply phase screen for w to rows [x0_start, x0_end) of a facet
+static void producer_facet_screen(struct recombine2d_config *cfg,
+                                  struct producer_facet *facet,
+                                  double complex *F,
+                                  int x0_start, int x0_end, double w)
+{
+    const int yB_size = cfg->yB_size;
+    const double complex *F0 = facet->F0;
+    int x0, x1;
+    assert (cfg->F_stride0 == cfg->yB_size && cfg->F_stride1 == 1);
+    if (w == 0) {
+        memcpy(F, F0 + x0_start * yB_size, sizeof(double complex) * (x0_end - x0_start) * yB_size);
+        return;
+    }
+
+    if (facet->separable) {
+
+        // Screen is the product of a column and a row factor
+        double complex *screen_l = (double complex *)malloc(sizeof(double complex) * yB_size);
+        for (x1 = 0; x1 < yB_size; x1++)
+            screen_l[x1] = cexp(2 * M_PI * I * w * facet->n_l[x1]);
+        for (x0 = x0_start; x0 < x0_end; x0++) {
+            const double complex screen_m = cexp(2 * M_PI * I * w * facet->n_m[x0]);
+            const double complex *src = F0 + x0 * yB_size;
+            double complex *dst = F + (x0 - x0_start) * yB_size;
+            for (x1 = 0; x1 < yB_size; x1++)
+                dst[x1] = src[x1] * screen_l[x1] * screen_m;
+        }
+        free(screen_l);
+
+    } else {
+
+        for (x0 = x0_start; x0 < x0_end; x0++) {
+            const double *n = facet->n + x0 * yB_size;
+            const double complex *src = F0 + x0 * yB_size;
+            double complex *dst = F + (x0 - x0_start) * yB_size;
+            for (x1 = 0; x1 < yB_size; x1++) {
+                const double ph = 2 * M_PI * w * n[x1];
+                dst[x1] = src[x1] * (cos(ph) + I * sin(ph));
+            }
+        }
+
+    }
+}
+
+// Whether there is any subgrid work at a w-level
+static bool producer_wlevel_needed(const struct producer_routing *routing, int wlevel)
+{
+    int iu;
+    for (iu = routing->iu_min; iu < routing->iu_min + routing->nu; iu++)
+        if (get_subgrid_off_u(routing, iu, wlevel) != INT_MIN)
+            return true;
+    return false;
+}
+
+// Fill rows [x0_start, x0_end) of a real-valued facet (see
+// recombine2d_set_real). We generate batches of rows as complex
+// values, and keep their real parts.
+static bool producer_fill_facet_real(struct work_config *wcfg,
+                                     struct facet_work *work,
+                                     struct hdf5_rows *facet_rows,
+                                     double *F, int x0_start, int x0_end)
+{
+    struct recombine2d_config *const cfg = &wcfg->recombine;
+    const int batch = wcfg->produce_batch_rows;
+    double complex *rows = (double complex *)
+        malloc(sizeof(double complex) * batch * cfg->F_stride0);
+    if (!rows)
+        return false;
+
+    bool success = true;
+    int x0, i;
+    for (x0 = x0_start; x0 < x0_end && success; x0 += batch) {
+        const int x0_end2 = x0 + batch < x0_end ? x0 + batch : x0_end;
+        const int count = (x0_end2 - x0) * cfg->F_stride0;
+        memset(rows, 0, sizeof(double complex) * count);
+        success = producer_fill_facet(wcfg, work, facet_rows, rows,
+                                      wcfg->source_count, wcfg->source_xy,
+                                      wcfg->source_lmn, wcfg->source_corr,
+                                      x0, x0_end2, 0);
+        double *dst = F + (x0 - x0_start) * cfg->F_stride0;
+        for (i = 0; i < count; i++)
+            dst[i] = creal(rows[i]);
+    }
+
+    free(rows);
+    return success;
+}
+
+// Fill facets for a w-level (in parallel, called by all team threads)
+static void producer_fill_facets(struct work_config *wcfg,
+                                 struct producer_stream *prod,
+                                 double complex *F, int wlevel)
 {
     struct recombine2d_config *const cfg = &wcfg->recombine;
-    struct producer_stream *const prod = producers + omp_get_thread_num();
     struct facet_work *const fwork = wcfg->facet_work +
         prod->facet_worker * wcfg->facet_max_work;
 
-    // Determine first and last needed w-level from subgrid work list
-    int min_wlevel = INT_MAX, max_wlevel = INT_MIN; int iwork;
-    for (iwork = 0; iwork < wcfg->subgrid_workers * wcfg->subgrid_max_work;
-         iwork++) {
-        if (!wcfg->subgrid_work[iwork].nbl)
+    // Parallelise over facets and facet chunks
+    int ifacet; int x0; const int x0_chunk = 256;
+    #pragma omp for schedule(dynamic) collapse(2)
+    for (ifacet = 0; ifacet < prod->facet_work_count; ifacet++) {
+        for (x0 = 0; x0 < cfg->yB_size; x0+=x0_chunk) {
+            int x0_end = x0 + x0_chunk;
+            if (x0_end > cfg->yB_size) x0_end = cfg->yB_size;
+            double complex *pF = F + ifacet * wcfg->recombine.F_size / sizeof(*F);
+            double w = wlevel * wcfg->wstep * wcfg->sg_step_w;
+
+            // Real facets (only used at w=0)
+            if (cfg->F_real) {
+                producer_fill_facet_real(wcfg, fwork + ifacet, &prod->facet_rows,
+                                         (double *)pF + x0*cfg->F_stride0, x0, x0_end);
+                continue;
+            }
+            pF += x0*cfg->F_stride0;
+
+            // Facet from file? Load it at the first w-level, then
+            // only apply phase screens
+            struct producer_facet *facet = prod->facets + ifacet;
+            if (facet->F0) {
+                if (wlevel == prod->routing->iw_min)
+                    producer_fill_facet(wcfg, fwork + ifacet, &prod->facet_rows,
+                                        facet->F0 + x0*cfg->F_stride0,
+                                        0, NULL, NULL, NULL, x0, x0_end, 0);
+                producer_facet_screen(cfg, facet, pF, x0, x0_end, w);
+                continue;
+            }
+
+            memset(pF, 0, sizeof(*pF) * cfg->F_stride0 *
+                   (x0_end-x0 > x0_chunk ? x0_chunk : x0_end-x0));
+            producer_fill_facet(wcfg, fwork + ifacet, &prod->facet_rows, pF,
+                                wcfg->source_count, wcfg->source_xy,
+                                wcfg->source_lmn, wcfg->source_corr,
+                                x0, x0_end, w);
+        }
+    }
+}
+
+// Facet pipeline: A separate team of threads fills (and prepares)
+// facets for the next w-level while the producers stream the current
+// one, alternating between two facet buffers.
+struct producer_pipeline {
+    struct work_config *wcfg;
+    struct producer_stream *fillers;
+    int fill_count;
+    double complex *F[2], *BF[2];
+    pthread_t thread;
+
+    // W-levels (with work) filled and streamed so far
+    int filled, streamed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // Time spent filling, and time producers spent waiting for fills
+    double fill_time, fill_wait_time;
+};
+
+static void *producer_fill_thread(void *param)
+{
+    struct producer_pipeline *pipe = (struct producer_pipeline *)param;
+    struct work_config *wcfg = pipe->wcfg;
+    const struct producer_routing *routing = pipe->fillers->routing;
+
+    int wlevel, i = 0;
+    for (wlevel = routing->iw_min; wlevel < routing->iw_min + routing->nw; wlevel++) {
+        if (!producer_wlevel_needed(routing, wlevel))
             continue;
-        if (min_wlevel > wcfg->subgrid_work[iwork].iw)
-            min_wlevel = wcfg->subgrid_work[iwork].iw;
-        if (max_wlevel < wcfg->subgrid_work[iwork].iw)
-            max_wlevel = wcfg->subgrid_work[iwork].iw;
+
+        // Wait for the buffer to get streamed (w-level i-2)
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->streamed < i - 1)
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        pthread_mutex_unlock(&pipe->lock);
+
+        // Fill, and do first stage preparation and Fourier transform
+        double start = get_time_ns();
+        double complex *F = pipe->F[i % 2], *BF = pipe->BF[i % 2];
+        #pragma omp parallel num_threads(pipe->fill_count)
+        {
+            struct producer_stream *prod = pipe->fillers + omp_get_thread_num();
+            producer_fill_facets(wcfg, prod, F, wlevel);
+            int ifacet;
+            if (wcfg->produce_retain_bf)
+                for (ifacet = 0; ifacet < prod->facet_work_count; ifacet++)
+                    recombine2d_pf1_ft1_omp(&prod->worker,
+                                            F + ifacet * wcfg->recombine.F_size / sizeof(*F),
+                                            prod->facets[ifacet].rows,
+                                            BF + ifacet * wcfg->recombine.BF_size / sizeof(*BF));
+        }
+        pipe->fill_time += get_time_ns() - start;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->filled = ++i;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
     }
+    return NULL;
+}
+
+double producer_work(struct work_config *wcfg,
+                     struct producer_stream *producers,
+                     struct producer_pipeline *pipe,
+                     double complex *F, double complex *BF)
+{
+    struct producer_stream *const prod = producers + omp_get_thread_num();
+    const int facet_work_count = prod->facet_work_count;
 
-    int wlevel;
+    // Go through w-levels covered by subgrid work
+    const struct producer_routing *routing = prod->routing;
+    int wlevel, i = 0;
     double stream_time = 0;
-    for (wlevel = min_wlevel; wlevel <= max_wlevel; wlevel++) {
+    for (wlevel = routing->iw_min; wlevel < routing->iw_min + routing->nw; wlevel++) {
 
         // Check whether wlevel should be skipped
-        bool found = false;
-        for (iwork = 0; iwork < wcfg->subgrid_workers * wcfg->subgrid_max_work;
-             iwork++) {
-            if (!wcfg->subgrid_work[iwork].nbl)
-                continue;
-            if (wcfg->subgrid_work[iwork].iw == wlevel) {
-                found = true;
-                break;
-            }
-        }
-        if (!found)
+        if (!producer_wlevel_needed(routing, wlevel))
             continue;
 
         // Start of facet data creation
         double generate_start;
         #pragma omp single copyprivate(generate_start)
         {
-            printf("Filling %d facet%s (w level %d)...\n",
+            printf("%s %d facet%s (w level %d)...\n",
+                   pipe ? "Waiting for" : "Filling",
                    facet_work_count, facet_work_count != 1 ? "s" : "",
                    wlevel);
             generate_start = get_time_ns();
-        }
 
-        // Parallelise over facets and facet chunks
-        int ifacet; int x0; const int x0_chunk = 256;
-        #pragma omp for schedule(dynamic) collapse(2)
-        for (ifacet = 0; ifacet < facet_work_count; ifacet++) {
-            for (x0 = 0; x0 < cfg->yB_size; x0+=x0_chunk) {
-                int x0_end = x0 + x0_chunk;
-                if (x0_end > cfg->yB_size) x0_end = cfg->yB_size;
-                double complex *pF =
-                    F + ifacet * wcfg->recombine.F_size / sizeof(*F)
-                    + x0*cfg->F_stride0;
-                memset(pF, 0, sizeof(*pF) * cfg->F_stride0 *
-                       (x0_end-x0 > x0_chunk ? x0_chunk : x0_end-x0));
-
-                double w = wlevel * wcfg->wstep * wcfg->sg_step_w;
-                producer_fill_facet(wcfg, fwork + ifacet, pF,
-                                    wcfg->source_count, wcfg->source_xy,
-                                    wcfg->source_lmn, wcfg->source_corr,
-                                    x0, x0_end, w);
+            // Pipelined: Wait for fill threads
+            if (pipe) {
+                pthread_mutex_lock(&pipe->lock);
+                while (pipe->filled <= i)
+                    pthread_cond_wait(&pipe->cond, &pipe->lock);
+                pthread_mutex_unlock(&pipe->lock);
+                pipe->fill_wait_time += get_time_ns() - generate_start;
             }
         }
+        double complex *wF = F, *wBF = BF;
+        if (pipe) {
+            wF = pipe->F[i % 2]; wBF = pipe->BF[i % 2];
+        } else {
+            producer_fill_facets(wcfg, prod, F, wlevel);
+        }
 
         // Done creating facet data
         double run_start;
@@ -528,12 +971,21 @@ double producer_work(struct work_config *wcfg,
         }
 
         // Start generating subgrid data
-        producer_facets_work(wcfg, prod, producers, F, BF, wlevel);
+        producer_facets_work(wcfg, prod, producers, wF, wBF, wlevel, pipe != NULL);
 
 #pragma omp single copyprivate(stream_time)
         {
             stream_time += get_time_ns() - run_start;
+
+            // Release buffer to fill threads
+            if (pipe) {
+                pthread_mutex_lock(&pipe->lock);
+                pipe->streamed = i + 1;
+                pthread_cond_broadcast(&pipe->cond);
+                pthread_mutex_unlock(&pipe->lock);
+            }
         }
+        i++;
 
     }
 
@@ -555,34 +1007,89 @@ int producer(struct work_config *wcfg, int facet_worker, int *streamer_ranks)
         if (fwork[ifacet].set)
             facet_work_count++;
 
+    // Split threads between streaming and (pipelined) filling
+    int fill_count = wcfg->produce_fill_threads;
+    if (fill_count >= omp_get_max_threads()) {
+        fprintf(stderr, "WARNING: Need at least one thread for streaming, not pipelining facet fills!\n");
+        fill_count = wcfg->produce_fill_threads = 0;
+    }
+    const int stream_count = omp_get_max_threads() - fill_count;
+    const int buffers = fill_count > 0 ? 2 : 1;
+
+    // Determine where subgrids need to go
+    struct producer_routing routing;
+    if (!producer_routing_init(wcfg, &routing)) {
+        printf("Failed to allocate subgrid routing table!\n");
+        return 1;
+    }
+
+    // Real facets? Only possible if we never need to apply w-stacking
+    // phase screens, i.e. all subgrids are at w=0
+    if (wcfg->produce_real_facets) {
+        if (routing.nw > 1 || (routing.nw == 1 && routing.iw_min != 0)) {
+            fprintf(stderr, "ERROR: Real facets need all subgrids at w=0 (use w-towers or 2D)!\n");
+            producer_routing_free(&routing);
+            return 1;
+        }
+        recombine2d_set_real(cfg, true);
+        printf("Using real-valued facets\n");
+    }
+
     // Determine required buffer sizes. If we don't retain the full
     // padded facet, we still need enough space to be able to work on
-    // one batch of rows.
+    // one batch of rows. Pipelining needs two sets of facets.
     uint64_t F_size = facet_work_count * cfg->F_size;
     uint64_t BF_size = wcfg->produce_retain_bf ?
         facet_work_count * cfg->BF_size :
         sizeof(double complex) * cfg->yP_size * BF_batch;
 
     printf("Using %.1f GB global, %.1f GB per thread\n",
-           (double)(F_size + BF_size) / 1000000000,
+           (double)buffers * (F_size + (wcfg->produce_retain_bf ? BF_size : 0)) / 1000000000 +
+           (wcfg->produce_retain_bf ? 0 : (double)BF_size / 1000000000),
            facet_work_count * (double)recombine2d_worker_memory(cfg) / 1000000000);
 
     // Create global memory buffers for facet at current w-level
-    double complex *F = (double complex *)calloc(1, F_size);
-    double complex *BF = (double complex *)malloc(BF_size);
+    double complex *F = (double complex *)calloc(buffers, F_size);
+    double complex *BF = (double complex *)malloc(wcfg->produce_retain_bf ? buffers * BF_size : BF_size);
     if (!F || (!BF && wcfg->produce_retain_bf)) {
+        producer_routing_free(&routing);
         free(F); free(BF);
         printf("Failed to allocate global buffers!\n");
         return 1;
     }
 
+    // Keep facets from files in memory, to apply w-stacking phase
+    // screens to
+    struct producer_facet *facets = producer_facets_init(wcfg, fwork, facet_work_count, &routing);
+    if (!facets || !producer_facets_ok(cfg, facets, fwork, facet_work_count)) {
+        if (facets) producer_facets_free(facets, facet_work_count);
+        producer_routing_free(&routing);
+        free(F); free(BF);
+        printf("Failed to allocate facet phase screens!\n");
+        return 1;
+    }
+
+
+    // Set up pipeline
+    struct producer_pipeline pipeline, *pipe = NULL;
+    if (fill_count > 0) {
+        pipe = &pipeline;
+        memset(pipe, 0, sizeof(*pipe));
+        pipe->wcfg = wcfg;
+        pipe->fill_count = fill_count;
+        pipe->F[0] = F; pipe->F[1] = F + F_size / sizeof(*F);
+        pipe->BF[0] = BF;
+        pipe->BF[1] = wcfg->produce_retain_bf ? BF + BF_size / sizeof(*BF) : BF;
+        pthread_mutex_init(&pipe->lock, NULL);
+        pthread_cond_init(&pipe->cond, NULL);
+    }
 
     // Global structures
     double stream_time;
     int producer_count;
     struct producer_stream *producers;
 
-    #pragma omp parallel
+    #pragma omp parallel num_threads(stream_count)
     {
 
         // Perform planning (need to know thread count for that)
@@ -592,26 +1099,36 @@ int producer(struct work_config *wcfg, int facet_worker, int *streamer_ranks)
             // Do global planning
             printf("Planning for %d threads...\n", producer_count);
             double planning_start = get_time_ns();
-            fftw_plan BF_plan = recombine2d_bf_plan(cfg, BF_batch,
-                                                    BF, FFTW_MEASURE);
+            fftw_plan BF_plan = cfg->F_real ?
+                recombine2d_bf_plan_r2c(cfg, BF_batch, BF, FFTW_MEASURE) :
+                recombine2d_bf_plan(cfg, BF_batch, BF, FFTW_MEASURE);
 
             // Create producers (which involves planning, and
-            // therefore is not parallelised)
+            // therefore is not parallelised). Fill threads get
+            // producer structures after the streaming ones.
             producers = (struct producer_stream *) malloc(
-                sizeof(struct producer_stream) * producer_count);
+                sizeof(struct producer_stream) * (producer_count + fill_count));
             int i;
-            for (i = 0; i < producer_count; i++) {
+            for (i = 0; i < producer_count + fill_count; i++) {
                 init_producer_stream(cfg, producers + i, facet_worker, facet_work_count,
-                                     wcfg->facet_workers, streamer_ranks,
+                                     wcfg->facet_workers, streamer_ranks, &routing, facets,
                                      BF_batch, BF_plan, send_queue_length);
             }
 
             printf(" %.2f s\n", get_time_ns() - planning_start);
 
+            // Start filling facets
+            if (pipe) {
+                printf("Pipelining facets: %d threads streaming, %d filling\n",
+                       producer_count, fill_count);
+                pipe->fillers = producers + producer_count;
+                pthread_create(&pipe->thread, NULL, producer_fill_thread, pipe);
+            }
+
         }
 
         // Start creating facets and streaming subgrid data out
-        stream_time = producer_work(wcfg, producers, facet_work_count, F, BF);
+        stream_time = producer_work(wcfg, producers, pipe, F, BF);
 
 #ifndef NO_MPI
         // Wait for remaining packets to be sent
@@ -624,18 +1141,31 @@ int producer(struct work_config *wcfg, int facet_worker, int *streamer_ranks)
 
         free_producer_stream(prod);
     }
+    int p;
+    if (pipe) {
+        pthread_join(pipe->thread, NULL);
+        for (p = producer_count; p < producer_count + fill_count; p++)
+            free_producer_stream(producers + p);
+        pthread_mutex_destroy(&pipe->lock);
+        pthread_cond_destroy(&pipe->cond);
+    }
     free(BF);
     free(F);
+    producer_routing_free(&routing);
+    producer_facets_free(facets, facet_work_count);
 
     fftw_free(producers[0].worker.BF_plan);
 
     // Show statistics
-    int p;
-    for (p = 1; p < producer_count; p++) {
+    for (p = 1; p < producer_count + fill_count; p++) {
         producer_add_stats(producers, producers + p);
     }
+    if (pipe) {
+        producers->fill_time = pipe->fill_time;
+        producers->fill_wait_time = pipe->fill_wait_time;
+    }
     producer_dump_stats(wcfg, facet_worker,
-                        producers, producer_count, stream_time);
+                        producers, producer_count + fill_count, stream_time);
 
     return 0;
 }
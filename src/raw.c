@@ -0,0 +1,465 @@
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include "raw.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+static size_t raw_align(size_t size)
+{
+    return (size + RAW_ALIGN - 1) / RAW_ALIGN * RAW_ALIGN;
+}
+
+// Open file, using O_DIRECT if requested and supported by the file
+// system (tmpfs for instance does not support it)
+static int raw_open_fd(struct raw_file *raw, const char *filename, int flags, bool direct)
+{
+    raw->direct = false;
+    if (direct && O_DIRECT) {
+        int fd = open(filename, flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            raw->direct = true;
+            return fd;
+        }
+        if (errno != EINVAL)
+            return fd;
+        fprintf(stderr, "WARNING: O_DIRECT not supported for %s, using buffered I/O!\n", filename);
+    }
+    return open(filename, flags, 0644);
+}
+
+static void raw_async_free(struct raw_file *raw);
+
+static bool raw_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf = (const char *)buf + written; size -= written; offset += written;
+    }
+    return true;
+}
+
+static bool raw_pread(int fd, void *buf, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t got = pread(fd, buf, size, offset);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (got == 0) { // past end of file
+            memset(buf, 0, size);
+            return true;
+        }
+        buf = (char *)buf + got; size -= got; offset += got;
+    }
+    return true;
+}
+
+// Set up chunk geometry and buffers for the given baselines
+static bool raw_init(struct raw_file *raw, struct vis_spec *spec, int bl_count)
+{
+    raw->time_chunk = spec->time_chunk;
+    raw->freq_chunk = spec->freq_chunk;
+    raw->time_chunks = spec_time_chunks(spec);
+    raw->freq_chunks = spec_freq_chunks(spec);
+    raw->chunk_size = sizeof(double complex) * raw->time_chunk * raw->freq_chunk;
+    raw->chunk_stride = raw_align(raw->chunk_size);
+    raw->data_offset = raw_align(sizeof(struct raw_header) + 2 * sizeof(uint32_t) * bl_count);
+    raw->buf = NULL;
+    raw->uring = NULL;
+    if (posix_memalign(&raw->buf, RAW_ALIGN, raw->chunk_stride))
+        return false;
+    memset(raw->buf, 0, raw->chunk_stride);
+    return true;
+}
+
+bool raw_create(struct raw_file *raw, const char *filename,
+                struct work_config *wcfg, int worker, int aggregator, bool direct)
+{
+    struct vis_spec *spec = &wcfg->spec;
+    const int nant = spec->cfg->ant_count;
+    int a1, a2, iwork;
+
+    // Determine baselines to hold: Either the ones covered by the
+    // worker (see create_bl_groups), or all of them. Aggregators only
+    // hold baselines assigned to them.
+    raw->fd = -1; raw->buf = NULL; raw->uring = NULL;
+    raw->ant_count = nant;
+    raw->bl_index = (int *)malloc(sizeof(int) * nant * nant);
+    if (!raw->bl_index)
+        return false;
+    for (a1 = 0; a1 < nant * nant; a1++)
+        raw->bl_index[a1] = (worker >= 0 ? -1 : 0);
+    if (worker >= 0) {
+        struct subgrid_work *work = wcfg->subgrid_work + worker * wcfg->subgrid_max_work;
+        for (iwork = 0; iwork < wcfg->subgrid_max_work; iwork++) {
+            struct subgrid_work_bl *bl;
+            for (bl = work[iwork].bls; bl; bl = bl->next)
+                raw->bl_index[bl->a1 * nant + bl->a2] = 0;
+        }
+    }
+    int bl_count = 0;
+    for (a1 = 0; a1 < nant; a1++)
+        for (a2 = 0; a2 < nant; a2++)
+            if (a2 > a1 && raw->bl_index[a1 * nant + a2] >= 0 &&
+                (aggregator < 0 || config_baseline_aggregator(wcfg, a1, a2) == aggregator))
+                raw->bl_index[a1 * nant + a2] = bl_count++;
+            else
+                raw->bl_index[a1 * nant + a2] = -1;
+    if (!raw_init(raw, spec, bl_count)) {
+        free(raw->bl_index);
+        return false;
+    }
+
+    // Fill header and baseline index
+    void *header_buf;
+    if (posix_memalign(&header_buf, RAW_ALIGN, raw->data_offset)) {
+        raw_close(raw);
+        return false;
+    }
+    memset(header_buf, 0, raw->data_offset);
+    struct raw_header *header = (struct raw_header *)header_buf;
+    memcpy(header->magic, RAW_MAGIC, sizeof(header->magic));
+    header->bl_count = bl_count;
+    header->time_count = spec->time_count; header->freq_count = spec->freq_count;
+    header->time_chunk = raw->time_chunk; header->freq_chunk = raw->freq_chunk;
+    header->time_chunks = raw->time_chunks; header->freq_chunks = raw->freq_chunks;
+    header->chunk_stride = raw->chunk_stride;
+    header->data_offset = raw->data_offset;
+    uint32_t *bls = (uint32_t *)(header + 1);
+    for (a1 = 0; a1 < nant; a1++)
+        for (a2 = 0; a2 < nant; a2++) {
+            const int ix = raw->bl_index[a1 * nant + a2];
+            if (ix >= 0) { bls[2*ix] = a1; bls[2*ix+1] = a2; }
+        }
+
+    // Create file, preallocate and write header
+    raw->fd = raw_open_fd(raw, filename, O_RDWR | O_CREAT | O_TRUNC, direct);
+    const off_t file_size = raw->data_offset +
+        (off_t)raw->chunk_stride * bl_count * raw->time_chunks * raw->freq_chunks;
+    bool success = raw->fd >= 0;
+    if (success && posix_fallocate(raw->fd, 0, file_size) != 0)
+        success = ftruncate(raw->fd, file_size) == 0;
+    if (success)
+        success = raw_pwrite(raw->fd, header_buf, raw->data_offset, 0);
+    free(header_buf);
+    if (!success) {
+        fprintf(stderr, "ERROR: Could not create raw visibility file %s: %s\n",
+                filename, strerror(errno));
+        raw_close(raw);
+        return false;
+    }
+    printf("%d baselines, %.2f GB preallocated%s\n", bl_count, (double)file_size / 1e9,
+           raw->direct ? " (O_DIRECT)" : "");
+    return true;
+}
+
+bool raw_open(struct raw_file *raw, const char *filename,
+              struct work_config *wcfg, bool direct)
+{
+    struct vis_spec *spec = &wcfg->spec;
+    const int nant = spec->cfg->ant_count;
+
+    raw->fd = -1; raw->buf = NULL; raw->uring = NULL;
+    raw->ant_count = nant;
+    raw->bl_index = (int *)malloc(sizeof(int) * nant * nant);
+    if (!raw->bl_index)
+        return false;
+    int i;
+    for (i = 0; i < nant * nant; i++)
+        raw->bl_index[i] = -1;
+
+    // Read and check header
+    struct raw_header *header = NULL;
+    raw->fd = raw_open_fd(raw, filename, O_RDONLY, direct);
+    if (raw->fd < 0 || posix_memalign((void **)&header, RAW_ALIGN, RAW_ALIGN) ||
+        !raw_pread(raw->fd, header, RAW_ALIGN, 0)) {
+        fprintf(stderr, "ERROR: Could not read raw visibility file %s: %s\n",
+                filename, strerror(errno));
+        free(header); raw_close(raw);
+        return false;
+    }
+    if (memcmp(header->magic, RAW_MAGIC, sizeof(header->magic)) ||
+        header->time_count != spec->time_count || header->freq_count != spec->freq_count ||
+        header->time_chunk != spec->time_chunk || header->freq_chunk != spec->freq_chunk) {
+        fprintf(stderr, "ERROR: Raw visibility file %s does not match visibility configuration!\n",
+                filename);
+        free(header); raw_close(raw);
+        return false;
+    }
+    const int bl_count = header->bl_count;
+    free(header);
+    if (!raw_init(raw, spec, bl_count)) {
+        raw_close(raw);
+        return false;
+    }
+
+    // Read baseline index
+    if (posix_memalign((void **)&header, RAW_ALIGN, raw->data_offset) ||
+        !raw_pread(raw->fd, header, raw->data_offset, 0)) {
+        fprintf(stderr, "ERROR: Could not read baselines from %s!\n", filename);
+        free(header); raw_close(raw);
+        return false;
+    }
+    uint32_t *bls = (uint32_t *)(header + 1);
+    for (i = 0; i < bl_count; i++)
+        if (bls[2*i] < nant && bls[2*i+1] < nant)
+            raw->bl_index[bls[2*i] * nant + bls[2*i+1]] = i;
+    free(header);
+    return true;
+}
+
+static off_t raw_chunk_offset(struct raw_file *raw, struct bl_data *bl,
+                              int time_chunk_ix, int freq_chunk_ix)
+{
+    const int ix = raw->bl_index[bl->antenna1 * raw->ant_count + bl->antenna2];
+    if (ix < 0) {
+        fprintf(stderr, "ERROR: Baseline %d/%d not in raw visibility file!\n",
+                bl->antenna1, bl->antenna2);
+        return -1;
+    }
+    return raw->data_offset + raw->chunk_stride *
+        (((off_t)ix * raw->time_chunks + time_chunk_ix) * raw->freq_chunks + freq_chunk_ix);
+}
+
+// Buffers that are aligned and fill the chunk's stride can go to the
+// file directly, everything else goes through the bounce buffer
+static bool raw_can_use(struct raw_file *raw, double complex *buf)
+{
+    return (uintptr_t)buf % RAW_ALIGN == 0 && raw->chunk_size == raw->chunk_stride;
+}
+
+bool raw_read_chunk(struct raw_file *raw, struct bl_data *bl,
+                    int time_chunk_ix, int freq_chunk_ix,
+                    double complex *buf)
+{
+    const off_t offset = raw_chunk_offset(raw, bl, time_chunk_ix, freq_chunk_ix);
+    if (offset < 0)
+        return false;
+    if (raw_can_use(raw, buf))
+        return raw_pread(raw->fd, buf, raw->chunk_stride, offset);
+    if (!raw_pread(raw->fd, raw->buf, raw->chunk_stride, offset))
+        return false;
+    memcpy(buf, raw->buf, raw->chunk_size);
+    return true;
+}
+
+bool raw_write_chunk(struct raw_file *raw, struct bl_data *bl,
+                     int time_chunk_ix, int freq_chunk_ix,
+                     double complex *buf)
+{
+    const off_t offset = raw_chunk_offset(raw, bl, time_chunk_ix, freq_chunk_ix);
+    if (offset < 0)
+        return false;
+    if (raw_can_use(raw, buf))
+        return raw_pwrite(raw->fd, buf, raw->chunk_stride, offset);
+    memcpy(raw->buf, buf, raw->chunk_size);
+    return raw_pwrite(raw->fd, raw->buf, raw->chunk_stride, offset);
+}
+
+void raw_close(struct raw_file *raw)
+{
+    raw_async_flush(raw);
+    raw_async_free(raw);
+    if (raw->fd >= 0)
+        close(raw->fd);
+    raw->fd = -1;
+    free(raw->bl_index); free(raw->buf);
+    raw->bl_index = NULL; raw->buf = NULL;
+}
+
+#ifdef HAVE_LIBURING
+
+struct raw_uring
+{
+    struct io_uring ring;
+    int depth, inflight;
+    bool fixed; // buffers registered with the kernel
+    char *bufs; // [depth, chunk_stride], aligned
+    int free, *next; // free buffers
+    int *chunk; // chunk index written from buffer, or -1
+};
+
+bool raw_async_init(struct raw_file *raw, int depth)
+{
+    struct raw_uring *u = (struct raw_uring *)calloc(1, sizeof(struct raw_uring));
+    if (!u)
+        return false;
+    u->depth = depth;
+    u->next = (int *)malloc(sizeof(int) * depth);
+    u->chunk = (int *)malloc(sizeof(int) * depth);
+    if (!u->next || !u->chunk ||
+        posix_memalign((void **)&u->bufs, RAW_ALIGN, raw->chunk_stride * depth)) {
+        free(u->next); free(u->chunk); free(u);
+        return false;
+    }
+    memset(u->bufs, 0, raw->chunk_stride * depth);
+    int i, ret = io_uring_queue_init(depth, &u->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: Could not set up io_uring: %s\n", strerror(-ret));
+        free(u->bufs); free(u->next); free(u->chunk); free(u);
+        return false;
+    }
+
+    // Register buffers, so the kernel does not need to map them for
+    // every write. Optional, the memlock limit might not allow it.
+    struct iovec *iovs = (struct iovec *)malloc(sizeof(struct iovec) * depth);
+    for (i = 0; iovs && i < depth; i++) {
+        iovs[i].iov_base = u->bufs + raw->chunk_stride * i;
+        iovs[i].iov_len = raw->chunk_stride;
+    }
+    u->fixed = iovs && io_uring_register_buffers(&u->ring, iovs, depth) == 0;
+    free(iovs);
+
+    for (i = 0; i < depth; i++) {
+        u->next[i] = (i + 1 < depth ? i + 1 : -1);
+        u->chunk[i] = -1;
+    }
+    u->free = 0;
+    u->inflight = 0;
+    raw->uring = u;
+    return true;
+}
+
+// Process completions, waiting until at most "max_inflight" writes
+// are outstanding
+static bool raw_async_reap(struct raw_file *raw, int max_inflight)
+{
+    struct raw_uring *u = raw->uring;
+    bool success = true;
+    while (u->inflight > 0) {
+        struct io_uring_cqe *cqe;
+        int ret = (u->inflight > max_inflight ?
+                   io_uring_wait_cqe(&u->ring, &cqe) :
+                   io_uring_peek_cqe(&u->ring, &cqe));
+        if (ret == -EAGAIN) break;
+        if (ret == -EINTR) continue;
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not get io_uring completion: %s\n", strerror(-ret));
+            return false;
+        }
+        const int i = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+        if (cqe->res < 0 || (size_t)cqe->res != raw->chunk_stride) {
+            fprintf(stderr, "ERROR: Asynchronous chunk write failed: %s\n",
+                    cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            success = false;
+        }
+        io_uring_cqe_seen(&u->ring, cqe);
+        u->chunk[i] = -1;
+        u->next[i] = u->free;
+        u->free = i;
+        u->inflight--;
+    }
+    return success;
+}
+
+double complex *raw_async_buffer(struct raw_file *raw)
+{
+    struct raw_uring *u = raw->uring;
+    if (u->free < 0)
+        raw_async_reap(raw, u->inflight - 1);
+    if (u->free < 0)
+        return NULL;
+    const int i = u->free;
+    u->free = u->next[i];
+    return (double complex *)(u->bufs + raw->chunk_stride * i);
+}
+
+bool raw_async_write(struct raw_file *raw, double complex *buf, struct bl_data *bl,
+                     int time_chunk_ix, int freq_chunk_ix, int chunk_index)
+{
+    struct raw_uring *u = raw->uring;
+    const int i = ((char *)buf - u->bufs) / raw->chunk_stride;
+    const off_t offset = raw_chunk_offset(raw, bl, time_chunk_ix, freq_chunk_ix);
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    if (offset < 0 || !sqe) {
+        u->next[i] = u->free;
+        u->free = i;
+        return false;
+    }
+    if (u->fixed)
+        io_uring_prep_write_fixed(sqe, raw->fd, buf, raw->chunk_stride, offset, i);
+    else
+        io_uring_prep_write(sqe, raw->fd, buf, raw->chunk_stride, offset);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    u->chunk[i] = chunk_index;
+    u->inflight++;
+    int ret = io_uring_submit(&u->ring);
+    if (ret < 0) {
+        fprintf(stderr, "ERROR: Could not submit to io_uring: %s\n", strerror(-ret));
+        u->chunk[i] = -1;
+        u->next[i] = u->free;
+        u->free = i;
+        u->inflight--;
+        return false;
+    }
+
+    // Pick up whatever completed in the meantime
+    return raw_async_reap(raw, u->depth);
+}
+
+bool raw_async_wait_chunk(struct raw_file *raw, int chunk_index)
+{
+    struct raw_uring *u = raw->uring;
+    int i;
+    for (i = 0; i < u->depth; i++) {
+        if (u->chunk[i] == chunk_index) {
+            if (!raw_async_reap(raw, u->inflight - 1))
+                return false;
+            i = -1; // completions come in any order, check again
+        }
+    }
+    return true;
+}
+
+bool raw_async_flush(struct raw_file *raw)
+{
+    return !raw->uring || raw_async_reap(raw, 0);
+}
+
+static void raw_async_free(struct raw_file *raw)
+{
+    struct raw_uring *u = raw->uring;
+    if (!u)
+        return;
+    io_uring_queue_exit(&u->ring);
+    free(u->bufs); free(u->next); free(u->chunk); free(u);
+    raw->uring = NULL;
+}
+
+#else
+
+bool raw_async_init(struct raw_file *raw, int depth)
+{
+    fprintf(stderr, "WARNING: Not built with liburing, no asynchronous writes!\n");
+    return false;
+}
+
+// Never called, as raw_async_init fails
+double complex *raw_async_buffer(struct raw_file *raw) { return NULL; }
+bool raw_async_write(struct raw_file *raw, double complex *buf, struct bl_data *bl,
+                     int time_chunk_ix, int freq_chunk_ix, int chunk_index) { return false; }
+bool raw_async_wait_chunk(struct raw_file *raw, int chunk_index) { return true; }
+bool raw_async_flush(struct raw_file *raw) { return true; }
+static void raw_async_free(struct raw_file *raw) { }
+
+#endif // HAVE_LIBURING
@@ -0,0 +1,77 @@
+
+#ifndef RAW_H
+#define RAW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <complex.h>
+#include <sys/types.h>
+
+struct work_config;
+struct bl_data;
+struct raw_uring;
+
+// Alignment of offsets and buffers for O_DIRECT. Logical block sizes
+// are at most 4K on all file systems we care about.
+#define RAW_ALIGN 4096
+
+// Header at the start of a raw visibility file. It is followed by
+// "bl_count" baselines as (antenna1, antenna2) pairs of uint32_t,
+// then padding up to "data_offset". After that the file holds
+// [bl_count, time_chunks, freq_chunks] chunks of "chunk_stride"
+// bytes each, with every chunk containing [time_chunk, freq_chunk]
+// visibilities (double complex) plus padding. All numbers are in
+// native byte order.
+#define RAW_MAGIC "IOTVRAW1"
+struct raw_header
+{
+    char magic[8];
+    uint32_t bl_count;
+    uint32_t time_count, freq_count;
+    uint32_t time_chunk, freq_chunk;
+    uint32_t time_chunks, freq_chunks;
+    uint32_t pad;
+    uint64_t chunk_stride;
+    uint64_t data_offset;
+};
+
+// Open raw visibility file
+struct raw_file
+{
+    int fd;
+    bool direct; // opened with O_DIRECT
+    int ant_count;
+    int *bl_index; // [ant_count * ant_count], baseline index or -1
+    int time_chunk, freq_chunk;
+    int time_chunks, freq_chunks;
+    size_t chunk_size; // bytes of visibility data per chunk
+    size_t chunk_stride; // bytes per chunk in file (aligned)
+    off_t data_offset;
+    void *buf; // aligned bounce buffer, chunk_stride bytes
+    struct raw_uring *uring; // asynchronous writes, if enabled
+};
+
+bool raw_create(struct raw_file *raw, const char *filename,
+                struct work_config *wcfg, int worker, int aggregator, bool direct);
+bool raw_open(struct raw_file *raw, const char *filename,
+              struct work_config *wcfg, bool direct);
+bool raw_read_chunk(struct raw_file *raw, struct bl_data *bl,
+                    int time_chunk_ix, int freq_chunk_ix,
+                    double complex *buf);
+bool raw_write_chunk(struct raw_file *raw, struct bl_data *bl,
+                     int time_chunk_ix, int freq_chunk_ix,
+                     double complex *buf);
+void raw_close(struct raw_file *raw);
+
+// Asynchronous writes using io_uring (only available if built with
+// liburing). Chunks get staged in buffers owned by the ring, and
+// written with up to "depth" writes in flight. Chunks must not be
+// read while writes to them are outstanding, see raw_async_wait_chunk.
+bool raw_async_init(struct raw_file *raw, int depth);
+double complex *raw_async_buffer(struct raw_file *raw);
+bool raw_async_write(struct raw_file *raw, double complex *buf, struct bl_data *bl,
+                     int time_chunk_ix, int freq_chunk_ix, int chunk_index);
+bool raw_async_wait_chunk(struct raw_file *raw, int chunk_index);
+bool raw_async_flush(struct raw_file *raw);
+
+#endif // RAW_H
@@ -7,6 +7,7 @@
 #include <math.h>
 #include <time.h>
 #include <omp.h>
+#include <string.h>
 #include <sys/stat.h>
 
 double *generate_Fb(int yN_size, int yB_size, double *pswf) {
@@ -82,27 +83,58 @@ void prepare_facet(int yB_size, int yP_size,
     }
 }
 
-void extract_subgrid(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size, int subgrid_offset,
-                     double *m_trunc, double *Fn,
-                     complex double *BF, int BF_stride,
-                     complex double *MBF, fftw_plan MBF_plan,
-                     complex double *NMBF, int NMBF_stride) {
+// Same as prepare_facet, for a real-valued facet. Writes the prepared
+// row in reverse order: Then a (forward) real-to-complex transform
+// yields the backward transform we need, see recombine2d_bf_plan_r2c.
+void prepare_facet_real(int yB_size, int yP_size,
+                        double *Fb,
+                        double *facet, int facet_stride,
+                        double *BF) {
+    int i;
+    BF[0] = Fb[0] * facet[0] / yP_size;
+    for (i = 1; i < yB_size/2; i++) {
+        BF[yP_size-i] = Fb[i] * facet[facet_stride*i] / yP_size;
+    }
+    for (; i < yP_size-yB_size/2; i++) {
+        BF[yP_size-i] = 0;
+    }
+    for (; i < yP_size; i++) {
+        BF[yP_size-i] = Fb[yB_size-yP_size+i] * facet[facet_stride*(yB_size-yP_size+i)] / yP_size;
+    }
+}
+
+// Entry of a BF row. If we only have half of it (real facets), the
+// rest follows from Hermitian symmetry.
+static inline complex double _bf_entry(complex double *BF, int BF_stride, int yP_size,
+                                       int ix, bool half)
+{
+    ix %= yP_size;
+    if (half && ix > yP_size / 2)
+        return conj(BF[BF_stride * (yP_size - ix)]);
+    return BF[BF_stride * ix];
+}
+
+static inline void _extract_subgrid(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size,
+                                    int subgrid_offset, double *m_trunc, double *Fn,
+                                    complex double *BF, int BF_stride, bool half,
+                                    complex double *MBF, fftw_plan MBF_plan,
+                                    complex double *NMBF, int NMBF_stride) {
     int i;
     int xN_yP_size = xMxN_yP_size - xM_yP_size;
     assert(xN_yP_size % 2 == 0); // re-check loop borders...
     subgrid_offset += 2 * yP_size; assert(subgrid_offset >= xM_yP_size);
     // m * b, with xN_yP_size worth of margin looping around the sides
     for (i = 0; i < xM_yP_size - xMxN_yP_size / 2; i++) {
-        MBF[i] = m_trunc[i] * BF[BF_stride * ((i + subgrid_offset) % yP_size)];
+        MBF[i] = m_trunc[i] * _bf_entry(BF, BF_stride, yP_size, i + subgrid_offset, half);
     }
     for (; i < (xMxN_yP_size + 1) / 2; i++) {
-        MBF[i] = m_trunc[i] * BF[BF_stride * ((i + subgrid_offset) % yP_size)];
+        MBF[i] = m_trunc[i] * _bf_entry(BF, BF_stride, yP_size, i + subgrid_offset, half);
         int bf_ix = i + subgrid_offset - xM_yP_size;
-        MBF[i] += m_trunc[xN_yP_size+i] * BF[BF_stride * (bf_ix % yP_size)];
+        MBF[i] += m_trunc[xN_yP_size+i] * _bf_entry(BF, BF_stride, yP_size, bf_ix, half);
     }
     for (; i < xM_yP_size; i++) {
         int bf_ix = i + subgrid_offset - xM_yP_size;
-        MBF[i] = m_trunc[xN_yP_size+i] * BF[BF_stride * (bf_ix % yP_size)];
+        MBF[i] = m_trunc[xN_yP_size+i] * _bf_entry(BF, BF_stride, yP_size, bf_ix, half);
     }
     fftw_execute(MBF_plan);
     for (i = 0; i < xM_yN_size / 2; i++) {
@@ -113,6 +145,41 @@ void extract_subgrid(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_si
     }
 }
 
+void extract_subgrid(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size, int subgrid_offset,
+                     double *m_trunc, double *Fn,
+                     complex double *BF, int BF_stride,
+                     complex double *MBF, fftw_plan MBF_plan,
+                     complex double *NMBF, int NMBF_stride) {
+    _extract_subgrid(yP_size, xM_yP_size, xMxN_yP_size, xM_yN_size, subgrid_offset,
+                     m_trunc, Fn, BF, BF_stride, false, MBF, MBF_plan, NMBF, NMBF_stride);
+}
+
+// Same as extract_subgrid, with BF only holding entries [0,yP_size/2]
+// of a Hermitian-symmetric row (real facets)
+void extract_subgrid_half(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size, int subgrid_offset,
+                          double *m_trunc, double *Fn,
+                          complex double *BF, int BF_stride,
+                          complex double *MBF, fftw_plan MBF_plan,
+                          complex double *NMBF, int NMBF_stride) {
+    _extract_subgrid(yP_size, xM_yP_size, xMxN_yP_size, xM_yN_size, subgrid_offset,
+                     m_trunc, Fn, BF, BF_stride, true, MBF, MBF_plan, NMBF, NMBF_stride);
+}
+
+// Extract subgrid from a row of BF (full or half, see F_real)
+static void extract_subgrid_bf(struct recombine2d_config *cfg, int subgrid_offset,
+                               complex double *BF, complex double *MBF, fftw_plan MBF_plan,
+                               complex double *NMBF, int NMBF_stride)
+{
+    if (cfg->F_real)
+        extract_subgrid_half(cfg->yP_size, cfg->xM_yP_size, cfg->xMxN_yP_size, cfg->xM_yN_size,
+                             subgrid_offset, cfg->m, cfg->Fn, BF, cfg->BF_stride1,
+                             MBF, MBF_plan, NMBF, NMBF_stride);
+    else
+        extract_subgrid(cfg->yP_size, cfg->xM_yP_size, cfg->xMxN_yP_size, cfg->xM_yN_size,
+                        subgrid_offset, cfg->m, cfg->Fn, BF, cfg->BF_stride1,
+                        MBF, MBF_plan, NMBF, NMBF_stride);
+}
+
 
 void add_facet(int xM_size, int xM_yN_size, int facet_offset,
                complex double *NMBF, int NMBF_stride,
@@ -167,6 +234,7 @@ bool recombine2d_set_config(struct recombine2d_config *cfg,
     cfg->xM_yP_size = cfg->xM_size * cfg->yP_size / cfg->image_size;
     assert((cfg->xM_size * cfg->yN_size) % cfg->image_size == 0);
     cfg->xM_yN_size = cfg->xM_size * cfg->yN_size / cfg->image_size;
+    cfg->F_real = false;
 
     cfg->F_size = sizeof(double complex) * cfg->yB_size * cfg->yB_size;
     cfg->BF_size = sizeof(double complex) * cfg->yP_size * cfg->yB_size;
@@ -196,6 +264,16 @@ bool recombine2d_set_config(struct recombine2d_config *cfg,
     return true;
 }
 
+// Switch to real-valued facets. We then only need half of every row
+// of BF, the rest follows from Hermitian symmetry.
+void recombine2d_set_real(struct recombine2d_config *cfg, bool real)
+{
+    cfg->F_real = real;
+    cfg->F_size = (real ? sizeof(double) : sizeof(double complex)) * cfg->yB_size * cfg->yB_size;
+    cfg->BF_stride0 = real ? cfg->yP_size / 2 + 1 : cfg->yP_size;
+    cfg->BF_size = sizeof(double complex) * cfg->BF_stride0 * cfg->yB_size;
+}
+
 void recombine2d_free(struct recombine2d_config *cfg)
 {
     free(cfg->Fb); free(cfg->Fn); free(cfg->m);
@@ -221,12 +299,26 @@ static double get_time_ns()
 fftw_plan recombine2d_bf_plan(struct recombine2d_config *cfg, int BF_batch,
                               double complex *BF, unsigned planner_flags)
 {
+    // Note that this is also used for the second axis (see
+    // recombine2d_pf0_ft0_omp), so use full rows even for real facets
     return fftw_plan_many_dft(1, &cfg->yP_size, BF_batch,
-                              BF, 0, cfg->BF_stride1, cfg->BF_stride0,
-                              BF, 0, cfg->BF_stride1, cfg->BF_stride0,
+                              BF, 0, 1, cfg->yP_size,
+                              BF, 0, 1, cfg->yP_size,
                               FFTW_BACKWARD, planner_flags);
 }
 
+// Transform of real facet rows (prepared using prepare_facet_real),
+// in place. Output is the first half of the rows' backward transform.
+fftw_plan recombine2d_bf_plan_r2c(struct recombine2d_config *cfg, int BF_batch,
+                                  double complex *BF, unsigned planner_flags)
+{
+    assert(cfg->F_real && cfg->BF_stride1 == 1);
+    return fftw_plan_many_dft_r2c(1, &cfg->yP_size, BF_batch,
+                                  (double *)BF, 0, 1, 2 * cfg->BF_stride0,
+                                  BF, 0, 1, cfg->BF_stride0,
+                                  planner_flags);
+}
+
 void recombine2d_init_worker(struct recombine2d_worker *worker, struct recombine2d_config *cfg,
                              int BF_batch, fftw_plan BF_plan, unsigned planner_flags)
 {
@@ -238,9 +330,12 @@ void recombine2d_init_worker(struct recombine2d_worker *worker, struct recombine
     worker->MBF = (double complex *)malloc(cfg->MBF_size);
     worker->NMBF = (double complex *)malloc(cfg->NMBF_size);
     worker->NMBF_BF = (double complex *)malloc(cfg->NMBF_BF_size);
+    worker->BF_chunk = (double complex *)malloc(sizeof(double complex) * cfg->yP_size * BF_batch);
 
     // Plan Fourier Transforms
     worker->BF_batch = BF_batch; worker->BF_plan = BF_plan;
+    worker->BF0_plan = cfg->F_real ?
+        recombine2d_bf_plan(cfg, BF_batch, worker->BF_chunk, planner_flags) : BF_plan;
     worker->MBF_plan = fftw_plan_dft_1d(cfg->xM_yP_size, worker->MBF, worker->MBF,
                                         FFTW_FORWARD, planner_flags);
     worker->NMBF_BF_plan = fftw_plan_many_dft(1, &cfg->yP_size, cfg->xM_yN_size,
@@ -256,94 +351,134 @@ void recombine2d_init_worker(struct recombine2d_worker *worker, struct recombine
 void recombine2d_free_worker(struct recombine2d_worker *worker)
 {
     // (BF_plan is assumed to be shared)
+    if (worker->BF0_plan != worker->BF_plan)
+        fftw_free(worker->BF0_plan);
     fftw_free(worker->MBF_plan);
     fftw_free(worker->NMBF_BF_plan);
 
     free(worker->MBF);
     free(worker->NMBF);
     free(worker->NMBF_BF);
+    free(worker->BF_chunk);
+}
+
+// Whether facet rows [y,y_end) are known to be zero (see F_rows)
+static inline bool _rows_zero(const bool *F_rows, int y, int y_end)
+{
+    if (!F_rows) return false;
+    for (; y < y_end; y++)
+        if (F_rows[y]) return false;
+    return true;
+}
+
+// Extracting a subgrid from a zero row yields zero
+static inline void _zero_nmbf_row(struct recombine2d_config *cfg,
+                                  complex double *NMBF, int NMBF_stride)
+{
+    int i;
+    for (i = 0; i < cfg->xM_yN_size; i++)
+        NMBF[i * NMBF_stride] = 0;
+}
+
+// Prepare and Fourier transform a batch of facet rows [y,y_end)
+static void _pf1_ft1_batch(struct recombine2d_worker *worker,
+                           void *F, const bool *F_rows, int y, int y_end,
+                           complex double *BF)
+{
+    struct recombine2d_config *cfg = worker->cfg;
+
+    // Nothing to transform?
+    double start = get_time_ns();
+    if (_rows_zero(F_rows, y, y_end)) {
+        memset(BF, 0, sizeof(complex double) * cfg->BF_stride0 * (y_end - y));
+        worker->pf1_time += get_time_ns() - start;
+        return;
+    }
+
+    // Facet preparation along first axis
+    int y2;
+    for (y2 = y; y2 < y_end; y2++) {
+        if (cfg->F_real)
+            prepare_facet_real(cfg->yB_size, cfg->yP_size, cfg->Fb,
+                               (double *)F+y2*cfg->F_stride0, cfg->F_stride1,
+                               (double *)(BF+(y2-y)*cfg->BF_stride0));
+        else
+            prepare_facet(cfg->yB_size, cfg->yP_size, cfg->Fb,
+                          (complex double *)F+y2*cfg->F_stride0, cfg->F_stride1,
+                          BF+(y2-y)*cfg->BF_stride0, cfg->BF_stride1);
+    }
+    worker->pf1_time += get_time_ns() - start;
+
+    // Fourier transform along first axis
+    start = get_time_ns();
+    if (cfg->F_real)
+        fftw_execute_dft_r2c(worker->BF_plan, (double *)BF, BF);
+    else
+        fftw_execute_dft(worker->BF_plan, BF, BF);
+    worker->ft1_time += get_time_ns() - start;
 }
 
 void recombine2d_pf1_ft1_omp(struct recombine2d_worker *worker,
-                             complex double *F,
+                             void *F, const bool *F_rows,
                              complex double *BF)
 {
     struct recombine2d_config *cfg = worker->cfg;
     int y;
 #pragma omp for schedule(dynamic)
     for (y = 0; y < cfg->yB_size; y+=worker->BF_batch) {
-
-        // Facet preparation along first axis
-        double start = get_time_ns();
-        int y2;
-        for (y2 = y; y2 < y+worker->BF_batch && y2 < cfg->yB_size; y2++) {
-            prepare_facet(cfg->yB_size, cfg->yP_size, cfg->Fb,
-                          F+y2*cfg->F_stride0, cfg->F_stride1,
-                          BF+y2*cfg->BF_stride0, cfg->BF_stride1);
-        }
-        worker->pf1_time += get_time_ns() - start;
-
-        // Fourier transform along first axis
-        start = get_time_ns();
-        fftw_execute_dft(worker->BF_plan, BF+y*cfg->BF_stride0, BF+y*cfg->BF_stride0);
-        worker->ft1_time += get_time_ns() - start;
+        int y_end = y+worker->BF_batch;
+        if (y_end > cfg->yB_size) y_end = cfg->yB_size;
+        _pf1_ft1_batch(worker, F, F_rows, y, y_end, BF+y*cfg->BF_stride0);
     }
 
 }
 
 void recombine2d_pf1_ft1_es1_omp(struct recombine2d_worker *worker,
                                  int subgrid_off1,
-                                 complex double *F,
+                                 void *F, const bool *F_rows,
                                  complex double *NMBF)
 {
     struct recombine2d_config *cfg = worker->cfg;
     int y;
 
-    int BF_chunk_size = sizeof(double complex) * cfg->yP_size * worker->BF_batch;
-    double complex *BF_chunk = malloc(BF_chunk_size);
+    double complex *BF_chunk = worker->BF_chunk;
     assert(cfg->BF_stride1 == 1);
     assert(cfg->NMBF_BF_stride0 == 1);
-    assert(cfg->BF_stride0 == cfg->NMBF_BF_stride1);
     assert(subgrid_off1 % cfg->subgrid_spacing == 0);
 
 #pragma omp for schedule(dynamic)
     for (y = 0; y < cfg->yB_size; y+=worker->BF_batch) {
 
-        // Facet preparation along first axis
-        double start = get_time_ns();
-        int y2;
-        for (y2 = y; y2 < y+worker->BF_batch && y2 < cfg->yB_size; y2++) {
-            prepare_facet(cfg->yB_size, cfg->yP_size, cfg->Fb,
-                          F+y2*cfg->F_stride0, cfg->F_stride1,
-                          BF_chunk+(y2-y)*cfg->BF_stride0, cfg->BF_stride1);
-        }
-        worker->pf1_time += get_time_ns() - start;
-
-        // Fourier transform along first axis
-        start = get_time_ns();
-        fftw_execute_dft(worker->BF_plan, BF_chunk, BF_chunk);
-        worker->ft1_time += get_time_ns() - start;
+        // Facet preparation and Fourier transform along first axis
+        // (skipped for batches of zero rows)
+        int y_end = y+worker->BF_batch;
+        if (y_end > cfg->yB_size) y_end = cfg->yB_size;
+        const bool zero = _rows_zero(F_rows, y, y_end);
+        if (!zero)
+            _pf1_ft1_batch(worker, F, NULL, y, y_end, BF_chunk);
 
         // Extract subgrids along first axis
         assert(subgrid_off1 % cfg->subgrid_spacing == 0);
         int subgrid_offset = subgrid_off1 / cfg->subgrid_spacing * cfg->yP_spacing;
-        start = get_time_ns();
-        for (y2 = y; y2 < y+worker->BF_batch && y2 < cfg->yB_size; y2++) {
-            extract_subgrid(cfg->yP_size, cfg->xM_yP_size, cfg->xMxN_yP_size, cfg->xM_yN_size,
-                            subgrid_offset, cfg->m, cfg->Fn,
-                            BF_chunk+(y2-y)*cfg->BF_stride0, cfg->BF_stride1,
-                            worker->MBF, worker->MBF_plan,
-                            NMBF+y2*cfg->NMBF_stride0, cfg->NMBF_stride1);
+        double start = get_time_ns();
+        int y2;
+        for (y2 = y; y2 < y_end; y2++) {
+            if (zero || (F_rows && !F_rows[y2]))
+                _zero_nmbf_row(cfg, NMBF+y2*cfg->NMBF_stride0, cfg->NMBF_stride1);
+            else
+                extract_subgrid_bf(cfg, subgrid_offset, BF_chunk+(y2-y)*cfg->BF_stride0,
+                                   worker->MBF, worker->MBF_plan,
+                                   NMBF+y2*cfg->NMBF_stride0, cfg->NMBF_stride1);
         }
         worker->es1_time += get_time_ns() - start;
 
     }
 
-    free(BF_chunk);
 }
 
 void recombine2d_es1_pf0_ft0(struct recombine2d_worker *worker,
-                             int subgrid_off1, complex double *BF, double complex *NMBF_BF)
+                             int subgrid_off1, complex double *BF, const bool *F_rows,
+                             double complex *NMBF_BF)
 {
     struct recombine2d_config *cfg = worker->cfg;
     int x,y;
@@ -353,11 +488,12 @@ void recombine2d_es1_pf0_ft0(struct recombine2d_worker *worker,
     int subgrid_offset = subgrid_off1 / cfg->subgrid_spacing * cfg->yP_spacing;
     double start = get_time_ns();
     for (x = 0; x < cfg->yB_size; x++) {
-        extract_subgrid(cfg->yP_size, cfg->xM_yP_size, cfg->xMxN_yP_size, cfg->xM_yN_size,
-                        subgrid_offset, cfg->m, cfg->Fn,
-                        BF+x*cfg->BF_stride0, cfg->BF_stride1,
-                        worker->MBF, worker->MBF_plan,
-                        worker->NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
+        if (F_rows && !F_rows[x])
+            _zero_nmbf_row(cfg, worker->NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
+        else
+            extract_subgrid_bf(cfg, subgrid_offset, BF+x*cfg->BF_stride0,
+                               worker->MBF, worker->MBF_plan,
+                               worker->NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
     }
     worker->es1_time += get_time_ns() - start;
 
@@ -382,7 +518,7 @@ void recombine2d_es1_pf0_ft0(struct recombine2d_worker *worker,
 
 void recombine2d_es1_omp(struct recombine2d_worker *worker,
                          int subgrid_off1,
-                         complex double *BF,
+                         complex double *BF, const bool *F_rows,
                          double complex *NMBF)
 {
     struct recombine2d_config *cfg = worker->cfg;
@@ -394,11 +530,12 @@ void recombine2d_es1_omp(struct recombine2d_worker *worker,
     double start = get_time_ns();
 #pragma omp for schedule(dynamic, worker->BF_batch)
     for (x = 0; x < cfg->yB_size; x++) {
-        extract_subgrid(cfg->yP_size, cfg->xM_yP_size, cfg->xMxN_yP_size, cfg->xM_yN_size,
-                        subgrid_offset, cfg->m, cfg->Fn,
-                        BF+x*cfg->BF_stride0, cfg->BF_stride1,
-                        worker->MBF, worker->MBF_plan,
-                        NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
+        if (F_rows && !F_rows[x])
+            _zero_nmbf_row(cfg, NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
+        else
+            extract_subgrid_bf(cfg, subgrid_offset, BF+x*cfg->BF_stride0,
+                               worker->MBF, worker->MBF_plan,
+                               NMBF+x*cfg->NMBF_stride0, cfg->NMBF_stride1);
     }
     worker->es1_time += get_time_ns() - start;
 
@@ -412,7 +549,7 @@ void recombine2d_pf0_ft0_omp(struct recombine2d_worker *worker,
 
     assert(cfg->BF_stride1 == 1);
     assert(cfg->NMBF_BF_stride0 = 1);
-    assert(cfg->BF_stride0 == cfg->NMBF_BF_stride1);
+    assert(cfg->yP_size == cfg->NMBF_BF_stride1);
 
     int y;
 #pragma omp for schedule(dynamic)
@@ -432,13 +569,14 @@ void recombine2d_pf0_ft0_omp(struct recombine2d_worker *worker,
 
         // Note 1: We are re-using the BF FFTW plan, which happens to
         // work because we switched strides (see assertions at start
-        // of routine).
+        // of routine). With real facets that plan is real-to-complex,
+        // so we use a complex one of the same shape instead.
 
         // Note 2: We do not want to assume that xM_yN_size gets
         // evenly divided by BF_batch, the quick hack here is to just
         // make an on-the-fly plan for the last bit
         start = get_time_ns();
-        fftw_plan plan = worker->BF_plan;
+        fftw_plan plan = worker->BF0_plan;
         if (y+worker->BF_batch >= cfg->xM_yN_size) {
             plan = recombine2d_bf_plan(worker->cfg, cfg->xM_yN_size - y,
                                        NMBF_BF+y*cfg->NMBF_BF_stride1,
@@ -447,7 +585,7 @@ void recombine2d_pf0_ft0_omp(struct recombine2d_worker *worker,
         fftw_execute_dft(plan,
                          NMBF_BF+y*cfg->NMBF_BF_stride1,
                          NMBF_BF+y*cfg->NMBF_BF_stride1);
-        if (plan != worker->BF_plan)
+        if (plan != worker->BF0_plan)
             fftw_free(plan);
         worker->ft2_time += get_time_ns() - start;
 
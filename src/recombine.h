@@ -19,11 +19,20 @@ void prepare_facet(int yB_size, int yP_size,
                    double *Fb,
                    double complex *facet, int facet_stride,
                    double complex *BF, int BF_stride);
+void prepare_facet_real(int yB_size, int yP_size,
+                        double *Fb,
+                        double *facet, int facet_stride,
+                        double *BF);
 void extract_subgrid(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size, int subgrid_offset,
                      double *m_trunc, double *Fn,
                      complex double *BF, int BF_stride,
                      complex double *MBF, fftw_plan MBF_plan,
                      complex double *NMBF, int NMBF_stride);
+void extract_subgrid_half(int yP_size, int xM_yP_size, int xMxN_yP_size, int xM_yN_size, int subgrid_offset,
+                          double *m_trunc, double *Fn,
+                          complex double *BF, int BF_stride,
+                          complex double *MBF, fftw_plan MBF_plan,
+                          complex double *NMBF, int NMBF_stride);
 void add_facet(int xM_size, int xM_yN_size, int facet_offset,
                complex double *NMBF, int NMBF_stride,
                complex double *out, int out_stride);
@@ -51,6 +60,9 @@ struct recombine2d_config {
     int xM_spacing; // Facet spacing in image sampled at xM resolution
     int xM_yP_size; // Buffer size for "m" mask multiplication
     int xM_yN_size; // Size of subgrid/facet pieces to exchange
+    // Real-valued facets: F holds doubles, and BF only the first
+    // yP_size/2+1 entries of every row (see recombine2d_set_real)
+    bool F_real;
     // Derived data layout (F, b*F, m(b*F), n*m(b*F) respectively for two axes)
     size_t F_size, BF_size, MBF_size;
     size_t NMBF_size, NMBF_BF_size, NMBF_NMBF_size;
@@ -69,6 +81,7 @@ bool recombine2d_set_config(struct recombine2d_config *cfg,
                             char *pswf_file,
                             int yB_size, int yN_size, int yP_size,
                             int xA_size, int xM_size, int xMxN_yP_size);
+void recombine2d_set_real(struct recombine2d_config *cfg, bool real);
 void recombine2d_free(struct recombine2d_config *cfg);
 
 uint64_t recombine2d_global_memory(struct recombine2d_config *cfg);
@@ -85,17 +98,21 @@ struct recombine2d_worker {
 
     // Plans associated with buffers
     int BF_batch; fftw_plan BF_plan; // shared
+    fftw_plan BF0_plan; // same as BF_plan, unless facets are real
     fftw_plan NMBF_BF_plan, MBF_plan;
 
     // Private buffers
     double complex *MBF;
     double complex *NMBF;
     double complex *NMBF_BF;
+    double complex *BF_chunk; // BF_batch rows, see recombine2d_pf1_ft1_es1_omp
 
 };
 
 fftw_plan recombine2d_bf_plan(struct recombine2d_config *cfg, int BF_batch,
                               double complex *BF, unsigned planner_flags);
+fftw_plan recombine2d_bf_plan_r2c(struct recombine2d_config *cfg, int BF_batch,
+                                  double complex *BF, unsigned planner_flags);
 void recombine2d_init_worker(struct recombine2d_worker *worker, struct recombine2d_config *cfg,
                              int BF_batch, fftw_plan BF_plan, unsigned planner_flags);
 void recombine2d_free_worker(struct recombine2d_worker *worker);
@@ -110,15 +127,24 @@ void recombine2d_free_worker(struct recombine2d_worker *worker);
 // axis 1 is X. This is why we start with axis 1 for locality. Step 1
 // increases the amount of data that has to be held, step 2 typically
 // reduces, step 3 reduces further.
+//
+// F is double complex, or double if the configuration has real facets.
+//
+// F_rows optionally marks the facet rows that can be non-zero (e.g.
+// for sparse facets with only a few sources). All other rows are
+// assumed to be zero, so we can skip work on them. NULL if unknown.
 void recombine2d_pf1_ft1_omp(struct recombine2d_worker *worker,
-                             complex double *F, complex double *BF);
+                             void *F, const bool *F_rows, complex double *BF);
 // ^^ OpenMP "parallel for" inside, good to call with multiple threads
 void recombine2d_pf1_ft1_es1_omp(struct recombine2d_worker *worker,
-                                 int subgrid_off1, complex double *F, complex double *NMBF);
+                                 int subgrid_off1, void *F, const bool *F_rows,
+                                 complex double *NMBF);
 void recombine2d_es1_pf0_ft0(struct recombine2d_worker *worker,
-                             int subgrid_off0, complex double *BF, double complex *NMBF_BF);
+                             int subgrid_off0, complex double *BF, const bool *F_rows,
+                             double complex *NMBF_BF);
 void recombine2d_es1_omp(struct recombine2d_worker *worker,
-                         int subgrid_off1, complex double *BF, double complex *NMBF);
+                         int subgrid_off1, complex double *BF, const bool *F_rows,
+                         double complex *NMBF);
 void recombine2d_pf0_ft0_omp(struct recombine2d_worker *worker,
                              double complex *NMBF, double complex *NMBF_BF);
 void recombine2d_es0(struct recombine2d_worker *worker,
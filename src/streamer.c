@@ -15,6 +15,50 @@
 
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Chunk queues are rings with a sequence number per slot. Producers
+// draw tickets, slot (ticket % queue_length) is free for ticket t once
+// its sequence number is t, and ready for the writer once it is t+1.
+// We spin shortly, then sleep on the sequence number using a futex.
+// Note that the futexes are not private, as with forked writers the
+// queue lives in shared memory.
+#define RING_SPIN 1024
+
+static void ring_wait(uint32_t *seq, uint32_t *waiters, uint32_t expected)
+{
+    int spin;
+    for (spin = 0; spin < RING_SPIN; spin++) {
+        if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) == expected)
+            return;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t current;
+    while ((current = __atomic_load_n(seq, __ATOMIC_SEQ_CST)) != expected) {
+#ifdef __linux__
+        syscall(SYS_futex, seq, FUTEX_WAIT, current, NULL, NULL, 0);
+#else
+        usleep(10);
+#endif
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void ring_post(uint32_t *seq, uint32_t *waiters, uint32_t value)
+{
+    __atomic_store_n(seq, value, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
 
 struct streamer_chunk *writer_push_slot(struct streamer_writer *writer,
                                         struct bl_data *bl_data,
@@ -22,25 +66,11 @@ struct streamer_chunk *writer_push_slot(struct streamer_writer *writer,
 {
     if (!writer) return NULL;
 
-    // Determine our slot (competing with other tasks, so need to have
-    // critical section here)
-    int vis_slot;
-    #pragma omp critical
-    {
-        vis_slot = writer->in_ptr;
-        writer->in_ptr = (writer->in_ptr + 1) % writer->queue_length;
-    }
-
-    // Obtain lock for writing data (writer thread might not have
-    // written this data to disk yet)
-    struct streamer_chunk *chunk = writer->queue + vis_slot;
-#pragma omp atomic
-    writer->to_write += 1;
-#ifndef __APPLE__
-    sem_wait(&chunk->in_lock);
-#else
-    dispatch_semaphore_wait(chunk->in_lock, DISPATCH_TIME_FOREVER);
-#endif
+    // Determine our slot, then wait for the writer to be done with
+    // it (might not have written its last data to disk yet)
+    const uint64_t ticket = __atomic_fetch_add(&writer->in_ticket, 1, __ATOMIC_RELAXED);
+    struct streamer_chunk *chunk = writer->queue + ticket % writer->queue_length;
+    ring_wait(&chunk->seq, &chunk->waiters, (uint32_t)ticket);
 
     // Set slot data
     chunk->bl_data = bl_data;
@@ -49,6 +79,38 @@ struct streamer_chunk *writer_push_slot(struct streamer_writer *writer,
     return chunk;
 }
 
+void writer_push_done(struct streamer_chunk *chunk)
+{
+    ring_post(&chunk->seq, &chunk->waiters, chunk->seq + 1);
+}
+
+// Wait for the next chunk to write, and release it afterwards
+static struct streamer_chunk *writer_pop_slot(struct streamer_writer *writer)
+{
+    const uint64_t ticket = writer->out_ticket;
+    struct streamer_chunk *chunk = writer->queue + ticket % writer->queue_length;
+    ring_wait(&chunk->seq, &chunk->waiters, (uint32_t)(ticket + 1));
+    return chunk;
+}
+#ifdef H5_HAVE_PARALLEL
+// Next chunk to write if it is ready already, NULL otherwise (see
+// streamer_writer_collective)
+static struct streamer_chunk *writer_try_pop_slot(struct streamer_writer *writer)
+{
+    const uint64_t ticket = writer->out_ticket;
+    struct streamer_chunk *chunk = writer->queue + ticket % writer->queue_length;
+    if (__atomic_load_n(&chunk->seq, __ATOMIC_ACQUIRE) != (uint32_t)(ticket + 1))
+        return NULL;
+    return chunk;
+}
+#endif
+static void writer_pop_done(struct streamer_writer *writer, struct streamer_chunk *chunk)
+{
+    const uint64_t ticket = writer->out_ticket;
+    ring_post(&chunk->seq, &chunk->waiters, (uint32_t)(ticket + writer->queue_length));
+    __atomic_store_n(&writer->out_ticket, ticket + 1, __ATOMIC_RELEASE);
+}
+
 void streamer_ireceive(struct streamer *streamer,
                        int subgrid_work, int slot)
 {
@@ -239,42 +301,519 @@ void *streamer_reader_thread(void *param)
     return NULL;
 }
 
+// Write-back cache for visibility chunks. Contributions to a chunk
+// get accumulated until all planned contributions have arrived (see
+// streamer_count_chunk_contributions), so the chunk only needs to get
+// written once. If the cache is full, the oldest chunk gets flushed
+// early.
+struct writer_cache_entry
+{
+    int chunk_index;
+    struct bl_data *bl_data;
+    int tchunk, fchunk;
+    int hash_next; // next entry in hash bucket (or free list)
+    int prev, next; // neighbours in order of insertion
+    double complex *vis;
+    int *ranges; // per time step: range [i0,i1) holding data (see writer_cache_add)
+    bool complete; // holds the whole chunk (read back from file)
+};
+
+struct writer_cache
+{
+    int size, used;
+    int buckets, *bucket; // hash table
+    int free, oldest, newest;
+    struct writer_cache_entry *entries;
+    double complex *vis;
+    int *ranges;
+};
+
+static bool writer_cache_init(struct writer_cache *cache, size_t bytes,
+                              int time_chunk, int freq_chunk)
+{
+    const int vis_count = time_chunk * freq_chunk;
+    int i;
+    cache->size = bytes / (sizeof(double complex) * vis_count);
+    cache->used = 0;
+    cache->buckets = 2 * cache->size + 1;
+    cache->bucket = (int *)malloc(sizeof(int) * cache->buckets);
+    cache->entries = (struct writer_cache_entry *)
+        malloc(sizeof(struct writer_cache_entry) * cache->size);
+    // Aligned, so entries can get written with O_DIRECT (see raw_write_chunk)
+    void *vis = NULL;
+    if (posix_memalign(&vis, RAW_ALIGN, sizeof(double complex) * vis_count * cache->size))
+        vis = NULL;
+    cache->vis = (double complex *)vis;
+    cache->ranges = (int *)malloc(sizeof(int) * 2 * time_chunk * cache->size);
+    if (!cache->bucket || !cache->entries || !cache->vis || !cache->ranges)
+        return false;
+    for (i = 0; i < cache->buckets; i++)
+        cache->bucket[i] = -1;
+    for (i = 0; i < cache->size; i++) {
+        cache->entries[i].hash_next = (i + 1 < cache->size ? i + 1 : -1);
+        cache->entries[i].vis = cache->vis + (size_t)vis_count * i;
+        cache->entries[i].ranges = cache->ranges + 2 * time_chunk * i;
+    }
+    cache->free = (cache->size > 0 ? 0 : -1);
+    cache->oldest = cache->newest = -1;
+    return true;
+}
+
+static void writer_cache_free(struct writer_cache *cache)
+{
+    free(cache->bucket); free(cache->entries); free(cache->vis);
+    free(cache->ranges);
+}
+
+static struct writer_cache_entry *writer_cache_get(struct writer_cache *cache, int chunk_index)
+{
+    int i;
+    for (i = cache->bucket[chunk_index % cache->buckets]; i >= 0; i = cache->entries[i].hash_next)
+        if (cache->entries[i].chunk_index == chunk_index)
+            return cache->entries + i;
+    return NULL;
+}
+
+// Add an (empty) entry. Cache must not be full.
+static struct writer_cache_entry *writer_cache_insert(struct writer_cache *cache, int chunk_index,
+                                                      struct bl_data *bl_data, int tchunk, int fchunk,
+                                                      int time_chunk)
+{
+    assert(cache->free >= 0);
+    const int i = cache->free;
+    struct writer_cache_entry *entry = cache->entries + i;
+    cache->free = entry->hash_next;
+    entry->chunk_index = chunk_index;
+    entry->bl_data = bl_data;
+    entry->tchunk = tchunk; entry->fchunk = fchunk;
+    entry->hash_next = cache->bucket[chunk_index % cache->buckets];
+    cache->bucket[chunk_index % cache->buckets] = i;
+    entry->prev = cache->newest; entry->next = -1;
+    if (cache->newest >= 0)
+        cache->entries[cache->newest].next = i;
+    else
+        cache->oldest = i;
+    cache->newest = i;
+    cache->used++;
+    memset(entry->ranges, 0, sizeof(int) * 2 * time_chunk);
+    entry->complete = false;
+    return entry;
+}
+
+// Add a contribution (with valid ranges per time step, see
+// streamer_chunk) to a cache entry. Entries track the hull of their
+// contributions per time step, clearing gaps between them as they
+// appear. Nothing outside the hull gets touched.
+static void writer_cache_add(struct writer_cache_entry *entry,
+                             const int *ranges, const double complex *vis,
+                             int time_chunk, int freq_chunk)
+{
+    int t, i;
+    for (t = 0; t < time_chunk; t++) {
+        const int i0 = ranges[t*2], i1 = ranges[t*2+1];
+        int *hull = entry->ranges + t*2;
+        double complex *row = entry->vis + t * freq_chunk;
+        if (i1 <= i0)
+            continue;
+        if (hull[1] <= hull[0]) {
+            hull[0] = i0; hull[1] = i1;
+        } else {
+            if (i0 > hull[1])
+                memset(row + hull[1], 0, sizeof(double complex) * (i0 - hull[1]));
+            if (i1 < hull[0])
+                memset(row + i1, 0, sizeof(double complex) * (hull[0] - i1));
+            // Make sure we never over-write data!
+            for (i = (i0 > hull[0] ? i0 : hull[0]); i < (i1 < hull[1] ? i1 : hull[1]); i++)
+                assert(row[i] == 0);
+            if (i0 < hull[0]) hull[0] = i0;
+            if (i1 > hull[1]) hull[1] = i1;
+        }
+        memcpy(row + i0, vis + t * freq_chunk + i0, sizeof(double complex) * (i1 - i0));
+    }
+}
+
+static void writer_cache_remove(struct writer_cache *cache, struct writer_cache_entry *entry)
+{
+    const int i = entry - cache->entries;
+    int *pi = cache->bucket + entry->chunk_index % cache->buckets;
+    while (*pi != i)
+        pi = &cache->entries[*pi].hash_next;
+    *pi = entry->hash_next;
+    if (entry->prev >= 0) cache->entries[entry->prev].next = entry->next;
+    else cache->oldest = entry->next;
+    if (entry->next >= 0) cache->entries[entry->next].prev = entry->prev;
+    else cache->newest = entry->prev;
+    entry->hash_next = cache->free;
+    cache->free = i;
+    cache->used--;
+}
+
+// Read or write a visibility chunk using the configured backend
+static bool writer_read_vis_chunk(struct streamer_writer *writer, struct bl_data *bl_data,
+                                  int tchunk, int fchunk, double complex *buf)
+{
+    struct vis_spec *const spec = &writer->work_cfg->spec;
+    if (writer->work_cfg->vis_backend == VIS_BACKEND_RAW)
+        return raw_read_chunk(&writer->raw, bl_data, tchunk, fchunk, buf);
+    return read_vis_chunk(writer->group, &writer->ds_cache, bl_data,
+                          spec->time_chunk, spec->freq_chunk, tchunk, fchunk, buf);
+}
+static bool writer_write_vis_chunk(struct streamer_writer *writer, struct bl_data *bl_data,
+                                   int tchunk, int fchunk, double complex *buf)
+{
+    struct vis_spec *const spec = &writer->work_cfg->spec;
+    if (writer->work_cfg->vis_backend == VIS_BACKEND_RAW)
+        return raw_write_chunk(&writer->raw, bl_data, tchunk, fchunk, buf);
+    return write_vis_chunk(writer->group, &writer->ds_cache, bl_data,
+                           spec->time_chunk, spec->freq_chunk, tchunk, fchunk, buf);
+}
+
+// Wait for asynchronous writes of a chunk written before, so we can
+// read it back or write it again.
+static void writer_wait_chunk(struct streamer_writer *writer, int chunk_index,
+                              struct bl_data *bl_data, int tchunk, int fchunk)
+{
+    if (writer->raw.uring &&
+        !raw_async_wait_chunk(&writer->raw, chunk_index) &&
+        !raw_async_flush(&writer->raw))
+        fprintf(stderr, "ERROR: Could not complete earlier writes of visibility chunk %d/%d %d/%d!\n",
+                bl_data->antenna1, bl_data->antenna2, tchunk, fchunk);
+}
+
+// Write a visibility chunk. Only the given ranges (per time step, see
+// streamer_chunk) of vis_data hold data, or the whole chunk if ranges
+// is NULL. If the chunk was written before, we need to read it back
+// and merge the ranges, as we must not lose data. Otherwise
+// everything outside the ranges gets written as zero.
+static void writer_write_chunk(struct streamer_writer *writer, bool *chunks_written,
+                               int chunk_index, struct bl_data *bl_data,
+                               int tchunk, int fchunk,
+                               double complex *vis_data, const int *ranges,
+                               double complex *vis_data_h5)
+{
+    struct vis_spec *const spec = &writer->work_cfg->spec;
+    const int vis_count = spec->time_chunk * spec->freq_chunk;
+    const int vis_data_size = sizeof(double complex) * vis_count;
+
+    // With asynchronous writes, stage the chunk in a buffer owned by
+    // the ring. This might wait for earlier writes to finish. Even if
+    // we get no buffer (and fall back to synchronous I/O), earlier
+    // writes to the chunk must land before we read it back or write
+    // it again.
+    double complex *async_buf = NULL;
+    double start = get_time_ns();
+    if (writer->raw.uring)
+        async_buf = raw_async_buffer(&writer->raw);
+    if (chunks_written[chunk_index])
+        writer_wait_chunk(writer, chunk_index, bl_data, tchunk, fchunk);
+    writer->write_time += get_time_ns() - start;
+
+    start = get_time_ns();
+    double complex *out = (async_buf ? async_buf : vis_data);
+    if (!ranges) {
+        if (out != vis_data)
+            memcpy(out, vis_data, vis_data_size);
+    } else {
+        const bool merge = chunks_written[chunk_index];
+        if (merge) {
+            out = (async_buf ? async_buf : vis_data_h5);
+            writer_read_vis_chunk(writer, bl_data, tchunk, fchunk, out);
+        }
+        int t, i;
+        for (t = 0; t < spec->time_chunk; t++) {
+            const int i0 = ranges[t*2], i1 = ranges[t*2+1];
+            double complex *row = out + t * spec->freq_chunk;
+            if (merge) {
+                // Make sure we never over-write data!
+                for (i = i0; i < i1; i++)
+                    assert(row[i] == 0);
+            } else if (i1 <= i0) {
+                memset(row, 0, sizeof(double complex) * spec->freq_chunk);
+                continue;
+            } else {
+                memset(row, 0, sizeof(double complex) * i0);
+                memset(row + i1, 0, sizeof(double complex) * (spec->freq_chunk - i1));
+            }
+            if (i1 > i0 && out != vis_data)
+                memcpy(row + i0, vis_data + t * spec->freq_chunk + i0,
+                       sizeof(double complex) * (i1 - i0));
+        }
+    }
+    vis_data = out;
+    writer->read_time += get_time_ns() - start;
+
+    start = get_time_ns();
+    if (async_buf ?
+        !raw_async_write(&writer->raw, async_buf, bl_data, tchunk, fchunk, chunk_index) :
+        !writer_write_vis_chunk(writer, bl_data, tchunk, fchunk, vis_data))
+        fprintf(stderr, "ERROR: Could not write visibility chunk %d/%d %d/%d!\n",
+                bl_data->antenna1, bl_data->antenna2, tchunk, fchunk);
+    writer->written_vis_data += vis_data_size;
+    if (chunks_written[chunk_index])
+        writer->rewritten_vis_data += vis_data_size;
+    chunks_written[chunk_index] = true;
+    writer->write_time += get_time_ns() - start;
+}
+
+// Write out a cache entry and remove it
+static void writer_cache_flush(struct streamer_writer *writer, struct writer_cache *cache,
+                               struct writer_cache_entry *entry, bool *chunks_written,
+                               double complex *vis_data_h5)
+{
+    writer_write_chunk(writer, chunks_written, entry->chunk_index,
+                       entry->bl_data, entry->tchunk, entry->fchunk,
+                       entry->vis, entry->complete ? NULL : entry->ranges, vis_data_h5);
+    writer_cache_remove(cache, entry);
+}
+
+// Add a cache entry for a chunk. If the chunk was written before
+// (evicted early), start from what is in the file, so we never need
+// to merge more than one contribution's ranges.
+static struct writer_cache_entry *writer_cache_start(struct streamer_writer *writer,
+                                                     struct writer_cache *cache,
+                                                     int chunk_index, struct bl_data *bl_data,
+                                                     int tchunk, int fchunk, bool *chunks_written)
+{
+    struct vis_spec *const spec = &writer->work_cfg->spec;
+    struct writer_cache_entry *entry =
+        writer_cache_insert(cache, chunk_index, bl_data, tchunk, fchunk, spec->time_chunk);
+    if (chunks_written[chunk_index]) {
+        double start = get_time_ns();
+        writer_wait_chunk(writer, chunk_index, bl_data, tchunk, fchunk);
+        writer_read_vis_chunk(writer, bl_data, tchunk, fchunk, entry->vis);
+        int t;
+        for (t = 0; t < spec->time_chunk; t++) {
+            entry->ranges[t*2] = 0; entry->ranges[t*2+1] = spec->freq_chunk;
+        }
+        entry->complete = true;
+        writer->read_time += get_time_ns() - start;
+    }
+    return entry;
+}
+
+// Layout of messages to I/O aggregators (see AGGREGATOR_TAG). The
+// header and ranges get padded so visibilities stay aligned.
+static size_t aggregator_vis_offset(const struct vis_spec *spec)
+{
+    const size_t header_size = sizeof(int) * (4 + 2 * spec->time_chunk);
+    return (header_size + sizeof(double complex) - 1)
+        / sizeof(double complex) * sizeof(double complex);
+}
+static size_t aggregator_message_size(const struct vis_spec *spec)
+{
+    return aggregator_vis_offset(spec) +
+        sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
+}
+
+// Forward chunks to I/O aggregators as they arrive in the writer's
+// queue, until we get the signal to stop. Only the valid range of
+// every time step gets sent.
+static void *streamer_writer_forward(struct streamer_writer *writer)
+{
+    struct work_config *wcfg = writer->work_cfg;
+    struct vis_spec *const spec = &wcfg->spec;
+    const size_t vis_offset = aggregator_vis_offset(spec);
+    char *msg = (char *)malloc(aggregator_message_size(spec));
+    if (!msg) {
+        fprintf(stderr, "ERROR: Could not allocate aggregator message buffer!\n");
+        exit(1);
+    }
+    int *header = (int *)msg;
+    double complex *vis = (double complex *)(msg + vis_offset);
+
+    for(;;) {
+
+        // Wait for visibilities to forward
+        double start = get_time_ns();
+        struct streamer_chunk *chunk = writer_pop_slot(writer);
+        writer->wait_out_time += get_time_ns() - start;
+
+        start = get_time_ns();
+        if (chunk->tchunk == -1 && chunk->fchunk == -1)
+            break; // Signal to end thread
+        writer->received_chunks++;
+        if (chunk->tchunk == -2 && chunk->fchunk == -2) {
+            writer_pop_done(writer, chunk);
+            continue; // Signal to ignore chunk
+        }
+
+        // Pack message, then release the slot straight away
+        header[0] = chunk->bl_data->antenna1; header[1] = chunk->bl_data->antenna2;
+        header[2] = chunk->tchunk; header[3] = chunk->fchunk;
+        memcpy(header + 4, chunk->ranges, sizeof(int) * 2 * spec->time_chunk);
+        int t, count = 0;
+        for (t = 0; t < spec->time_chunk; t++) {
+            const int i0 = chunk->ranges[t*2], i1 = chunk->ranges[t*2+1];
+            if (i1 > i0) {
+                memcpy(vis + count, chunk->vis + t * spec->freq_chunk + i0,
+                       sizeof(double complex) * (i1 - i0));
+                count += i1 - i0;
+            }
+        }
+        writer_pop_done(writer, chunk);
+        writer->read_time += get_time_ns() - start;
+
+        // Send to the aggregator responsible for the baseline
+        start = get_time_ns();
+        const size_t size = vis_offset + sizeof(double complex) * count;
+        const int aggregator = config_baseline_aggregator(wcfg, header[0], header[1]);
+        MPI_Send(msg, size, MPI_BYTE, config_aggregator_rank(wcfg, aggregator),
+                 AGGREGATOR_TAG, MPI_COMM_WORLD);
+        writer->written_vis_data += size;
+        writer->write_time += get_time_ns() - start;
+    }
+
+    free(msg);
+    return NULL;
+}
+
+// Number of valid visibilities in a chunk (see streamer_chunk)
+static int streamer_chunk_valid(const struct vis_spec *spec, const struct streamer_chunk *chunk)
+{
+    int t, count = 0;
+    for (t = 0; t < spec->time_chunk; t++)
+        if (chunk->ranges[t*2+1] > chunk->ranges[t*2])
+            count += chunk->ranges[t*2+1] - chunk->ranges[t*2];
+    return count;
+}
+
+// Create structure for baselines in a new HDF5 visibility file
+static bool streamer_create_bls(hid_t group, struct work_config *wcfg, int worker, int aggregator)
+{
+    if (wcfg->vis_layout == VIS_LAYOUT_SINGLE)
+        return create_bl_table(group, wcfg, worker, aggregator);
+    return create_bl_groups(group, wcfg, worker, aggregator);
+}
+
+// Open the visibility file shared by all writing processes using
+// MPI-IO. Baseline groups get created collectively, for all baselines.
+static void streamer_writer_open_shared(struct streamer_writer *writer, const char *filename)
+{
+#ifdef H5_HAVE_PARALLEL
+    struct work_config *wcfg = writer->work_cfg;
+    const size_t align = (size_t)wcfg->vis_hdf5_align * 1024;
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_mpio(fapl, writer->comm, MPI_INFO_NULL);
+    vis_file_access_props(fapl, wcfg->vis_hdf5_profile, align, false);
+    if (wcfg->vis_check_existing) {
+        printf("\nOpening %s (shared)... ", filename);
+        writer->file = H5Fopen(filename, H5F_ACC_RDONLY, fapl);
+        if (writer->file >= 0)
+            writer->group = H5Gopen(writer->file, "vis", H5P_DEFAULT);
+    } else {
+        printf("\nCreating %s (shared)... ", filename);
+        hid_t fcpl = vis_file_create_props(wcfg->vis_hdf5_profile, align, false);
+        writer->file = H5Fcreate(filename, H5F_ACC_TRUNC, fcpl, fapl);
+        H5Pclose(fcpl);
+        if (writer->file >= 0)
+            writer->group = H5Gcreate(writer->file, "vis", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if (writer->file >= 0 && writer->group >= 0)
+            streamer_create_bls(writer->group, wcfg, -1, -1);
+    }
+    H5Pclose(fapl);
+
+    // Transfer mode for visibility writes
+    writer->dxpl = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(writer->dxpl, wcfg->vis_shared_file == VIS_SHARED_COLLECTIVE ?
+                     H5FD_MPIO_COLLECTIVE : H5FD_MPIO_INDEPENDENT);
+#else
+    fprintf(stderr, "ERROR: Shared visibility files need parallel HDF5!\n");
+#endif
+}
+
+// Close visibility file
+static void streamer_writer_close(struct streamer_writer *writer)
+{
+    if (writer->work_cfg->vis_backend == VIS_BACKEND_RAW) {
+        raw_close(&writer->raw);
+    } else {
+        vis_ds_cache_free(&writer->ds_cache);
+        if (writer->dxpl != H5P_DEFAULT)
+            H5Pclose(writer->dxpl);
+        H5Gclose(writer->group); H5Fclose(writer->file);
+    }
+}
+
+static void *streamer_writer_loop(struct streamer_writer *writer);
+static void *streamer_writer_collective(struct streamer_writer *writer);
+
 void *streamer_writer_thread(void *param)
 {
     struct streamer_writer *writer = (struct streamer_writer *) param;
     struct work_config *wcfg = writer->work_cfg;
-
     struct vis_spec *const spec = &writer->work_cfg->spec;
-    const int vis_data_size = sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
-    double complex *vis_data_h5 = (double complex *) alloca(vis_data_size);
 
-    // Create HDF5 output file if we are meant to output any amount of
+    // Create output file if we are meant to output any amount of
     // visibilities
     if (!wcfg->vis_path)
         return NULL;
 
+    // With I/O aggregators, streamers do not write files themselves
+    if (wcfg->aggregator_workers > 0 && writer->aggregator < 0)
+        return streamer_writer_forward(writer);
+
     // Get filename to use
     char filename[512];
-    sprintf(filename, wcfg->vis_path, writer->index);
+    const bool shared = wcfg->vis_shared_file != VIS_SHARED_OFF;
+    sprintf(filename, wcfg->vis_path, shared ? 0 : writer->index);
+
+    // The raw backend writes and reads visibilities using its own
+    // (O_DIRECT) file descriptor
+    writer->ds_cache.size = 0;
+    writer->ds_cache.single = false;
+    if (wcfg->vis_backend == VIS_BACKEND_RAW) {
+        bool success;
+        if (wcfg->vis_check_existing) {
+            printf("\nOpening %s... ", filename);
+            success = raw_open(&writer->raw, filename, wcfg, true);
+        } else {
+            printf("\nCreating %s... ", filename);
+            success = raw_create(&writer->raw, filename, wcfg, writer->subgrid_worker,
+                                 writer->aggregator, true);
+        }
+        if (!success) {
+            fprintf(stderr, "Could not open visibility file %s!\n", filename);
+            return NULL;
+        }
+        writer->uring_depth = 0;
+        if (wcfg->vis_writer_uring_depth > 0 && !wcfg->vis_check_existing) {
+            if (raw_async_init(&writer->raw, wcfg->vis_writer_uring_depth))
+                writer->uring_depth = wcfg->vis_writer_uring_depth;
+            else
+                fprintf(stderr, "ERROR: Could not set up asynchronous writes, writing synchronously!\n");
+        }
+        return streamer_writer_loop(writer);
+    }
 
     // For some reason we need to protect creating the file with a
     // critical section, otherwise libhdf5 messes up. Note that
     // creating groups (below) is apparently fine to do in parallel.
+    const size_t align = (size_t)wcfg->vis_hdf5_align * 1024;
 #pragma omp critical
     {
-        // Open file and "vis" group
-        if (wcfg->vis_check_existing) {
+        // Open file and "vis" group. Page buffering only works for
+        // files created with paged file space management.
+        if (shared) {
+            streamer_writer_open_shared(writer, filename);
+        } else if (wcfg->vis_check_existing) {
             printf("\nOpening %s... ", filename);
-            writer->file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+            hid_t fapl = vis_file_access_props(H5Pcreate(H5P_FILE_ACCESS),
+                                               wcfg->vis_hdf5_profile, align, false);
+            writer->file = H5Fopen(filename, H5F_ACC_RDONLY, fapl);
+            H5Pclose(fapl);
             writer->group = H5Gopen(writer->file, "vis", H5P_DEFAULT);
         } else {
             printf("\nCreating %s... ", filename);
-            writer->file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+            hid_t fcpl = vis_file_create_props(wcfg->vis_hdf5_profile, align, true);
+            hid_t fapl = vis_file_access_props(H5Pcreate(H5P_FILE_ACCESS),
+                                               wcfg->vis_hdf5_profile, align, true);
+            writer->file = H5Fcreate(filename, H5F_ACC_TRUNC, fcpl, fapl);
+            H5Pclose(fcpl); H5Pclose(fapl);
             if (writer->file >= 0)
                 writer->group = H5Gcreate(writer->file, "vis", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
             // Create baseline groups
             if (writer->file >= 0 && writer->group >= 0)
-                create_bl_groups(writer->group, wcfg, writer->subgrid_worker);
+                streamer_create_bls(writer->group, wcfg, writer->subgrid_worker, writer->aggregator);
         }
     }
 
@@ -283,22 +822,62 @@ void *streamer_writer_thread(void *param)
         return NULL;
     }
 
-    int time_chunk_count = spec->time_count / spec->time_chunk;
-    int freq_chunk_count = spec->freq_count / spec->freq_chunk;
-    int chunk_count = spec->cfg->ant_count * spec->cfg->ant_count
-        * time_chunk_count * freq_chunk_count;
-    bool *chunks_written = calloc(sizeof(bool), chunk_count);
+    // Keep visibility datasets open between chunks. The single
+    // dataset gets written at many places at once, so give it room for
+    // more chunks in its cache.
+    const size_t chunk_bytes = sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
+    hid_t dapl = vis_dataset_access_props(wcfg->vis_hdf5_profile, chunk_bytes,
+                                          wcfg->vis_layout == VIS_LAYOUT_SINGLE ? 64 : 1);
+    if (!vis_ds_cache_init(&writer->ds_cache, wcfg->vis_writer_ds_cache,
+                           wcfg->vis_writer_direct_chunks,
+                           spec->time_chunk, spec->freq_chunk, dapl)) {
+        fprintf(stderr, "ERROR: Could not allocate dataset cache, opening datasets per chunk!\n");
+    }
+    if (wcfg->vis_layout == VIS_LAYOUT_SINGLE &&
+        !vis_ds_cache_open_table(&writer->ds_cache, writer->group, spec->cfg->ant_count)) {
+        fprintf(stderr, "Could not open visibility dataset in %s!\n", filename);
+        H5Gclose(writer->group); H5Fclose(writer->file);
+        return NULL;
+    }
+
+    if (wcfg->vis_shared_file == VIS_SHARED_COLLECTIVE && !wcfg->vis_check_existing)
+        return streamer_writer_collective(writer);
+    return streamer_writer_loop(writer);
+}
+
+// Write out chunks as they arrive in the writer's queue, until we get
+// the signal to stop. File must be open already.
+static void *streamer_writer_loop(struct streamer_writer *writer)
+{
+    struct work_config *wcfg = writer->work_cfg;
+    struct vis_spec *const spec = &writer->work_cfg->spec;
+    const int vis_data_size = sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
+
+    // Buffers for merging and reading back chunks. Aligned, so the raw
+    // backend can use them for O_DIRECT.
+    double complex *vis_data_h5 = NULL;
+    if (posix_memalign((void **)&vis_data_h5, RAW_ALIGN, vis_data_size)) {
+        fprintf(stderr, "ERROR: Could not allocate writer buffers!\n");
+        exit(1);
+    }
+
+    bool *chunks_written = calloc(sizeof(bool), streamer_chunk_count(spec));
+
+    // Set up write-back cache, if requested
+    struct writer_cache cache = { .size = 0 };
+    if (wcfg->vis_writer_cache > 0 && !wcfg->vis_check_existing &&
+        !writer_cache_init(&cache, (size_t)wcfg->vis_writer_cache * 1000000,
+                           spec->time_chunk, spec->freq_chunk)) {
+        fprintf(stderr, "ERROR: Could not allocate write-back cache, writing chunks directly!\n");
+        writer_cache_free(&cache);
+        cache.size = 0;
+    }
 
     for(;;) {
 
-        // Obtain "out" lock for writing out visibilities
+        // Wait for visibilities to write out
         double start = get_time_ns();
-        struct streamer_chunk *chunk = writer->queue + writer->out_ptr;
-#ifndef __APPLE__
-        sem_wait(&chunk->out_lock);
-#else
-        dispatch_semaphore_wait(chunk->out_lock, DISPATCH_TIME_FOREVER);
-#endif
+        struct streamer_chunk *chunk = writer_pop_slot(writer);
         writer->wait_out_time += get_time_ns() - start;
 
         start = get_time_ns();
@@ -306,93 +885,190 @@ void *streamer_writer_thread(void *param)
         // Obtain baseline data
         if (chunk->tchunk == -1 && chunk->fchunk == -1)
             break; // Signal to end thread
+        writer->received_chunks++;
         if (chunk->tchunk == -2 && chunk->fchunk == -2) {
-            #pragma omp atomic
-                writer->to_write -= 1;
-#ifndef __APPLE__
-            sem_post(&chunk->in_lock);
-#else
-            dispatch_semaphore_signal(chunk->in_lock);
-#endif
-            writer->out_ptr = (writer->out_ptr + 1) % writer->queue_length;
+            writer_pop_done(writer, chunk);
             continue; // Signal to ignore chunk
         }
-        const int nant =  wcfg->spec.cfg->ant_count;
         struct bl_data *bl_data = chunk->bl_data;
         double complex *vis_data = chunk->vis;
+        int chunk_index = streamer_chunk_index(spec, bl_data, chunk->tchunk, chunk->fchunk);
 
-        // Read visibility chunk. If it was not yet set, this will
-        // just fill the buffer with zeroes.
-        int chunk_index = ((bl_data->antenna2 * nant + bl_data->antenna1)
-                           * time_chunk_count + chunk->tchunk) * freq_chunk_count + chunk->fchunk;
-        if (wcfg->vis_check_existing || chunks_written[chunk_index]) {
-            read_vis_chunk(writer->group, bl_data,
-                           spec->time_chunk, spec->freq_chunk,
-                           chunk->tchunk, chunk->fchunk,
-                           vis_data_h5);
-        } else {
-            memset(vis_data_h5, 0, vis_data_size);
-        }
-        writer->read_time += get_time_ns() - start;
-        start = get_time_ns();
-
+        // Only the degridded range of every time step carries data
+        // (see degrid_conv_uv_line)
         if (wcfg->vis_check_existing) {
 
-            // Compare data
-            int i;
-            for (i = 0; i < spec->time_chunk * spec->freq_chunk; i++) {
-                if (vis_data[i] != 0) {
-                    if (cabs(vis_data_h5[i] - vis_data[i]) > 1e-12) {
+            // Read visibility chunk and compare data
+            writer_read_vis_chunk(writer, bl_data, chunk->tchunk, chunk->fchunk, vis_data_h5);
+            writer->read_time += get_time_ns() - start;
+            int t, i;
+            for (t = 0; t < spec->time_chunk; t++) {
+                for (i = chunk->ranges[t*2]; i < chunk->ranges[t*2+1]; i++) {
+                    const int ix = t * spec->freq_chunk + i;
+                    if (cabs(vis_data_h5[ix] - vis_data[ix]) > 1e-12) {
                         printf("%g%+gj != %g%+gj (diff %g)!\n",
-                               creal(vis_data_h5[i]), cimag(vis_data_h5[i]),
-                               creal(vis_data[i]), cimag(vis_data[i]),
-                               cabs(vis_data_h5[i] - vis_data[i]));
+                               creal(vis_data_h5[ix]), cimag(vis_data_h5[ix]),
+                               creal(vis_data[ix]), cimag(vis_data[ix]),
+                               cabs(vis_data_h5[ix] - vis_data[ix]));
                     }
                 }
             }
             writer->rewritten_vis_data += vis_data_size;
 
+        } else if (wcfg->vis_shared_file != VIS_SHARED_OFF) {
+
+            // Shared file: write the valid part straight away. Writers
+            // contribute disjoint parts of chunks, so there is nothing
+            // to merge.
+            if (!write_vis_chunk_ranges(writer->group, &writer->ds_cache, bl_data,
+                                        spec->time_chunk, spec->freq_chunk,
+                                        chunk->tchunk, chunk->fchunk,
+                                        chunk->ranges, writer->dxpl, vis_data))
+                fprintf(stderr, "ERROR: Could not write visibility chunk %d/%d %d/%d!\n",
+                        bl_data->antenna1, bl_data->antenna2, chunk->tchunk, chunk->fchunk);
+            writer->written_vis_data += sizeof(double complex) * streamer_chunk_valid(spec, chunk);
+            writer->write_time += get_time_ns() - start;
+
         } else {
 
-            // Copy over data
-            start = get_time_ns();
-            int i;
-            for (i = 0; i < spec->time_chunk * spec->freq_chunk; i++) {
-                if (vis_data[i] != 0) {
-                    // Make sure we never over-write data!
-                    assert(vis_data_h5[i] == 0);
-                    vis_data_h5[i] = vis_data[i];
+            // Without cache, write the chunk's valid ranges straight
+            // away. Otherwise collect them in a cache entry.
+            if (cache.size == 0) {
+                writer->write_time += get_time_ns() - start;
+                writer_write_chunk(writer, chunks_written, chunk_index, bl_data,
+                                   chunk->tchunk, chunk->fchunk, vis_data, chunk->ranges,
+                                   vis_data_h5);
+            } else {
+                struct writer_cache_entry *entry = writer_cache_get(&cache, chunk_index);
+                if (entry) {
+                    writer->cached_chunks++;
+                } else {
+                    // Make room by flushing oldest entry
+                    if (cache.used >= cache.size) {
+                        writer_cache_flush(writer, &cache, cache.entries + cache.oldest,
+                                           chunks_written, vis_data_h5);
+                        writer->evicted_chunks++;
+                    }
+                    entry = writer_cache_start(writer, &cache, chunk_index, bl_data,
+                                               chunk->tchunk, chunk->fchunk, chunks_written);
                 }
+
+                // Copy over data
+                writer_cache_add(entry, chunk->ranges, vis_data,
+                                 spec->time_chunk, spec->freq_chunk);
+                writer->write_time += get_time_ns() - start;
+
+                // Write chunk, unless we expect more contributions
+                if (--writer->chunk_contribs[chunk_index] <= 0)
+                    writer_cache_flush(writer, &cache, entry, chunks_written, vis_data_h5);
             }
 
-            // Write chunk back
-            write_vis_chunk(writer->group, bl_data,
-                            spec->time_chunk, spec->freq_chunk,
-                            chunk->tchunk, chunk->fchunk,
-                            vis_data_h5);
+        }
+
+        // Mark the slot free for writing
+        writer_pop_done(writer, chunk);
+
+    }
+
+    // Flush whatever is left in the cache. This should only happen
+    // if the plan was off.
+    while (cache.size > 0 && cache.oldest >= 0) {
+        writer_cache_flush(writer, &cache, cache.entries + cache.oldest,
+                           chunks_written, vis_data_h5);
+        writer->evicted_chunks++;
+    }
+    if (cache.size > 0)
+        writer_cache_free(&cache);
+    if (writer->uring_depth > 0) {
+        double start = get_time_ns();
+        raw_async_flush(&writer->raw);
+        writer->write_time += get_time_ns() - start;
+    }
+    free(chunks_written);
+    free(vis_data_h5);
+    streamer_writer_close(writer);
+    return NULL;
+}
 
-            writer->written_vis_data += vis_data_size;
-            if (chunks_written[chunk_index])
-                writer->rewritten_vis_data += vis_data_size;
-            chunks_written[chunk_index] = true;
+// Write chunks to the shared file collectively with the writers of
+// all other processes. Writers go in lock-step rounds: Everybody
+// contributes the next chunk from its queue (if any), then takes part
+// in one collective write per baseline involved. This continues until
+// all writers have got the signal to stop.
+static void *streamer_writer_collective(struct streamer_writer *writer)
+{
+#ifdef H5_HAVE_PARALLEL
+    struct work_config *wcfg = writer->work_cfg;
+    struct vis_spec *const spec = &wcfg->spec;
+    const int nant = spec->cfg->ant_count;
+    const bool single = wcfg->vis_layout == VIS_LAYOUT_SINGLE;
+    int comm_size, r, i;
+    MPI_Comm_size(writer->comm, &comm_size);
+    int *bls = (int *)malloc(sizeof(int) * comm_size);
+    bool done = false;
 
+    for(;;) {
+
+        // Check for a chunk to write. We must not block here, as
+        // other writers might be waiting for this round to finish.
+        double start = get_time_ns();
+        struct streamer_chunk *chunk = (done ? NULL : writer_try_pop_slot(writer));
+        if (chunk && chunk->tchunk == -1 && chunk->fchunk == -1) {
+            done = true; // Signal to end thread
+            chunk = NULL;
+        } else if (chunk) {
+            writer->received_chunks++;
+            if (chunk->tchunk == -2 && chunk->fchunk == -2) {
+                writer_pop_done(writer, chunk);
+                chunk = NULL; // Signal to ignore chunk
+            }
         }
 
-        // Release "in" lock to mark the slot free for writing
-        #pragma omp atomic
-            writer->to_write -= 1;
-#ifndef __APPLE__
-        sem_post(&chunk->in_lock);
-#else
-        dispatch_semaphore_signal(chunk->in_lock);
-#endif
-        writer->out_ptr = (writer->out_ptr + 1) % writer->queue_length;
+        // Exchange baselines (-1: nothing to write, -2: done)
+        int bl = (chunk ? chunk->bl_data->antenna1 + nant * chunk->bl_data->antenna2 :
+                  done ? -2 : -1);
+        MPI_Allgather(&bl, 1, MPI_INT, bls, 1, MPI_INT, writer->comm);
+        writer->wait_out_time += get_time_ns() - start;
+
+        // Write every baseline once, with everybody participating.
+        // With a single dataset, one write covers all chunks.
+        start = get_time_ns();
+        bool all_done = true, any = false;
+        for (r = 0; r < comm_size; r++) {
+            if (bls[r] != -2) all_done = false;
+            if (bls[r] < 0) continue;
+            for (i = 0; i < r; i++)
+                if (bls[i] >= 0 && (single || bls[i] == bls[r])) break;
+            if (i < r) continue;
+            any = true;
+            const bool mine = chunk && (single || bls[r] == bl);
+            if (!write_vis_chunk_ranges(writer->group, &writer->ds_cache,
+                                        mine ? chunk->bl_data : wcfg->bl_data + bls[r],
+                                        spec->time_chunk, spec->freq_chunk,
+                                        mine ? chunk->tchunk : 0, mine ? chunk->fchunk : 0,
+                                        mine ? chunk->ranges : NULL, writer->dxpl,
+                                        mine ? chunk->vis : NULL))
+                fprintf(stderr, "ERROR: Could not write visibility chunk collectively!\n");
+        }
+        if (chunk) {
+            writer->written_vis_data += sizeof(double complex) * streamer_chunk_valid(spec, chunk);
+            writer_pop_done(writer, chunk);
+        }
         writer->write_time += get_time_ns() - start;
+        if (all_done)
+            break;
 
+        // Nobody had anything to write? Back off a bit.
+        if (!any) {
+            start = get_time_ns();
+            usleep(100);
+            writer->wait_out_time += get_time_ns() - start;
+        }
     }
 
-    H5Gclose(writer->group); H5Fclose(writer->file);
-
+    free(bls);
+#endif
+    streamer_writer_close(writer);
     return NULL;
 }
 
@@ -461,11 +1137,14 @@ void *streamer_publish_stats(void *par)
             _append_writer_stat(PARS(wait_out_time), 100 / sample_rate);
             _append_writer_stat(PARS(read_time), 100 / sample_rate);
             _append_writer_stat(PARS(write_time), 100 / sample_rate);
+            _append_writer_stat(PARS(received_chunks), 1 / sample_rate);
             _append_writer_stat(PARS(written_vis_data), 1 / sample_rate);
             _append_writer_stat(PARS(rewritten_vis_data), 1 / sample_rate);
+            _append_writer_stat(PARS(ds_cache.hits), 1 / sample_rate);
+            _append_writer_stat(PARS(ds_cache.misses), 1 / sample_rate);
 #undef PARS
             _append_writer_stat(stats, "chunks_to_write", streamer->subgrid_worker,
-                                now.writer[i].index, now.writer[i].to_write, 1);
+                                now.writer[i].index, writer_to_write(now.writer + i), 1);
         }
 
         // Receiver idle time
@@ -524,6 +1203,187 @@ void *streamer_publish_stats(void *par)
     return NULL;
 }
 
+// Make Fresnel screen for moving a subgrid image by dw in w. Subgrid
+// images are in FFT order, therefore l and m wrap around.
+static double complex *streamer_fresnel_screen(struct streamer *streamer, double dw)
+{
+    struct work_config *wcfg = streamer->work_cfg;
+    const int xM_size = wcfg->recombine.xM_size;
+    double complex *screen = (double complex *)
+        malloc(sizeof(double complex) * xM_size * xM_size);
+    if (!screen)
+        return NULL;
+    int y0, y1;
+    for (y0 = 0; y0 < xM_size; y0++) {
+        double m = (y0 < xM_size / 2 ? y0 : y0 - xM_size) * wcfg->theta / xM_size;
+        for (y1 = 0; y1 < xM_size; y1++) {
+            double l = (y1 < xM_size / 2 ? y1 : y1 - xM_size) * wcfg->theta / xM_size;
+            double n = (l*l + m*m < 1 ? sqrt(1 - l*l - m*m) - 1 : -1);
+            screen[y0 * xM_size + y1] = cexp(2 * M_PI * I * dw * n);
+        }
+    }
+    return screen;
+}
+
+// Determine w-planes to generate for every subgrid, and the Fresnel
+// screens to get from one to the next.
+static bool streamer_init_wplanes(struct streamer *streamer)
+{
+    struct work_config *wcfg = streamer->work_cfg;
+    const int w_size = streamer->w_kern->size;
+
+    // Visibilities are within half a subgrid w-step of the middle
+    // plane, the w-kernel reaches up to w_size/2 planes further.
+    int iw, iwf;
+    streamer->wplane_count = 2 * ((wcfg->sg_step_w + w_size + 1) / 2) + 4;
+    frac_coord(streamer->wplane_count, streamer->w_kern->oversampling,
+               -wcfg->sg_step_w / 2., &iw, &iwf);
+    streamer->wplane_min = iw - w_size / 2;
+    frac_coord(streamer->wplane_count, streamer->w_kern->oversampling,
+               wcfg->sg_step_w / 2., &iw, &iwf);
+    streamer->wplane_max = iw - w_size / 2 + w_size - 1;
+    assert(streamer->wplane_min >= 0 && streamer->wplane_max < streamer->wplane_count);
+
+    // Fresnel screens for the first plane and the step between planes
+    streamer->wplane_start = streamer_fresnel_screen(
+        streamer, wcfg->wstep * (streamer->wplane_min - streamer->wplane_count / 2));
+    streamer->wplane_step = streamer_fresnel_screen(streamer, wcfg->wstep);
+    return streamer->wplane_start && streamer->wplane_step;
+}
+
+// Set up visibility queue and writers. With I/O aggregators, writers
+// on streamers forward chunks to aggregators instead of writing them
+// (see streamer_writer_forward), and aggregators use writers to write
+// the chunks they receive (see aggregator).
+static bool streamer_init_writers(struct streamer *streamer)
+{
+    struct work_config *const wcfg = streamer->work_cfg;
+    struct vis_spec *const spec = &wcfg->spec;
+    const bool forward = wcfg->aggregator_workers > 0 && streamer->aggregator < 0;
+    const bool shared = wcfg->vis_shared_file != VIS_SHARED_OFF && !forward;
+    streamer->fork_writers = wcfg->vis_fork_writer && !forward && !shared;
+
+    // Calculate size of queues
+    streamer->vis_queue_length = wcfg->vis_chunk_queue_length;
+    streamer->writer_count = (wcfg->vis_path ? wcfg->vis_writer_count : 0);
+    hbool_t hdf5_threadsafe;
+    H5is_library_threadsafe(&hdf5_threadsafe);
+    if (!streamer->fork_writers && !forward && wcfg->vis_backend == VIS_BACKEND_HDF5 &&
+        streamer->writer_count > 1 && !hdf5_threadsafe) {
+        fprintf(stderr, "WARNING: libhdf5 is not thread safe, using only one writer thread!\n");
+        streamer->writer_count = 1;
+    }
+    if (streamer->writer_count > 0) {
+        streamer->vis_queue_per_writer = streamer->vis_queue_length / streamer->writer_count;
+    } else {
+        streamer->vis_queue_per_writer = 0;
+    }
+    const int vis_data_size = sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
+    const int vis_range_size = sizeof(int) * 2 * spec->time_chunk;
+
+    // Allocate visibility queue
+    streamer->vis_queue_size = (size_t)streamer->vis_queue_length * vis_data_size;
+    streamer->vis_range_queue_size = (size_t)streamer->vis_queue_length * vis_range_size;
+    streamer->vis_chunks_size = (size_t)streamer->vis_queue_length * sizeof(struct streamer_chunk);
+    if (streamer->fork_writers) {
+        streamer->vis_queue = mmap(NULL, streamer->vis_queue_size,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        streamer->vis_range_queue = mmap(NULL, streamer->vis_range_queue_size,
+                                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        streamer->vis_chunks = mmap(NULL, streamer->vis_chunks_size,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        streamer->vis_queue = malloc((size_t)streamer->vis_queue_length * vis_data_size);
+        streamer->vis_range_queue = malloc(streamer->vis_range_queue_size);
+        streamer->vis_chunks = malloc((size_t)streamer->vis_queue_length * sizeof(struct streamer_chunk));
+    }
+    if (!streamer->vis_queue || !streamer->vis_range_queue || !streamer->vis_chunks) {
+
+        fprintf(stderr, "ERROR: Could not allocate visibility queue!\n");
+        return false;
+    }
+
+    // Count planned contributions per chunk for write-back caches
+    streamer->chunk_contribs = NULL;
+    if (streamer->writer_count > 0 && wcfg->vis_writer_cache > 0 && !forward) {
+        streamer->chunk_contribs = streamer_count_chunk_contributions(streamer);
+        if (!streamer->chunk_contribs) {
+            fprintf(stderr, "ERROR: Could not allocate chunk contribution counts!\n");
+            return false;
+        }
+    }
+
+    // Writers sharing a file: Either all streamers or all aggregators
+    streamer->vis_comm = MPI_COMM_NULL;
+#ifdef H5_HAVE_PARALLEL
+    if (shared && streamer->writer_count > 0) {
+        const int first = (streamer->aggregator >= 0 ? config_aggregator_rank(wcfg, 0) : 0);
+        const int count = (streamer->aggregator >= 0 ? wcfg->aggregator_workers : wcfg->subgrid_workers);
+        int range[1][3] = { { first, first + count - 1, 1 } };
+        MPI_Group world_group, group;
+        MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+        MPI_Group_range_incl(world_group, 1, range, &group);
+        MPI_Comm_create_group(MPI_COMM_WORLD, group, 0, &streamer->vis_comm);
+        MPI_Group_free(&group); MPI_Group_free(&world_group);
+    }
+#endif
+
+    // Initialise writer thread data
+    streamer->writer = NULL;
+    streamer->writer_size = streamer->writer_count * sizeof(struct streamer_writer);
+    if (streamer->writer_count > 0) {
+        if (streamer->fork_writers) {
+            printf("Using %d writer processes\n", streamer->writer_count);
+            streamer->writer = mmap(NULL, streamer->writer_size,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        } else {
+            printf("Using %d writer threads%s\n", streamer->writer_count,
+                   forward ? " (forwarding to aggregators)" : "");
+            streamer->writer = calloc(1, streamer->writer_size);
+        }
+        int i;
+        for (i = 0; i < streamer->writer_count; i++) {
+            struct streamer_writer *writer = streamer->writer + i;
+            writer->subgrid_worker = streamer->subgrid_worker;
+            writer->aggregator = streamer->aggregator;
+            writer->index = (streamer->aggregator >= 0 ? streamer->aggregator : streamer->subgrid_worker)
+                * streamer->writer_count + i;
+            writer->work_cfg = wcfg;
+            writer->file = writer->group = -1;
+            writer->raw.uring = NULL;
+            writer->uring_depth = 0;
+            writer->comm = streamer->vis_comm;
+            writer->dxpl = H5P_DEFAULT;
+            writer->queue_length = streamer->vis_queue_per_writer;
+            writer->chunk_contribs = streamer->chunk_contribs;
+            writer->in_ticket = writer->out_ticket = 0;
+            writer->queue = streamer->vis_chunks + i * streamer->vis_queue_per_writer;
+            int j;
+            for (j = 0; j < streamer->vis_queue_per_writer; j++) {
+                writer->queue[j].seq = j; // free for ticket j
+                writer->queue[j].waiters = 0;
+                writer->queue[j].vis = streamer->vis_queue +
+                    spec->time_chunk * spec->freq_chunk * (i * streamer->vis_queue_per_writer + j);
+                writer->queue[j].ranges = streamer->vis_range_queue +
+                    2 * spec->time_chunk * (i * streamer->vis_queue_per_writer + j);
+            }
+
+            // Now either fork the writer or start a thread
+            if (streamer->fork_writers) {
+                writer->pid = fork();
+                if (!writer->pid) {
+                    streamer_writer_thread(writer);
+                    exit(0);
+                }
+            } else {
+                pthread_create(&writer->thread, NULL, streamer_writer_thread, writer);
+            }
+        }
+    }
+
+    return true;
+}
+
 bool streamer_init(struct streamer *streamer,
                    struct work_config *wcfg, int subgrid_worker, int *producer_ranks)
 {
@@ -533,6 +1393,7 @@ bool streamer_init(struct streamer *streamer,
 
     streamer->work_cfg = wcfg;
     streamer->subgrid_worker = subgrid_worker;
+    streamer->aggregator = -1;
     streamer->producer_ranks = producer_ranks;
 
     streamer->num_workers = omp_get_max_threads();
@@ -548,6 +1409,7 @@ bool streamer_init(struct streamer *streamer,
     streamer->grid_worst_error = 0;
     streamer->degrid_flops = 0;
     streamer->produced_chunks = 0;
+    streamer->rerouted_chunks = 0;
     streamer->task_yields = 0;
     streamer->subgrid_tasks = 0;
     streamer->finished = false;
@@ -555,23 +1417,45 @@ bool streamer_init(struct streamer *streamer,
     // Load gridding kernel
     if (wcfg->gridder.data) {
         streamer->kern = &wcfg->gridder;
+        if (wcfg->vis_degrid_single && !sep_kern_make_float(streamer->kern)) {
+            fprintf(stderr, "ERROR: Could not allocate single precision gridding kernel!\n");
+            return false;
+        }
+        if (streamer->subgrid_worker == 0)
+            printf("Degridding kernel: size %d, %s, %s precision\n", streamer->kern->size,
+                   degrid_kernel_arch(streamer->kern),
+                   wcfg->vis_degrid_single ? "single" : "double");
+    }
+
+    // Set up w-planes, if we are degridding with a w-kernel
+    streamer->w_kern = NULL;
+    streamer->wplane_count = 1;
+    streamer->wplane_min = streamer->wplane_max = 0;
+    streamer->wplane_start = streamer->wplane_step = NULL;
+    streamer->wtower_step = NULL;
+    if (streamer->kern && wcfg->w_gridder.data) {
+        streamer->w_kern = &wcfg->w_gridder;
+        if (!streamer_init_wplanes(streamer)) {
+            fprintf(stderr, "ERROR: Could not allocate Fresnel screens!\n");
+            return false;
+        }
+        if (streamer->subgrid_worker == 0)
+            printf("w-kernel: size %d, %d w-planes per subgrid (step %d)\n",
+                   streamer->w_kern->size, subgrid_planes(streamer), wcfg->sg_step_w);
+    }
+
+    // Screen for stepping subgrids through w-levels of a w-tower
+    if (wcfg->vis_wtowers) {
+        streamer->wtower_step = streamer_fresnel_screen(streamer, wcfg->sg_step_w * wcfg->wstep);
+        if (!streamer->wtower_step) {
+            fprintf(stderr, "ERROR: Could not allocate Fresnel screens!\n");
+            return false;
+        }
     }
 
     // Calculate size of queues
     streamer->queue_length = wcfg->vis_subgrid_queue_length;
     streamer->vis_queue_length = wcfg->vis_chunk_queue_length;
-    streamer->writer_count = (wcfg->vis_path ? wcfg->vis_writer_count : 0);
-    hbool_t hdf5_threadsafe;
-    H5is_library_threadsafe(&hdf5_threadsafe);
-    if (!wcfg->vis_fork_writer && streamer->writer_count > 1 && !hdf5_threadsafe) {
-        fprintf(stderr, "WARNING: libhdf5 is not thread safe, using only one writer thread!\n");
-        streamer->writer_count = 1;
-    }
-    if (streamer->writer_count > 0) {
-        streamer->vis_queue_per_writer = streamer->vis_queue_length / streamer->writer_count;
-    } else {
-        streamer->vis_queue_per_writer = 0;
-    }
 
     const int nmbf_length = cfg->NMBF_NMBF_size / sizeof(double complex);
     const size_t queue_size = (size_t)sizeof(double complex) * nmbf_length * facets * streamer->queue_length;
@@ -579,9 +1463,11 @@ bool streamer_init(struct streamer *streamer,
     const size_t requests_size = (size_t)sizeof(MPI_Request) * facets * streamer->queue_length;
     struct vis_spec *const spec = &streamer->work_cfg->spec;
     const int vis_data_size = sizeof(double complex) * spec->time_chunk * spec->freq_chunk;
+    const int vis_range_size = sizeof(int) * 2 * spec->time_chunk;
     printf("Allocating %.3g GB subgrid queue, %.3g GB visibility queue\n",
            (double)(queue_size+sg_queue_size+requests_size) / 1e9,
-           (double)((size_t)streamer->vis_queue_length * (vis_data_size + 6 * sizeof(int))) / 1e9);
+           (double)((size_t)streamer->vis_queue_length *
+                    (vis_data_size + vis_range_size + 6 * sizeof(int))) / 1e9);
 
     // Allocate receive queue
     streamer->nmbf_queue = (double complex *)malloc(queue_size);
@@ -598,6 +1484,17 @@ bool streamer_init(struct streamer *streamer,
         return false;
     }
 
+    // Set up buffer pools. For single precision, w-plane images need
+    // a copy for the in-place transform (see streamer_prepare_subgrid).
+    const size_t image_size = cfg->SG_size * (wcfg->vis_degrid_single && streamer->w_kern ? 2 : 1);
+    if (!pool_init(&streamer->subgrid_pool, "subgrid",
+                   subgrid_plane_size(streamer) * subgrid_planes(streamer),
+                   wcfg->vis_pool_pages) ||
+        !pool_init(&streamer->image_pool, "image", image_size, wcfg->vis_pool_pages)) {
+        fprintf(stderr, "ERROR: Could not initialise buffer pools!\n");
+        return false;
+    }
+
     // Populate receive queue
     int iwork;
     for (iwork = 0; iwork < wcfg->subgrid_max_work && iwork < streamer->queue_length; iwork++) {
@@ -611,80 +1508,150 @@ bool streamer_init(struct streamer *streamer,
         streamer->request_work[iwork] = -1;
     }
 
-    // Plan FFTs
-    streamer->subgrid_plan = fftw_plan_dft_2d(cfg->xM_size, cfg->xM_size,
-                                              streamer->subgrid_queue,
-                                              streamer->subgrid_queue + cfg->SG_size,
-                                              FFTW_BACKWARD, FFTW_MEASURE);
-
-    // Allocate visibility queue
-    streamer->vis_queue_size = (size_t)streamer->vis_queue_length * vis_data_size;
-    streamer->vis_chunks_size = (size_t)streamer->vis_queue_length * sizeof(struct streamer_chunk);
-    if (wcfg->vis_fork_writer) {
-        streamer->vis_queue = mmap(NULL, streamer->vis_queue_size,
-                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-        streamer->vis_chunks = mmap(NULL, streamer->vis_chunks_size,
-                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    // Plan FFTs. Output goes straight into the padded subgrid layout
+    // used for degridding (see streamer_prepare_subgrid). For single
+    // precision we transform in-place and convert afterwards.
+    if (wcfg->vis_degrid_single) {
+        streamer->subgrid_plan = fft_plan_strided_2d(cfg->xM_size, cfg->xM_size,
+                                                     streamer->subgrid_queue,
+                                                     streamer->subgrid_queue,
+                                                     FFTW_BACKWARD, FFTW_MEASURE);
     } else {
-        streamer->vis_queue = malloc((size_t)streamer->vis_queue_length * vis_data_size);
-        streamer->vis_chunks = malloc((size_t)streamer->vis_queue_length * sizeof(struct streamer_chunk));
+        double complex *subgrid_out = (double complex *)
+            calloc(sizeof(double complex), (size_t)subgrid_stride(streamer) * cfg->xM_size);
+        if (!subgrid_out) {
+            fprintf(stderr, "ERROR: Could not allocate subgrid buffer!\n");
+            return false;
+        }
+        streamer->subgrid_plan = fft_plan_strided_2d(cfg->xM_size, subgrid_stride(streamer),
+                                                     streamer->subgrid_queue, subgrid_out,
+                                                     FFTW_BACKWARD, FFTW_MEASURE);
+        free(subgrid_out);
     }
-    if (!streamer->vis_queue || !streamer->vis_chunks) {
 
-        fprintf(stderr, "ERROR: Could not allocate visibility queue!\n");
+    // Set up writers
+    if (!streamer_init_writers(streamer))
         return false;
-    }
 
-    // Initialise writer thread data
-    streamer->writer = NULL;
-    streamer->writer_size = streamer->writer_count * sizeof(struct streamer_writer);
+    return true;
+}
+
+// Wait for writers to actually finish
+static void streamer_join_writers(struct streamer *streamer)
+{
+    int i;
     if (streamer->writer_count > 0) {
-        if (wcfg->vis_fork_writer) {
-            printf("Using %d writer processes\n", streamer->writer_count);
-            streamer->writer = mmap(NULL, streamer->writer_size,
-                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-        } else {
-            printf("Using %d writer threads\n", streamer->writer_count);
-            streamer->writer = calloc(1, streamer->writer_size);
-        }
-        int i;
+        printf("Finishing writes...\n");
         for (i = 0; i < streamer->writer_count; i++) {
             struct streamer_writer *writer = streamer->writer + i;
-            writer->subgrid_worker = subgrid_worker;
-            writer->index = subgrid_worker * streamer->writer_count + i;
-            writer->work_cfg = wcfg;
-            writer->file = writer->group = -1;
-            writer->queue_length = streamer->vis_queue_per_writer;
-            writer->in_ptr = writer->out_ptr =
-                writer->to_write = 0;
-            writer->queue = streamer->vis_chunks + i * streamer->vis_queue_per_writer;
-            int j;
-            for (j = 0; j < streamer->vis_queue_per_writer; j++) {
-#ifndef __APPLE__
-                sem_init(&writer->queue[j].in_lock, wcfg->vis_fork_writer, 1);
-                sem_init(&writer->queue[j].out_lock, wcfg->vis_fork_writer, 0);
-#else
-                writer->queue[j].in_lock = dispatch_semaphore_create(1);
-                writer->queue[j].out_lock = dispatch_semaphore_create(0);
-#endif
-                writer->queue[j].vis = streamer->vis_queue +
-                    spec->time_chunk * spec->freq_chunk * (i * streamer->vis_queue_per_writer + j);
-            }
-
-            // Now either fork the writer or start a thread
-            if (wcfg->vis_fork_writer) {
-                writer->pid = fork();
-                if (!writer->pid) {
-                    streamer_writer_thread(writer);
-                    exit(0);
-                }
+            if (streamer->fork_writers) {
+                waitpid(writer->pid, NULL, 0);
             } else {
-                pthread_create(&writer->thread, NULL, streamer_writer_thread, writer);
+                pthread_join(writer->thread, NULL);
             }
         }
     }
+}
 
-    return true;
+// Print writer statistics
+static void streamer_report_writers(struct streamer *streamer, double stream_time)
+{
+    // Balance of chunks between writers
+    int i;
+    uint64_t total_chunks = 0, max_chunks = 0;
+    for (i = 0; i < streamer->writer_count; i++) {
+        total_chunks += streamer->writer[i].received_chunks;
+        if (streamer->writer[i].received_chunks > max_chunks)
+            max_chunks = streamer->writer[i].received_chunks;
+    }
+    const double mean_chunks = (double)total_chunks / (streamer->writer_count ? streamer->writer_count : 1);
+    if (total_chunks > 0) {
+        static const char *routing_names[] = { "busy", "baseline", "chunk" };
+        printf("Writers: %"PRIu64" chunks, balance %.2f (max/mean), routing %s, "
+               "%"PRIu64" rerouted on back-pressure\n",
+               total_chunks, max_chunks / mean_chunks,
+               routing_names[streamer->work_cfg->vis_writer_routing],
+               streamer->rerouted_chunks);
+    }
+
+    const bool forward = streamer->work_cfg->aggregator_workers > 0 && streamer->aggregator < 0;
+    if (!forward && streamer->work_cfg->vis_backend == VIS_BACKEND_HDF5) {
+        static const char *profile_names[] = { "default", "pfs" };
+        static const char *layout_names[] = { "groups", "single" };
+        printf("Writers: HDF5 profile %s, alignment %d KB, layout %s\n",
+               profile_names[streamer->work_cfg->vis_hdf5_profile],
+               streamer->work_cfg->vis_hdf5_align,
+               layout_names[streamer->work_cfg->vis_layout]);
+    }
+    for (i = 0; i < streamer->writer_count; i++) {
+        struct streamer_writer *writer = streamer->writer + i;
+
+        if (forward) {
+            printf("Writer %d: forwarded %.2f GB to aggregators, rate %.2f GB/s\n",
+                   writer->index,
+                   (double)writer->written_vis_data / 1000000000,
+                   (double)writer->written_vis_data / 1000000000 / stream_time);
+            printf("Writer %d: Wait: %gs, Pack: %gs, Send: %gs, Idle: %gs\n", writer->index,
+                   writer->wait_out_time, writer->read_time, writer->write_time,
+                   stream_time - writer->wait_out_time - writer->read_time - writer->write_time);
+            continue;
+        }
+
+        // Print stats. The above join can hang a bit as data
+        // gets flushed, so re-determine stream time.
+        printf("Writer %d: %.2f GB (rewritten %.2f GB), rate %.2f GB/s (%.2f GB/s effective)\n",
+               writer->index,
+               (double)writer->written_vis_data / 1000000000,
+               (double)writer->rewritten_vis_data / 1000000000,
+               (double)writer->written_vis_data / 1000000000 / stream_time,
+               (double)(writer->written_vis_data - writer->rewritten_vis_data)
+               / 1000000000 / stream_time);
+        if (total_chunks > 0)
+            printf("Writer %d: %"PRIu64" chunks (%.1f%% of mean)\n", writer->index,
+                   writer->received_chunks, 100 * writer->received_chunks / mean_chunks);
+        printf("Writer %d: Wait: %gs, Read: %gs, Write: %gs, Idle: %gs\n", writer->index,
+               writer->wait_out_time, writer->read_time, writer->write_time,
+               stream_time - writer->wait_out_time - writer->read_time - writer->write_time);
+        const struct vis_spec *spec = &streamer->work_cfg->spec;
+        const uint64_t chunks_written = writer->written_vis_data /
+            (sizeof(double complex) * spec->time_chunk * spec->freq_chunk);
+        const bool raw = streamer->work_cfg->vis_backend == VIS_BACKEND_RAW;
+        static const char *shared_names[] = { "", "shared, independent", "shared, collective" };
+        if (chunks_written > 0)
+            printf("Writer %d: %.1f us read+write per chunk (%s chunk I/O)\n", writer->index,
+                   (writer->read_time + writer->write_time) * 1e6 / chunks_written,
+                   raw ? (writer->uring_depth > 0 ? "raw, io_uring" : "raw") :
+                   streamer->work_cfg->vis_shared_file ? shared_names[streamer->work_cfg->vis_shared_file] :
+                   streamer->work_cfg->vis_writer_direct_chunks ? "direct" : "hyperslab");
+        if (!raw)
+            printf("Writer %d: Dataset cache: %"PRIu64" hits, %"PRIu64" misses\n", writer->index,
+                   writer->ds_cache.hits, writer->ds_cache.misses);
+        if (streamer->work_cfg->vis_writer_cache > 0)
+            printf("Writer %d: Cache: %"PRIu64" chunks merged, %"PRIu64" evicted\n", writer->index,
+                   writer->cached_chunks, writer->evicted_chunks);
+    }
+}
+
+// Release visibility queue and writers
+static void streamer_free_writers(struct streamer *streamer)
+{
+    free(streamer->chunk_contribs);
+#ifdef H5_HAVE_PARALLEL
+    if (streamer->vis_comm != MPI_COMM_NULL)
+        MPI_Comm_free(&streamer->vis_comm);
+#endif
+    if (streamer->fork_writers) {
+        munmap(streamer->vis_queue, streamer->vis_queue_size);
+        munmap(streamer->vis_range_queue, streamer->vis_range_queue_size);
+        munmap(streamer->vis_chunks, streamer->vis_chunks_size);
+        if (streamer->writer) {
+            munmap(streamer->writer, streamer->writer_size);
+        }
+    } else {
+        free(streamer->vis_queue); free(streamer->vis_range_queue);
+        free(streamer->vis_chunks);
+        free(streamer->writer);
+    }
 }
 
 bool streamer_free(struct streamer *streamer,
@@ -692,18 +1659,14 @@ bool streamer_free(struct streamer *streamer,
 {
     bool success = true;
 
-    // Wait for writer to actually finish
-    int i;
-    if (streamer->writer_count > 0) {
-        printf("Finishing writes...\n");
-        for (i = 0; i < streamer->writer_count; i++) {
-            struct streamer_writer *writer = streamer->writer + i;
-            if (streamer->work_cfg->vis_fork_writer) {
-                waitpid(writer->pid, NULL, 0);
-            } else {
-                pthread_join(writer->thread, NULL);
-            }
-        }
+    // Wait for writers, then tell aggregators that we are done
+    streamer_join_writers(streamer);
+    if (streamer->work_cfg->aggregator_workers > 0) {
+        int end[4] = { -1, -1, -1, -1 };
+        int i;
+        for (i = 0; i < streamer->work_cfg->aggregator_workers; i++)
+            MPI_Send(end, sizeof(end), MPI_BYTE, config_aggregator_rank(streamer->work_cfg, i),
+                     AGGREGATOR_TAG, MPI_COMM_WORLD);
     }
 
     double stream_time = get_time_ns() - stream_start;
@@ -733,9 +1696,10 @@ bool streamer_free(struct streamer *streamer,
         printf("Grid accuracy: RMSE %g, worst %g (%"PRIu64" samples)\n",
                grid_rmse / source_energy, streamer->grid_worst_error / source_energy,
                streamer->grid_error_samples);
-        printf("Vis accuracy: RMSE %g, worst %g (%"PRIu64" samples)\n",
+        printf("Vis accuracy: RMSE %g, worst %g (%"PRIu64" samples, %s precision)\n",
                vis_rmse / source_energy, streamer->vis_worst_error / source_energy,
-               streamer->vis_error_samples);
+               streamer->vis_error_samples,
+               streamer->work_cfg->vis_degrid_single ? "single" : "double");
         // Check against error bounds
         if (fmax(streamer->grid_worst_error, streamer->vis_worst_error)
             > streamer->work_cfg->vis_max_error * source_energy) {
@@ -745,48 +1709,21 @@ bool streamer_free(struct streamer *streamer,
         }
     }
 
-    for (i = 0; i < streamer->writer_count; i++) {
-        struct streamer_writer *writer = streamer->writer + i;
+    streamer_report_writers(streamer, stream_time);
 
-        int j;
-        for (j = 0; j < streamer->vis_queue_per_writer; j++) {
-#ifndef __APPLE__
-            sem_destroy(&writer->queue[j].in_lock);
-            sem_destroy(&writer->queue[j].out_lock);
-#else
-            dispatch_release(writer->queue[i].in_lock);
-            dispatch_release(writer->queue[i].out_lock);
-#endif
-        }
-
-        // Then print stats. The above join can hang a bit as data
-        // gets flushed, so re-determine stream time.
-        printf("Writer %d: %.2f GB (rewritten %.2f GB), rate %.2f GB/s (%.2f GB/s effective)\n",
-               writer->index,
-               (double)writer->written_vis_data / 1000000000,
-               (double)writer->rewritten_vis_data / 1000000000,
-               (double)writer->written_vis_data / 1000000000 / stream_time,
-               (double)(writer->written_vis_data - writer->rewritten_vis_data)
-               / 1000000000 / stream_time);
-        printf("Writer %d: Wait: %gs, Read: %gs, Write: %gs, Idle: %gs\n", writer->index,
-               writer->wait_out_time, writer->read_time, writer->write_time,
-               stream_time - writer->wait_out_time - writer->read_time - writer->write_time);
-    }
+    // Report and release buffer pools
+    pool_report(&streamer->subgrid_pool);
+    pool_report(&streamer->image_pool);
+    pool_destroy(&streamer->subgrid_pool);
+    pool_destroy(&streamer->image_pool);
 
     free(streamer->nmbf_queue); free(streamer->subgrid_queue);
     free(streamer->request_queue); free(streamer->subgrid_locks);
     free(streamer->skip_receive);
+    free(streamer->wplane_start); free(streamer->wplane_step);
+    free(streamer->wtower_step);
     fftw_free(streamer->subgrid_plan);
-    if (streamer->work_cfg->vis_fork_writer) {
-        munmap(streamer->vis_queue, streamer->vis_queue_size);
-        munmap(streamer->vis_chunks, streamer->vis_chunks_size);
-        if (streamer->writer) {
-            munmap(streamer->writer, streamer->writer_size);
-        }
-    } else {
-        free(streamer->vis_queue); free(streamer->vis_chunks);
-        free(streamer->writer);
-    }
+    streamer_free_writers(streamer);
 
     return success;
 }
@@ -836,11 +1773,7 @@ int streamer(struct work_config *wcfg, int subgrid_worker, int *producer_ranks)
         for (writer = 0; writer < streamer.writer_count; writer++) {
             struct streamer_chunk *slot = writer_push_slot(
                  streamer.writer + writer, NULL, -1, -1);
-#ifndef __APPLE__
-            sem_post(&slot->out_lock);
-#else
-            dispatch_semaphore_signal(slot->out_lock);
-#endif
+            writer_push_done(slot);
         }
     }
 #pragma omp section
@@ -859,3 +1792,95 @@ int streamer(struct work_config *wcfg, int subgrid_worker, int *producer_ranks)
         return 1;
     }
 }
+
+int aggregator(struct work_config *wcfg, int aggregator)
+{
+    struct vis_spec *const spec = &wcfg->spec;
+    const int nant = spec->cfg->ant_count;
+
+    // Aggregators only need the visibility queue and writers of a
+    // streamer
+    struct streamer streamer;
+    memset(&streamer, 0, sizeof(streamer));
+    streamer.work_cfg = wcfg;
+    streamer.subgrid_worker = -1;
+    streamer.aggregator = aggregator;
+    if (!streamer_init_writers(&streamer))
+        return 1;
+
+    const size_t vis_offset = aggregator_vis_offset(spec);
+    const size_t msg_size = aggregator_message_size(spec);
+    char *msg = (char *)malloc(msg_size);
+    if (!msg) {
+        fprintf(stderr, "ERROR: Could not allocate aggregator message buffer!\n");
+        return 1;
+    }
+    int *header = (int *)msg;
+    double complex *vis = (double complex *)(msg + vis_offset);
+
+    // Receive chunks until all streamers have signalled that they are done
+    double stream_start = get_time_ns();
+    int streamers_left = wcfg->subgrid_workers;
+    printf("Waiting for data from %d streamers...\n", streamers_left);
+    while (streamers_left > 0) {
+
+        double start = get_time_ns();
+        MPI_Status status; int size;
+        MPI_Recv(msg, msg_size, MPI_BYTE, MPI_ANY_SOURCE, AGGREGATOR_TAG,
+                 MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_BYTE, &size);
+        streamer.wait_time += get_time_ns() - start;
+        streamer.received_data += size;
+        if (header[0] < 0) {
+            streamers_left--;
+            continue;
+        }
+
+        // Acquire a slot from the writer responsible
+        start = get_time_ns();
+        struct bl_data *bl_data = wcfg->bl_data + header[0] + nant * header[1];
+        const int tchunk = header[2], fchunk = header[3];
+        struct streamer_writer *writer = streamer_route_chunk(&streamer, bl_data, tchunk, fchunk);
+        struct streamer_chunk *chunk = writer_push_slot(writer, bl_data, tchunk, fchunk);
+        streamer.wait_in_time += get_time_ns() - start;
+        if (!chunk)
+            continue;
+
+        // Unpack ranges and visibilities
+        start = get_time_ns();
+        memcpy(chunk->ranges, header + 4, sizeof(int) * 2 * spec->time_chunk);
+        int t, count = 0;
+        for (t = 0; t < spec->time_chunk; t++) {
+            const int i0 = chunk->ranges[t*2], i1 = chunk->ranges[t*2+1];
+            if (i1 > i0) {
+                memcpy(chunk->vis + t * spec->freq_chunk + i0, vis + count,
+                       sizeof(double complex) * (i1 - i0));
+                count += i1 - i0;
+            }
+        }
+        assert(vis_offset + sizeof(double complex) * count == (size_t)size);
+        writer_push_done(chunk);
+        streamer.produced_chunks++;
+        streamer.recombine_time += get_time_ns() - start;
+    }
+
+    // Signal writers to exit, and wait for them to finish
+    int i;
+    for (i = 0; i < streamer.writer_count; i++)
+        writer_push_done(writer_push_slot(streamer.writer + i, NULL, -1, -1));
+    streamer_join_writers(&streamer);
+
+    double stream_time = get_time_ns() - stream_start;
+    printf("Aggregated for %.2fs\n", stream_time);
+    printf("Received %.2f GB (%"PRIu64" chunks from %d streamers)\n",
+           (double)streamer.received_data / 1000000000, streamer.produced_chunks,
+           wcfg->subgrid_workers);
+    printf("Aggregator: Wait: %gs, Queue: %gs, Unpack: %gs, Idle: %gs\n",
+           streamer.wait_time, streamer.wait_in_time, streamer.recombine_time,
+           stream_time - streamer.wait_time - streamer.wait_in_time - streamer.recombine_time);
+    streamer_report_writers(&streamer, stream_time);
+
+    free(msg);
+    streamer_free_writers(&streamer);
+    return 0;
+}
@@ -7,41 +7,53 @@
 #else
 #define MPI_Request int
 #define MPI_REQUEST_NULL 0
-#endif
-
-#ifndef __APPLE__
-#include <semaphore.h>
-#else
-#include <dispatch/dispatch.h>
-#define sem_t dispatch_semaphore_t
+#define MPI_Comm int
+#define MPI_COMM_NULL 0
 #endif
 
 #include "config.h"
+#include "pool.h"
+#include "raw.h"
 
 struct streamer_chunk
 {
     struct bl_data *bl_data;
     int tchunk, fchunk;
-    sem_t in_lock, out_lock; // Ready to fill / write to disk
+    uint32_t seq, waiters; // Ring sequence number (see writer_push_slot), sleeping threads
     double complex *vis;
+    int *ranges; // per time step: valid frequency range [i0,i1) in vis
+};
+
+// Subgrid prepared for degridding, shared between tasks
+struct streamer_subgrid
+{
+    int refs; // references held (by tasks)
+    int iw; // w-level
+    void *data; // planes, see subgrid_planes
 };
 
 struct streamer_writer
 {
 
-    // Index of worker, and writer (unique across distributed program)
+    // Index of worker or aggregator (-1 if not an aggregator), and
+    // writer (unique across distributed program)
     int subgrid_worker;
+    int aggregator;
     int index;
     pid_t pid; // if forking writers
     pthread_t thread; // if not forking writers
 
-    // Visibility file
+    // Visibility file (HDF5 or raw, see vis_backend)
     hid_t file, group;
+    struct vis_ds_cache ds_cache;
+    struct raw_file raw;
+    int uring_depth; // asynchronous writes in flight (raw backend, 0: off)
+    MPI_Comm comm; // writers sharing the file (see vis_shared)
+    hid_t dxpl; // transfer properties for writes to the shared file
 
     // Visibility Chunk queue
     int queue_length;
-    int in_ptr, out_ptr;
-    int to_write;
+    uint64_t in_ticket, out_ticket; // handed out to producers / written
     struct streamer_chunk *queue;
 
     // Work config
@@ -51,7 +63,13 @@ struct streamer_writer
     double wait_out_time;
     double read_time;
     double write_time;
+    uint64_t received_chunks;
     uint64_t written_vis_data, rewritten_vis_data;
+    uint64_t cached_chunks, evicted_chunks; // write-back cache
+
+    // Contributions left to arrive per chunk (write-back cache, see
+    // streamer_count_chunk_contributions)
+    int *chunk_contribs;
 
 };
 
@@ -59,10 +77,21 @@ struct streamer
 {
     struct work_config *work_cfg;
     int subgrid_worker;
+    int aggregator; // I/O aggregator index, or -1 for streamers
     int *producer_ranks;
 
     struct sep_kernel_data *kern;
 
+    // w-planes to generate per subgrid if degridding with a w-kernel
+    // (see degrid_conv_uvw_line): planes [wplane_min,wplane_max] out
+    // of wplane_count, with Fresnel screens to step between them
+    struct sep_kernel_data *w_kern;
+    int wplane_count, wplane_min, wplane_max;
+    double complex *wplane_start, *wplane_step;
+
+    // Fresnel screen to step between subgrid w-levels (w-towers)
+    double complex *wtower_step;
+
     // Incoming data queue (to be assembled)
     int queue_length;
     double complex *nmbf_queue;
@@ -76,14 +105,22 @@ struct streamer
     int *subgrid_locks;
     fftw_plan subgrid_plan;
 
-    // Visibility chunk queue (to be written)
+    // Buffers for prepared subgrids (see subgrid_planes) and for
+    // subgrid images (w-planes and w-towers)
+    struct pool subgrid_pool, image_pool;
+
+    // Visibility chunk queue (to be written, or forwarded to aggregators)
     int writer_count;
+    bool fork_writers;
     int vis_queue_length;
-    size_t vis_queue_size, vis_chunks_size, writer_size;
+    size_t vis_queue_size, vis_range_queue_size, vis_chunks_size, writer_size;
     int vis_queue_per_writer;
+    MPI_Comm vis_comm; // writers sharing a file (see vis_shared)
     double complex *vis_queue;
+    int *vis_range_queue;
     struct streamer_chunk *vis_chunks;
     struct streamer_writer *writer;
+    int *chunk_contribs; // see streamer_count_chunk_contributions
 
     // Statistics
     int num_workers;
@@ -95,12 +132,31 @@ struct streamer
     double vis_error_sum, vis_worst_error, grid_error_sum, grid_worst_error;
     uint64_t degrid_flops;
     uint64_t produced_chunks;
+    uint64_t rerouted_chunks; // away from routed writer, see streamer_route_chunk
     uint64_t task_yields;
 
     // Signal for being finished
     bool finished;
 };
 
+// Number of visibility chunks over all baselines, and index of a
+// baseline's (time, frequency) chunk
+inline static int streamer_chunk_count(const struct vis_spec *spec)
+{
+    const int nant = spec->cfg->ant_count;
+    return nant * nant *
+        ((spec->time_count + spec->time_chunk - 1) / spec->time_chunk) *
+        ((spec->freq_count + spec->freq_chunk - 1) / spec->freq_chunk);
+}
+inline static int streamer_chunk_index(const struct vis_spec *spec, const struct bl_data *bl_data,
+                                       int tchunk, int fchunk)
+{
+    const int time_chunk_count = (spec->time_count + spec->time_chunk - 1) / spec->time_chunk;
+    const int freq_chunk_count = (spec->freq_count + spec->freq_chunk - 1) / spec->freq_chunk;
+    return ((bl_data->antenna2 * spec->cfg->ant_count + bl_data->antenna1)
+            * time_chunk_count + tchunk) * freq_chunk_count + fchunk;
+}
+
 inline static double complex *nmbf_slot(struct streamer *streamer,
                                         int slot, int facet)
 {
@@ -125,11 +181,49 @@ inline static double complex *subgrid_slot(struct streamer *streamer,
     return streamer->subgrid_queue + xM_size * xM_size * slot;
 }
 
+// Row stride of prepared (Fourier transformed) subgrids. We add
+// padding so we don't get cache thrashing problems when the gridding
+// kernel moves. Assume 16x16 is biggest possible convolution.
+inline static int subgrid_stride(struct streamer *streamer)
+{
+    return streamer->work_cfg->recombine.xM_size + 16;
+}
+
+// Number of prepared subgrid planes, and size of a plane in bytes
+inline static int subgrid_planes(struct streamer *streamer)
+{
+    return streamer->wplane_max - streamer->wplane_min + 1;
+}
+inline static size_t subgrid_plane_size(struct streamer *streamer)
+{
+    return (size_t)subgrid_stride(streamer) * streamer->work_cfg->recombine.xM_size *
+        (streamer->work_cfg->vis_degrid_single ? sizeof(float complex) : sizeof(double complex));
+}
+
 void streamer_work(struct streamer *streamer,
                    int subgrid_work,
                    double complex *nmbf);
+int *streamer_count_chunk_contributions(struct streamer *streamer);
 struct streamer_chunk *writer_push_slot(struct streamer_writer *writer,
                                         struct bl_data *bl_data,
                                         int tchunk, int fchunk);
+void writer_push_done(struct streamer_chunk *chunk);
+struct streamer_writer *streamer_route_chunk(struct streamer *streamer,
+                                             struct bl_data *bl_data,
+                                             int tchunk, int fchunk);
+
+// MPI tag of visibility chunks sent to I/O aggregators. Messages
+// consist of a header (antenna1, antenna2, tchunk, fchunk), the
+// valid frequency ranges per time step, and then only the valid
+// visibilities of every time step. Antenna -1 signals the end of a
+// streamer's data.
+#define AGGREGATOR_TAG 0x7fff
+
+// Number of chunks queued for a writer (or waiting for a slot)
+inline static int writer_to_write(const struct streamer_writer *writer)
+{
+    return (int)(__atomic_load_n(&writer->in_ticket, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&writer->out_ticket, __ATOMIC_RELAXED));
+}
 
 #endif
@@ -10,6 +10,7 @@
 #include <complex.h>
 #include <string.h>
 #include <omp.h>
+#include <limits.h>
 #include <float.h>
 #include <pthread.h>
 
@@ -18,7 +19,7 @@
 
 uint64_t streamer_degrid_worker(struct streamer *streamer,
                                 struct bl_data *bl_data,
-                                int SG_stride, double complex *subgrid,
+                                int SG_stride, void *subgrid,
                                 double mid_u, double mid_v, double mid_w,
                                 int iu, int iv, int iw,
                                 bool conjugate,
@@ -26,7 +27,7 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
                                 double min_u, double max_u,
                                 double min_v, double max_v,
                                 double min_w, double max_w,
-                                double complex *vis_data)
+                                double complex *vis_data, int *vis_ranges)
 {
     struct vis_spec *const spec = &streamer->work_cfg->spec;
     const double theta = streamer->work_cfg->theta;
@@ -47,6 +48,15 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
         source_checks = 0;
     }
 
+    // Locate w-planes of the prepared subgrid, if any
+    void *wplanes[streamer->wplane_count];
+    for (i = 0; i < streamer->wplane_count; i++) {
+        if (i < streamer->wplane_min || i > streamer->wplane_max)
+            wplanes[i] = NULL;
+        else
+            wplanes[i] = (char *)subgrid + subgrid_plane_size(streamer) * (i - streamer->wplane_min);
+    }
+
     // Do degridding
     uint64_t flops = 0;
     uint64_t square_error_samples = 0;
@@ -73,13 +83,34 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
 
         // Degrid a line of visibilities
         double complex *pvis = vis_data + (time-it0)*spec->freq_chunk;
-        degrid_conv_uv_line(subgrid, subgrid_size, SG_stride, theta,
-                            u-mid_u, v-mid_v, w-mid_w, du, dv, dw, if1 - if0,
-                            min_u-mid_u, max_u-mid_u,
-                            min_v-mid_v, max_v-mid_v,
-                            min_w-mid_w, max_w-mid_w,
-                            conjugate,
-                            streamer->kern, pvis, &flops);
+        int *prange = vis_ranges + (time-it0)*2;
+        if (streamer->w_kern)
+            degrid_conv_uvw_line(wplanes, streamer->wplane_count, streamer->work_cfg->wstep,
+                                 streamer->work_cfg->vis_degrid_single,
+                                 subgrid_size, SG_stride, theta,
+                                 u-mid_u, v-mid_v, w-mid_w, du, dv, dw, if1 - if0,
+                                 min_u-mid_u, max_u-mid_u,
+                                 min_v-mid_v, max_v-mid_v,
+                                 min_w-mid_w, max_w-mid_w,
+                                 conjugate,
+                                 streamer->kern, streamer->w_kern, pvis,
+                                 prange, prange+1, &flops);
+        else if (streamer->work_cfg->vis_degrid_single)
+            degrid_conv_uv_line_f32((float complex *)subgrid, subgrid_size, SG_stride, theta,
+                                    u-mid_u, v-mid_v, w-mid_w, du, dv, dw, if1 - if0,
+                                    min_u-mid_u, max_u-mid_u,
+                                    min_v-mid_v, max_v-mid_v,
+                                    min_w-mid_w, max_w-mid_w,
+                                    conjugate,
+                                    streamer->kern, pvis, prange, prange+1, &flops);
+        else
+            degrid_conv_uv_line((double complex *)subgrid, subgrid_size, SG_stride, theta,
+                                u-mid_u, v-mid_v, w-mid_w, du, dv, dw, if1 - if0,
+                                min_u-mid_u, max_u-mid_u,
+                                min_v-mid_v, max_v-mid_v,
+                                min_w-mid_w, max_w-mid_w,
+                                conjugate,
+                                streamer->kern, pvis, prange, prange+1, &flops);
 
         // Check against DFT (one per row, maximum)
         if (source_checks > 0) {
@@ -88,7 +119,9 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
 
             } else {
 
-                double complex vis_out = pvis[check_counter];
+                double complex vis_out = 0;
+                if (check_counter >= prange[0] && check_counter < prange[1])
+                    vis_out = pvis[check_counter];
                 double check_u = u + du * check_counter;
                 double check_v = v + dv * check_counter;
                 double check_w = w + dw * check_counter;
@@ -128,6 +161,10 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
         }
     }
 
+    // Mark rows past the end of the data as empty
+    for (; time < it0 + spec->time_chunk; time++)
+        vis_ranges[(time-it0)*2] = vis_ranges[(time-it0)*2+1] = 0;
+
     // Add to statistics
     #pragma omp atomic
         streamer->vis_error_samples += square_error_samples;
@@ -146,12 +183,23 @@ uint64_t streamer_degrid_worker(struct streamer *streamer,
     return flops;
 }
 
-bool streamer_degrid_chunk(struct streamer *streamer,
-                           struct subgrid_work *work,
-                           struct subgrid_work_bl *bl,
-                           int tchunk, int fchunk,
-                           int slot,
-                           int SG_stride, double complex *subgrid)
+// Subgrid boundaries and visibility range of a baseline chunk
+struct streamer_chunk_bounds
+{
+    double sg_mid_u, sg_mid_v, sg_mid_w;
+    double sg_min_u, sg_min_v, sg_min_w;
+    double sg_max_u, sg_max_v, sg_max_w;
+    int it0, it1, if0, if1;
+    bool positive_u;
+};
+
+// Determine bounds of a baseline chunk, returns whether it overlaps
+// with the subgrid
+static bool streamer_chunk_bounds(struct streamer *streamer,
+                                  struct subgrid_work *work,
+                                  struct subgrid_work_bl *bl,
+                                  int tchunk, int fchunk,
+                                  struct streamer_chunk_bounds *b)
 {
     struct vis_spec *const spec = &streamer->work_cfg->spec;
     struct recombine2d_config *const cfg = &streamer->work_cfg->recombine;
@@ -160,61 +208,113 @@ bool streamer_degrid_chunk(struct streamer *streamer,
     const double sg_step = streamer->work_cfg->sg_step;
     const double sg_step_w = streamer->work_cfg->sg_step_w;
 
-    double start = get_time_ns();
-
     // Calculate subgrid boundaries. TODO: All of this duplicates
     // logic that also appears in config.c (bin_baseline). This is
-    // brittle, should get refactored at some point!
-    double sg_mid_u = work->subgrid_off_u / theta;
-    double sg_mid_v = work->subgrid_off_v / theta;
-    double sg_mid_w = work->subgrid_off_w * wstep;
-    double sg_min_u = (work->subgrid_off_u - sg_step / 2) / theta;
-    double sg_min_v = (work->subgrid_off_v - sg_step / 2) / theta;
-    double sg_min_w = (work->subgrid_off_w - sg_step_w / 2) * wstep;
-    double sg_max_u = (work->subgrid_off_u + sg_step / 2) / theta;
-    double sg_max_v = (work->subgrid_off_v + sg_step / 2) / theta;
-    double sg_max_w = (work->subgrid_off_w + sg_step_w / 2) * wstep;
-    if (sg_min_v > cfg->image_size / theta / 2) {
-        sg_min_v -= cfg->image_size / theta / 2;
-        sg_max_v -= cfg->image_size / theta / 2;
+    // brittle, should get refactored at some point! Note that the
+    // w-level comes from the baseline, as it might differ from the
+    // subgrid's with w-towers.
+    const int subgrid_off_w = sg_step_w * bl->iw;
+    b->sg_mid_u = work->subgrid_off_u / theta;
+    b->sg_mid_v = work->subgrid_off_v / theta;
+    b->sg_mid_w = subgrid_off_w * wstep;
+    b->sg_min_u = (work->subgrid_off_u - sg_step / 2) / theta;
+    b->sg_min_v = (work->subgrid_off_v - sg_step / 2) / theta;
+    b->sg_min_w = (subgrid_off_w - sg_step_w / 2) * wstep;
+    b->sg_max_u = (work->subgrid_off_u + sg_step / 2) / theta;
+    b->sg_max_v = (work->subgrid_off_v + sg_step / 2) / theta;
+    b->sg_max_w = (subgrid_off_w + sg_step_w / 2) * wstep;
+    if (b->sg_min_v > cfg->image_size / theta / 2) {
+        b->sg_min_v -= cfg->image_size / theta / 2;
+        b->sg_max_v -= cfg->image_size / theta / 2;
     }
 
     // Determine chunk size
-    int it0 = tchunk * spec->time_chunk,
-        it1 = (tchunk+1) * spec->time_chunk;
-    if (it1 > spec->time_count) it1 = spec->time_count;
-    int if0 = fchunk * spec->freq_chunk,
-        if1 = (fchunk+1) * spec->freq_chunk;
-    if (if1 > spec->freq_count) if1 = spec->freq_count;
+    b->it0 = tchunk * spec->time_chunk;
+    b->it1 = (tchunk+1) * spec->time_chunk;
+    if (b->it1 > spec->time_count) b->it1 = spec->time_count;
+    b->if0 = fchunk * spec->freq_chunk;
+    b->if1 = (fchunk+1) * spec->freq_chunk;
+    if (b->if1 > spec->freq_count) b->if1 = spec->freq_count;
 
     // Check whether time chunk fall into positive u. We use this
     // for deciding whether coordinates are going to get flipped
     // for the entire chunk. This is assuming that a chunk is
     // never big enough that we would overlap an extra subgrid
     // into the negative direction.
-    int tstep_mid = (it0 + it1) / 2;
-    bool positive_u = bl->bl_data->uvw_m[tstep_mid * 3] >= 0;
+    int tstep_mid = (b->it0 + b->it1) / 2;
+    b->positive_u = bl->bl_data->uvw_m[tstep_mid * 3] >= 0;
 
     // Check for overlap between baseline chunk and subgrid
     double min_uvw[3], max_uvw[3];
-    bl_bounding_box(bl->bl_data, !positive_u, it0, it1-1, if0, if1-1,
+    bl_bounding_box(bl->bl_data, !b->positive_u, b->it0, b->it1-1, b->if0, b->if1-1,
                     min_uvw, max_uvw);
-    if (!(min_uvw[0] < sg_max_u && max_uvw[0] > sg_min_u &&
-          min_uvw[1] < sg_max_v && max_uvw[1] > sg_min_v &&
-          min_uvw[2] < sg_max_w && max_uvw[2] > sg_min_w))
-        return false;
+    return min_uvw[0] < b->sg_max_u && max_uvw[0] > b->sg_min_u &&
+           min_uvw[1] < b->sg_max_v && max_uvw[1] > b->sg_min_v &&
+           min_uvw[2] < b->sg_max_w && max_uvw[2] > b->sg_min_w;
+}
+
+// Select writer for a chunk (see writer_routing). Routing by baseline
+// or chunk means contributions to a chunk end up in the same file.
+// Unless the write-back cache relies on that, we fall back to the
+// least busy writer if the queue of the chosen writer is full.
+struct streamer_writer *streamer_route_chunk(struct streamer *streamer,
+                                             struct bl_data *bl_data,
+                                             int tchunk, int fchunk)
+{
+    struct work_config *const wcfg = streamer->work_cfg;
+    if (streamer->writer_count == 0)
+        return NULL;
+
+    struct streamer_writer *writer = NULL;
+    if (wcfg->vis_writer_routing == WRITER_ROUTE_BASELINE) {
+        // On aggregators, all baselines share the same hash modulo
+        // aggregator count (see config_baseline_aggregator)
+        uint32_t hash = config_baseline_hash(wcfg, bl_data->antenna1, bl_data->antenna2);
+        if (streamer->aggregator >= 0)
+            hash /= wcfg->aggregator_workers;
+        writer = streamer->writer + hash % streamer->writer_count;
+    } else if (wcfg->vis_writer_routing == WRITER_ROUTE_CHUNK) {
+        writer = streamer->writer +
+            streamer_chunk_index(&wcfg->spec, bl_data, tchunk, fchunk) % streamer->writer_count;
+    }
+    if (writer && (wcfg->vis_writer_cache > 0 ||
+                   writer_to_write(writer) < writer->queue_length))
+        return writer;
 
     // Determine least busy writer
-    int i, least_waiting = 2 * streamer->vis_queue_per_writer;
-    struct streamer_writer *writer = streamer->writer;
+    int i, least_waiting = INT_MAX;
+    struct streamer_writer *least_busy = streamer->writer;
     for (i = 0; i < streamer->writer_count; i++) {
-        if (streamer->writer[i].to_write < least_waiting) {
-            least_waiting = streamer->writer[i].to_write;
-            writer = streamer->writer + i;
+        if (writer_to_write(streamer->writer + i) < least_waiting) {
+            least_waiting = writer_to_write(streamer->writer + i);
+            least_busy = streamer->writer + i;
         }
     }
+    if (writer && least_busy != writer) {
+        #pragma omp atomic
+            streamer->rerouted_chunks++;
+    }
+    return least_busy;
+}
+
+bool streamer_degrid_chunk(struct streamer *streamer,
+                           struct subgrid_work *work,
+                           struct subgrid_work_bl *bl,
+                           int tchunk, int fchunk,
+                           int slot,
+                           int SG_stride, void *subgrid)
+{
+    struct vis_spec *const spec = &streamer->work_cfg->spec;
+
+    double start = get_time_ns();
+
+    // Check for overlap between baseline chunk and subgrid
+    struct streamer_chunk_bounds b;
+    if (!streamer_chunk_bounds(streamer, work, bl, tchunk, fchunk, &b))
+        return false;
 
     // Acquire a slot
+    struct streamer_writer *writer = streamer_route_chunk(streamer, bl->bl_data, tchunk, fchunk);
     struct streamer_chunk *chunk
         = writer_push_slot(writer, bl->bl_data, tchunk, fchunk);
     #pragma omp atomic
@@ -223,71 +323,105 @@ bool streamer_degrid_chunk(struct streamer *streamer,
 
     // Do degridding
     const size_t chunk_vis_size = sizeof(double complex) * spec->freq_chunk * spec->time_chunk;
+    const size_t chunk_ranges_size = sizeof(int) * 2 * spec->time_chunk;
     uint64_t flops = streamer_degrid_worker(
         streamer, bl->bl_data, SG_stride, subgrid,
-        sg_mid_u, sg_mid_v, sg_mid_w,
-        work->iu, work->iv, work->iw,
-        !positive_u,
-        it0, it1, if0, if1,
-        sg_min_u, sg_max_u, sg_min_v, sg_max_v, sg_min_w, sg_max_w,
-        chunk ? chunk->vis : alloca(chunk_vis_size));
+        b.sg_mid_u, b.sg_mid_v, b.sg_mid_w,
+        work->iu, work->iv, bl->iw,
+        !b.positive_u,
+        b.it0, b.it1, b.if0, b.if1,
+        b.sg_min_u, b.sg_max_u, b.sg_min_v, b.sg_max_v, b.sg_min_w, b.sg_max_w,
+        chunk ? chunk->vis : alloca(chunk_vis_size),
+        chunk ? chunk->ranges : alloca(chunk_ranges_size));
     #pragma omp atomic
       streamer->degrid_time += get_time_ns() - start;
 
     if (chunk) {
 
         // No flops executed? Signal to writer that we can skip writing
-        // this chunk (small optimisation)
-        if (flops == 0) {
+        // this chunk (small optimisation). The write-back cache needs
+        // to count the contribution, so it gets passed on regardless.
+        if (flops == 0 && streamer->work_cfg->vis_writer_cache == 0) {
             chunk->tchunk = -2;
             chunk->fchunk = -2;
         }
 
         // Signal slot for output
-#ifndef __APPLE__
-        sem_post(&chunk->out_lock);
-#else
-        dispatch_semaphore_signal(chunk->out_lock);
-#endif
+        writer_push_done(chunk);
     }
 
     return true;
 }
 
+int *streamer_count_chunk_contributions(struct streamer *streamer)
+{
+    struct work_config *const wcfg = streamer->work_cfg;
+    struct vis_spec *const spec = &wcfg->spec;
+    int *counts = (int *)calloc(sizeof(int), streamer_chunk_count(spec));
+    if (!counts)
+        return NULL;
+
+    // Go through all baselines of all our work, same as
+    // streamer_task. Aggregators get the baselines assigned to them
+    // from all streamers (see config_baseline_aggregator).
+    int worker0 = streamer->subgrid_worker, worker1 = streamer->subgrid_worker + 1;
+    if (streamer->aggregator >= 0) {
+        worker0 = 0; worker1 = wcfg->subgrid_workers;
+    }
+    int iwork;
+    for (iwork = worker0 * wcfg->subgrid_max_work; iwork < worker1 * wcfg->subgrid_max_work; iwork++) {
+        struct subgrid_work *const work = wcfg->subgrid_work + iwork;
+        struct subgrid_work_bl *bl;
+        for (bl = work->bls; bl; bl = bl->next) {
+            if (streamer->aggregator >= 0 &&
+                config_baseline_aggregator(wcfg, bl->bl_data->antenna1, bl->bl_data->antenna2)
+                    != streamer->aggregator)
+                continue;
+            int ntchunk = (bl->bl_data->time_count + spec->time_chunk - 1) / spec->time_chunk;
+            int nfchunk = (bl->bl_data->freq_count + spec->freq_chunk - 1) / spec->freq_chunk;
+            int tchunk, fchunk;
+            struct streamer_chunk_bounds b;
+            for (tchunk = 0; tchunk < ntchunk; tchunk++)
+                for (fchunk = 0; fchunk < nfchunk; fchunk++)
+                    if (streamer_chunk_bounds(streamer, work, bl, tchunk, fchunk, &b))
+                        counts[streamer_chunk_index(spec, bl->bl_data, tchunk, fchunk)]++;
+        }
+    }
+
+    return counts;
+}
+
+// Release a reference to a prepared subgrid. Frees the buffer once
+// the last reference to it is gone.
+static void streamer_release_subgrid(struct streamer *streamer,
+                                     int slot, struct streamer_subgrid *subgrid)
+{
+    int refs;
+    #pragma omp atomic capture
+        refs = --subgrid->refs;
+    if (refs == 0) {
+        pool_free(&streamer->subgrid_pool, subgrid->data);
+        free(subgrid);
+    }
+    #pragma omp atomic
+        streamer->subgrid_locks[slot]--;
+}
+
 void streamer_task(struct streamer *streamer,
                    struct subgrid_work *work,
                    struct subgrid_work_bl *bl,
                    int slot,
                    int subgrid_work,
-                   double complex *subgrid_image)
+                   struct streamer_subgrid *subgrid)
 {
 
-
-    const int xM_size = streamer->work_cfg->recombine.xM_size;
-    const int SG_stride = xM_size + 16; // Assume 16x16 is biggest possible convolution
-    const int SG2_size = sizeof(double complex) *
-        SG_stride * xM_size;
-    int i;
-
-    // FFT and establish proper stride for the subgrid so we don't get
-    // cache thrashing problems when gridding moves (TODO: construct
-    // like this right away?)
-    double complex *subgrid = calloc(1, SG2_size);
-    if (subgrid_image) {
-        fftw_execute_dft(streamer->subgrid_plan, subgrid_image, subgrid);
-        fft_shift(subgrid, xM_size);
-        for (i = xM_size-1; i >= 0; i--) {
-            memcpy(subgrid + SG_stride * i,
-                   subgrid + xM_size * i,
-                   sizeof(double complex) * xM_size);
-        }
-    }
+    const int SG_stride = subgrid_stride(streamer);
 
     struct vis_spec *const spec = &streamer->work_cfg->spec;
     struct subgrid_work_bl *bl2;
     int i_bl2;
     for (bl2 = bl, i_bl2 = 0;
-         bl2 && i_bl2 < streamer->work_cfg->vis_bls_per_task;
+         bl2 && i_bl2 < streamer->work_cfg->vis_bls_per_task && bl2->iw == subgrid->iw;
          bl2 = bl2->next, i_bl2++) {
 
         // Go through time/frequency chunks
@@ -299,7 +433,7 @@ void streamer_task(struct streamer *streamer,
             for (fchunk = 0; fchunk < nfchunk; fchunk++)
                 if (streamer_degrid_chunk(streamer, work,
                                           bl2, tchunk, fchunk,
-                                          slot, SG_stride, subgrid))
+                                          slot, SG_stride, subgrid->data))
                     nchunks++;
 
         // Check that plan predicted the right number of chunks. This
@@ -309,37 +443,138 @@ void streamer_task(struct streamer *streamer,
         // plan!
         if (bl2->chunks != nchunks)
             printf("WARNING: subgrid (%d/%d/%d) baseline (%d-%d) %d chunks planned, %d actual!\n",
-                   work->iu, work->iv, work->iw, bl2->a1, bl2->a2, bl2->chunks, nchunks);
+                   work->iu, work->iv, bl2->iw, bl2->a1, bl2->a2, bl2->chunks, nchunks);
 
     }
 
     // Done with this chunk
 #pragma omp atomic
     streamer->subgrid_tasks--;
-#pragma omp atomic
-    streamer->subgrid_locks[slot]--;
+    streamer_release_subgrid(streamer, slot, subgrid);
+}
+
+// Fourier transform a (modulated) subgrid image into a plane of the
+// prepared subgrid. For single precision we transform in-place and
+// convert, so this overwrites the image.
+static void streamer_transform_plane(struct streamer *streamer,
+                                     double complex *image, void *plane)
+{
+    const int xM_size = streamer->work_cfg->recombine.xM_size;
+    const int SG_stride = subgrid_stride(streamer);
+    int i, j;
+
+    if (streamer->work_cfg->vis_degrid_single) {
+        float complex *subgrid = (float complex *)plane;
+        fftw_execute_dft(streamer->subgrid_plan, image, image);
+        for (i = 0; i < xM_size; i++) {
+            float complex *row = subgrid + SG_stride * i;
+            for (j = 0; j < xM_size; j++)
+                row[j] = image[xM_size * i + j];
+            for (; j < SG_stride; j++)
+                row[j] = 0;
+        }
+        return;
+    }
+
+    // Transform writes every row, so only padding needs clearing
+    double complex *subgrid = (double complex *)plane;
+    for (i = 0; i < xM_size; i++) {
+        memset(subgrid + SG_stride * i + xM_size, 0,
+               sizeof(double complex) * (SG_stride - xM_size));
+    }
+    fftw_execute_dft(streamer->subgrid_plan, image, subgrid);
+}
+
+// Fourier transform the subgrid image, shift it and establish the
+// padded stride expected by the degridding code. This happens once
+// per subgrid, the result gets shared between all degridding tasks.
+// With a w-kernel we generate neighbouring w-planes as well by
+// applying Fresnel screens (see streamer_init_wplanes).
+// Note that this modulates the subgrid image in-place. For single
+// precision degridding, the (double precision) Fourier transformed
+// middle plane is also left in the subgrid image. The result starts
+// out with a single reference.
+static struct streamer_subgrid *streamer_prepare_subgrid(struct streamer *streamer,
+                                                         double complex *subgrid_image,
+                                                         int iw)
+{
+    const int xM_size = streamer->work_cfg->recombine.xM_size;
+    const size_t plane_size = subgrid_plane_size(streamer);
+    const int nplanes = subgrid_planes(streamer);
+    int i, k;
+
+    // Shift gets applied by checkerboard modulation of the input,
+    // striding is handled by the plan itself
+    fft_shift_modulate(subgrid_image, xM_size, xM_size);
+    struct streamer_subgrid *ready = (struct streamer_subgrid *)
+        malloc(sizeof(struct streamer_subgrid));
+    char *subgrid = (char *)pool_alloc(&streamer->subgrid_pool);
+    if (!ready || !subgrid) {
+        free(ready); pool_free(&streamer->subgrid_pool, subgrid);
+        return NULL;
+    }
+    ready->refs = 1;
+    ready->iw = iw;
+    ready->data = subgrid;
+    if (!streamer->w_kern) {
+        streamer_transform_plane(streamer, subgrid_image, subgrid);
+        return ready;
+    }
+
+    // Allocate image buffers for w-planes. For single precision we
+    // need a copy for the in-place transform.
+    const bool single = streamer->work_cfg->vis_degrid_single;
+    const size_t image_length = (size_t)xM_size * xM_size;
+    double complex *wimage = (double complex *)pool_alloc(&streamer->image_pool);
+    if (!wimage) {
+        free(ready); pool_free(&streamer->subgrid_pool, subgrid);
+        return NULL;
+    }
+    double complex *wimage_copy = wimage + image_length;
+
+    // Step through w-planes. The middle plane is the original image.
+    const int kmid = streamer->wplane_count / 2 - streamer->wplane_min;
+    for (i = 0; i < image_length; i++)
+        wimage[i] = subgrid_image[i] * streamer->wplane_start[i];
+    for (k = 0; k < nplanes; k++) {
+        if (k > 0) {
+            for (i = 0; i < image_length; i++)
+                wimage[i] *= streamer->wplane_step[i];
+        }
+        if (k == kmid) {
+            streamer_transform_plane(streamer, subgrid_image, subgrid + k * plane_size);
+        } else if (single) {
+            memcpy(wimage_copy, wimage, sizeof(double complex) * image_length);
+            streamer_transform_plane(streamer, wimage_copy, subgrid + k * plane_size);
+        } else {
+            streamer_transform_plane(streamer, wimage, subgrid + k * plane_size);
+        }
+    }
 
-    free(subgrid);
+    pool_free(&streamer->image_pool, wimage);
+    return ready;
 }
 
-// Perform checks on the subgrid data. Returns RMSE if we have sources
-// to do the checks.
+// Perform checks on the (Fourier transformed and shifted) subgrid
+// data at w-level iw. Returns RMSE if we have sources to do the checks.
 static double streamer_checks(struct streamer *streamer,
-                              struct subgrid_work *work,
-                              complex double *subgrid_image)
+                              struct subgrid_work *work, int iw,
+                              complex double *subgrid, int SG_stride)
 {
     struct recombine2d_config *const cfg = &streamer->work_cfg->recombine;
 
-    // Perform Fourier transform
-    complex double *subgrid = calloc(sizeof(complex double), cfg->SG_size);
-    fftw_execute_dft(streamer->subgrid_plan, subgrid_image, subgrid);
-
-    // Check accumulated result
-    if (work->check_path && streamer->work_cfg->facet_workers > 0) {
+    // Check accumulated result. Reference is not shifted, and only
+    // exists for the subgrid's own w-level.
+    if (work->check_path && streamer->work_cfg->facet_workers > 0 && iw == work->iw) {
         double complex *approx_ref = read_hdf5(cfg->SG_size, work->check_hdf5, work->check_path);
-        double err_sum = 0; int y;
-        for (y = 0; y < cfg->xM_size * cfg->xM_size; y++) {
-            double err = cabs(subgrid[y] - approx_ref[y]); err_sum += err * err;
+        double err_sum = 0; int y0, y1;
+        for (y0 = 0; y0 < cfg->xM_size; y0++) {
+            double complex *row = subgrid + SG_stride * ((y0 + cfg->xM_size/2) % cfg->xM_size);
+            for (y1 = 0; y1 < cfg->xM_size; y1++) {
+                double err = cabs(row[(y1 + cfg->xM_size/2) % cfg->xM_size] -
+                                  approx_ref[y0 * cfg->xM_size + y1]);
+                err_sum += err * err;
+            }
         }
         free(approx_ref);
         double rmse = sqrt(err_sum / cfg->xM_size / cfg->xM_size);
@@ -349,10 +584,9 @@ static double streamer_checks(struct streamer *streamer,
 
     }
 
-    fft_shift(subgrid, cfg->xM_size);
-
     // Check some degridded example visibilities
-    if (work->check_degrid_path && streamer->kern && streamer->work_cfg->facet_workers > 0) {
+    if (work->check_degrid_path && streamer->kern && streamer->work_cfg->facet_workers > 0 &&
+        iw == work->iw) {
         int nvis = get_npoints_hdf5(work->check_hdf5, "%s/vis", work->check_degrid_path);
         double *uvw_sg = read_hdf5(3 * sizeof(double) * nvis, work->check_hdf5,
                                    "%s/uvw_subgrid", work->check_degrid_path);
@@ -370,7 +604,7 @@ static double streamer_checks(struct streamer *streamer,
 
         // Degrid and compare
         bl.uvw_m = uvw_sg;
-        degrid_conv_bl(subgrid, cfg->xM_size, cfg->xM_size, cfg->image_size, 0, 0,
+        degrid_conv_bl(subgrid, cfg->xM_size, SG_stride, cfg->image_size, 0, 0,
                        -cfg->xM_size, cfg->xM_size, -cfg->xM_size, cfg->xM_size,
                        &bl, 0, nvis, 0, 1, streamer->kern);
         double err_sum = 0; int y;
@@ -402,7 +636,7 @@ static double streamer_checks(struct streamer *streamer,
 
                 double check_u = (work->subgrid_off_u+iu) / theta;
                 double check_v = (work->subgrid_off_v+iv) / theta;
-                double check_w = work->subgrid_off_w * wstep;
+                double check_w = streamer->work_cfg->sg_step_w * iw * wstep;
 
                 // Generate visibility
                 complex double vis = 0;
@@ -418,7 +652,7 @@ static double streamer_checks(struct streamer *streamer,
                 vis /= (double)cfg->image_size * cfg->image_size;
 
                 // Check
-                double complex  vis_grid = subgrid[(iv+cfg->xM_size/2) * cfg->xM_size + iu + cfg->xM_size/2];
+                double complex  vis_grid = subgrid[(iv+cfg->xM_size/2) * SG_stride + iu + cfg->xM_size/2];
                 double err = cabs(vis_grid - vis);
                 err_sum += err * err;
                 worst_err = fmax(worst_err, err);
@@ -439,13 +673,29 @@ static double streamer_checks(struct streamer *streamer,
 
     }
 
-    free(subgrid);
     if (err_samples > 0)
         return sqrt(err_sum / err_samples) / streamer->work_cfg->source_energy;
     else
         return -1;
 }
 
+// Move a (unmodulated) subgrid image by diw w-levels (w-towers).
+// Every step is a multiplication with the Fresnel screen for one
+// subgrid w-step, or its conjugate to step backwards.
+static void streamer_wtower_step(struct streamer *streamer,
+                                 double complex *image, int diw)
+{
+    const int xM_size = streamer->work_cfg->recombine.xM_size;
+    const double complex *screen = streamer->wtower_step;
+    int i, k;
+    for (k = 0; k < diw; k++)
+        for (i = 0; i < xM_size * xM_size; i++)
+            image[i] *= screen[i];
+    for (k = 0; k < -diw; k++)
+        for (i = 0; i < xM_size * xM_size; i++)
+            image[i] *= conj(screen[i]);
+}
+
 void streamer_work(struct streamer *streamer,
                    int subgrid_work,
                    double complex *nmbf)
@@ -507,23 +757,73 @@ void streamer_work(struct streamer *streamer,
                             nmbf + nmbf_length*ifacet);
     streamer->recombine_time += get_time_ns() - recombine_start;
 
-    // Perform checks on result
-    double rmse = streamer_checks(streamer, work, subgrid);
-
+    // Without w-towers all baselines are at the subgrid's w-level,
+    // otherwise step the subgrid image through the tower's w-levels
+    // in order (see streamer_wtower_step).
     struct vis_spec *const spec = &streamer->work_cfg->spec;
-    if (spec->time_count > 0 && streamer->kern) {
+    struct subgrid_work_bl *bl;
+    double complex *wtower = NULL;
+    int iw = work->iw;
+    for (bl = work->bls; bl; bl = bl->next)
+        if (bl->iw != iw) break;
+    if (streamer->wtower_step && bl) {
+        wtower = (double complex *)pool_alloc(&streamer->image_pool);
+        if (!wtower) {
+            fprintf(stderr, "ERROR: Could not allocate w-tower for subgrid %d/%d/%d!\n",
+                    work->iu, work->iv, work->iw);
+            return;
+        }
+        memcpy(wtower, subgrid, cfg->SG_size);
+    }
 
-        // Loop through baselines
-        struct subgrid_work_bl *bl;
-        int i_bl = 0;
-        for (bl = work->bls; bl; bl = bl->next, i_bl++) {
-            if (i_bl % streamer->work_cfg->vis_bls_per_task != 0)
+    double rmse = -1; int i_bl = 0;
+    bl = work->bls;
+    do {
+        if (wtower) {
+            streamer_wtower_step(streamer, wtower, bl->iw - iw);
+            iw = bl->iw;
+            memcpy(subgrid, wtower, cfg->SG_size);
+        }
+
+        // Prepare subgrid for degridding. We hold a reference
+        // ourselves until all tasks have been spawned, so it can't
+        // get freed early.
+        struct streamer_subgrid *subgrid_ready = streamer_prepare_subgrid(streamer, subgrid, iw);
+        if (!subgrid_ready) {
+            fprintf(stderr, "ERROR: Could not allocate subgrid %d/%d/%d!\n",
+                    work->iu, work->iv, iw);
+            break;
+        }
+        #pragma omp atomic
+            streamer->subgrid_locks[slot]++;
+
+        // Perform checks on result (on the middle w-plane). Use double
+        // precision data if we have it.
+        double level_rmse;
+        if (streamer->work_cfg->vis_degrid_single)
+            level_rmse = streamer_checks(streamer, work, iw, subgrid, cfg->xM_size);
+        else
+            level_rmse = streamer_checks(streamer, work, iw,
+                                         (double complex *)((char *)subgrid_ready->data +
+                                                            subgrid_plane_size(streamer) *
+                                                            (streamer->wplane_count / 2 - streamer->wplane_min)),
+                                         subgrid_stride(streamer));
+        rmse = fmax(rmse, level_rmse);
+
+        // Loop through baselines at this w-level
+        int i_level_bl = 0;
+        for (; bl && bl->iw == iw; bl = bl->next, i_bl++, i_level_bl++) {
+            if (i_level_bl % streamer->work_cfg->vis_bls_per_task != 0)
+                continue;
+            if (spec->time_count == 0 || !streamer->kern)
                 continue;
 
-            // We are spawning a task: Add lock to subgrid data to
-            // make sure it doesn't get overwritten
+            // We are spawning a task: Add reference to subgrid data
+            // to make sure it doesn't get overwritten
             #pragma omp atomic
               streamer->subgrid_tasks++;
+            #pragma omp atomic
+              subgrid_ready->refs++;
             #pragma omp atomic
               streamer->subgrid_locks[slot]++;
 
@@ -534,12 +834,19 @@ void streamer_work(struct streamer *streamer,
             // the copy), but I don't trust its judgement.
             double task_start = get_time_ns();
             struct subgrid_work *_work = work;
-            #pragma omp task firstprivate(streamer, _work, bl, slot, subgrid_work, subgrid)
-                streamer_task(streamer, _work, bl, slot, subgrid_work, subgrid);
+            #pragma omp task firstprivate(streamer, _work, bl, slot, subgrid_work, subgrid_ready)
+                streamer_task(streamer, _work, bl, slot, subgrid_work, subgrid_ready);
             #pragma omp atomic
                 streamer->task_start_time += get_time_ns() - task_start;
         }
 
+        // Drop our own reference
+        streamer_release_subgrid(streamer, slot, subgrid_ready);
+
+    } while (wtower && bl);
+    pool_free(&streamer->image_pool, wtower);
+
+    if (spec->time_count > 0 && streamer->kern) {
         if (rmse >= 0) {
             printf("Subgrid %d/%d/%d (%d baselines, rmse %.02g)\n",
                    work->iu, work->iv, work->iw, i_bl, rmse);
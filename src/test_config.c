@@ -79,9 +79,9 @@ void simple_benchmark(const char *filename,
                          -uvw_l_max[1] < sg_max_v && -uvw_l_min[1] > sg_min_v)) {
 
                         if (write)
-                            write_vis_chunk(vis_g, &bl, time_chunk, freq_chunk, itime, ifreq, data);
+                            write_vis_chunk(vis_g, NULL, &bl, time_chunk, freq_chunk, itime, ifreq, data);
                         else
-                            read_vis_chunk(vis_g, &bl, time_chunk, freq_chunk, itime, ifreq, data);
+                            read_vis_chunk(vis_g, NULL, &bl, time_chunk, freq_chunk, itime, ifreq, data);
                         bytes += sizeof(double complex) * time_chunk * freq_chunk;
                     } else {
                         skipped_bytes += sizeof(double complex) * time_chunk * freq_chunk;
@@ -179,7 +179,7 @@ int main(int argc, char *argv[])
         }
 
         // Create all baseline groups
-        create_bl_groups(vis_g, &work_cfg, world_size > 1 ? i : -1);
+        create_bl_groups(vis_g, &work_cfg, world_size > 1 ? i : -1, -1);
         H5Gclose(vis_g); H5Fclose(vis_f);
 
         // Run simple write+read benchmark
@@ -345,10 +345,10 @@ int T04a_recombine2d() {
 
         double complex *facet = read_dump(cfg.F_size, "../data/grid/T04_facet%d%d.in", j0, j1);
 
-        recombine2d_pf1_ft1_omp(&worker, facet, BF);
+        recombine2d_pf1_ft1_omp(&worker, facet, NULL, BF);
         int i0, i1;
         for (i1 = 0; i1 < nsubgrid; i1++) {
-            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, worker.NMBF_BF);
+            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, NULL, worker.NMBF_BF);
             for (i0 = 0; i0 < nsubgrid; i0++) {
                 recombine2d_es0(&worker, i0*cfg.xA_size, i1*cfg.xA_size, worker.NMBF_BF, NMBF_NMBF);
 
@@ -375,6 +375,134 @@ int T04a_recombine2d() {
     return ret;
 }
 
+// Real-valued facets (real parts of last test's) must give the same
+// result as the complex path
+int T04b_recombine2d_real() {
+
+    const int nsubgrid = 3;
+    const int BF_batch = 16;
+
+    struct recombine2d_config cfg, cfg_r;
+    if (!recombine2d_set_config(&cfg, 2000, 100,
+                                "../data/grid/T04_pswf.in",
+                                400, 480, 900, 400, 500, 247) ||
+        !recombine2d_set_config(&cfg_r, 2000, 100,
+                                "../data/grid/T04_pswf.in",
+                                400, 480, 900, 400, 500, 247))
+        return 1;
+    recombine2d_set_real(&cfg_r, true);
+
+    double complex *facet = read_dump(cfg.F_size, "../data/grid/T04_facet%d%d.in", 1, 2);
+    if (!facet) return 1;
+    double *facet_r = (double *)malloc(cfg_r.F_size);
+    int y;
+    for (y = 0; y < cfg.yB_size * cfg.yB_size; y++) {
+        facet_r[y] = creal(facet[y]);
+        facet[y] = creal(facet[y]);
+    }
+
+    double complex *BF = (double complex *)malloc(cfg.BF_size);
+    double complex *BF_r = (double complex *)malloc(cfg_r.BF_size);
+    double complex *NMBF_NMBF = (double complex *)malloc(cfg.NMBF_NMBF_size);
+    double complex *NMBF_NMBF_r = (double complex *)malloc(cfg.NMBF_NMBF_size);
+
+    struct recombine2d_worker worker, worker_r;
+    fftw_plan BF_plan = recombine2d_bf_plan(&cfg, BF_batch, BF, FFTW_ESTIMATE);
+    fftw_plan BF_plan_r = recombine2d_bf_plan_r2c(&cfg_r, BF_batch, BF_r, FFTW_ESTIMATE);
+    recombine2d_init_worker(&worker, &cfg, BF_batch, BF_plan, FFTW_ESTIMATE);
+    recombine2d_init_worker(&worker_r, &cfg_r, BF_batch, BF_plan_r, FFTW_ESTIMATE);
+
+    recombine2d_pf1_ft1_omp(&worker, facet, NULL, BF);
+    recombine2d_pf1_ft1_omp(&worker_r, facet_r, NULL, BF_r);
+    int i0, i1;
+    for (i1 = 0; i1 < nsubgrid; i1++) {
+        recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, NULL, worker.NMBF_BF);
+        recombine2d_es1_pf0_ft0(&worker_r, i1*cfg.xA_size, BF_r, NULL, worker_r.NMBF_BF);
+        for (i0 = 0; i0 < nsubgrid; i0++) {
+            recombine2d_es0(&worker, i0*cfg.xA_size, i1*cfg.xA_size, worker.NMBF_BF, NMBF_NMBF);
+            recombine2d_es0(&worker_r, i0*cfg.xA_size, i1*cfg.xA_size, worker_r.NMBF_BF, NMBF_NMBF_r);
+            for (y = 0; y < cfg.xM_yN_size * cfg.xM_yN_size; y++)
+                assert(cabs(NMBF_NMBF[y] - NMBF_NMBF_r[y]) < 1e-12);
+        }
+    }
+
+    recombine2d_free_worker(&worker);
+    recombine2d_free_worker(&worker_r);
+    fftw_free(BF_plan); fftw_free(BF_plan_r);
+    recombine2d_free(&cfg); recombine2d_free(&cfg_r);
+    free(facet); free(facet_r);
+    free(BF); free(BF_r); free(NMBF_NMBF); free(NMBF_NMBF_r);
+
+    return 0;
+}
+
+// Skipping rows known to be zero must not change the result
+int T04c_recombine2d_sparse() {
+
+    const int nsubgrid = 3;
+    const int BF_batch = 16;
+
+    struct recombine2d_config cfg;
+    if (!recombine2d_set_config(&cfg, 2000, 100,
+                                "../data/grid/T04_pswf.in",
+                                400, 480, 900, 400, 500, 247))
+        return 1;
+
+    // Keep only a few rows of the facet
+    double complex *facet = read_dump(cfg.F_size, "../data/grid/T04_facet%d%d.in", 1, 1);
+    if (!facet) return 1;
+    bool *F_rows = (bool *)calloc(cfg.yB_size, sizeof(bool));
+    int x, y;
+    for (x = 0; x < cfg.yB_size; x++) {
+        F_rows[x] = (x % 37 == 3);
+        if (!F_rows[x])
+            for (y = 0; y < cfg.yB_size; y++)
+                facet[x * cfg.F_stride0 + y * cfg.F_stride1] = 0;
+    }
+
+    double complex *BF = (double complex *)malloc(cfg.BF_size);
+    double complex *NMBF = (double complex *)malloc(cfg.NMBF_size);
+    double complex *NMBF_NMBF = (double complex *)malloc(cfg.NMBF_NMBF_size);
+    double complex *NMBF_NMBF_s = (double complex *)malloc(cfg.NMBF_NMBF_size);
+
+    struct recombine2d_worker worker;
+    fftw_plan BF_plan = recombine2d_bf_plan(&cfg, BF_batch, BF, FFTW_ESTIMATE);
+    recombine2d_init_worker(&worker, &cfg, BF_batch, BF_plan, FFTW_ESTIMATE);
+
+    int i0, i1;
+    for (i1 = 0; i1 < nsubgrid; i1++) {
+        for (i0 = 0; i0 < nsubgrid; i0++) {
+
+            // Reference without skipping
+            recombine2d_pf1_ft1_omp(&worker, facet, NULL, BF);
+            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, NULL, worker.NMBF_BF);
+            recombine2d_es0(&worker, i0*cfg.xA_size, i1*cfg.xA_size, worker.NMBF_BF, NMBF_NMBF);
+
+            // Retaining BF
+            recombine2d_pf1_ft1_omp(&worker, facet, F_rows, BF);
+            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, F_rows, worker.NMBF_BF);
+            recombine2d_es0(&worker, i0*cfg.xA_size, i1*cfg.xA_size, worker.NMBF_BF, NMBF_NMBF_s);
+            for (y = 0; y < cfg.xM_yN_size * cfg.xM_yN_size; y++)
+                assert(cabs(NMBF_NMBF[y] - NMBF_NMBF_s[y]) < 1e-12);
+
+            // Not retaining BF
+            recombine2d_pf1_ft1_es1_omp(&worker, i1*cfg.xA_size, facet, F_rows, NMBF);
+            recombine2d_pf0_ft0_omp(&worker, NMBF, worker.NMBF_BF);
+            recombine2d_es0(&worker, i0*cfg.xA_size, i1*cfg.xA_size, worker.NMBF_BF, NMBF_NMBF_s);
+            for (y = 0; y < cfg.xM_yN_size * cfg.xM_yN_size; y++)
+                assert(cabs(NMBF_NMBF[y] - NMBF_NMBF_s[y]) < 1e-12);
+        }
+    }
+
+    recombine2d_free_worker(&worker);
+    fftw_free(BF_plan);
+    recombine2d_free(&cfg);
+    free(facet); free(F_rows);
+    free(BF); free(NMBF); free(NMBF_NMBF); free(NMBF_NMBF_s);
+
+    return 0;
+}
+
 int T05_frac_coord()
 {
     double cs[] = {
@@ -411,6 +539,39 @@ int T05_frac_coord()
     return 0;
 }
 
+int T05_fft_shift()
+{
+    // Compare FFT + fft_shift against modulated, strided transform
+    const int grid_size = 32, grid_stride = grid_size + 16;
+    double complex *image = malloc(sizeof(double complex) * grid_size * grid_size);
+    double complex *ref = malloc(sizeof(double complex) * grid_size * grid_size);
+    double complex *grid = calloc(sizeof(double complex), grid_stride * grid_size);
+    fftw_plan ref_plan = fftw_plan_dft_2d(grid_size, grid_size, image, ref,
+                                          FFTW_BACKWARD, FFTW_ESTIMATE);
+    fftw_plan plan = fft_plan_strided_2d(grid_size, grid_stride, image, grid,
+                                         FFTW_BACKWARD, FFTW_ESTIMATE);
+
+    int x, y;
+    srand(12345);
+    for (y = 0; y < grid_size * grid_size; y++)
+        image[y] = (double)rand() / RAND_MAX - 0.5 + I * ((double)rand() / RAND_MAX - 0.5);
+    fftw_execute(ref_plan);
+    fft_shift(ref, grid_size);
+    fft_shift_modulate(image, grid_size, grid_size);
+    fftw_execute(plan);
+
+    for (y = 0; y < grid_size; y++) {
+        for (x = 0; x < grid_size; x++)
+            assert(cabs(grid[y * grid_stride + x] - ref[y * grid_size + x]) < 1e-12);
+        for (; x < grid_stride; x++)
+            assert(grid[y * grid_stride + x] == 0);
+    }
+
+    fftw_free(ref_plan); fftw_free(plan);
+    free(image); free(ref); free(grid);
+    return 0;
+}
+
 int T05_degrid()
 {
 
@@ -445,10 +606,10 @@ int T05_degrid()
 
         double complex *facet = read_hdf5(cfg.F_size, in_file, "j0=%d/j1=%d/facet", j0, j1);
 
-        recombine2d_pf1_ft1_omp(&worker, facet, BF);
+        recombine2d_pf1_ft1_omp(&worker, facet, NULL, BF);
         int i0, i1;
         for (i1 = 0; i1 < nsubgrid; i1++) {
-            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, worker.NMBF_BF);
+            recombine2d_es1_pf0_ft0(&worker, i1*cfg.xA_size, BF, NULL, worker.NMBF_BF);
             for (i0 = 0; i0 < nsubgrid; i0++) {
                 int ix = ((i1 * nsubgrid + i0) * nfacet + j0) * nfacet + j1;
                 double complex *nmbf_nmbf = all_NMBF_NMBF +
@@ -602,7 +763,10 @@ int main(int argc, char *argv[]) {
     RUN_TEST(T03_add_facet);
     RUN_TEST(T04_test_2d);
     RUN_TEST(T04a_recombine2d);
+    RUN_TEST(T04b_recombine2d_real);
+    RUN_TEST(T04c_recombine2d_sparse);
     RUN_TEST(T05_frac_coord);
+    RUN_TEST(T05_fft_shift);
     RUN_TEST(T05_degrid);
     RUN_TEST(T05_config);
 